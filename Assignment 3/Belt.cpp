@@ -0,0 +1,318 @@
+#include "Belt.h"
+#include "Parallel.h"
+#include "Random.h"
+#include "Stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <utility>
+
+static const float TwoPi = 6.28318531f;
+// the spread of the rocks about their lane, as the ring always had it
+static const float MaxEccentricity = 0.03f;
+static const float MaxInclination = 0.035f;
+static const float MinScale = 0.05f, MaxScale = 0.14f;
+// how far a rock gets from its mean longitude: twice the eccentricity
+// and a little (the equation of the centre), and less than the square of
+// the inclination from the tilt of its plane
+static const float LongitudeMargin = 2.5f * MaxEccentricity + MaxInclination * MaxInclination;
+static const size_t NoSlot = (size_t)-1;
+
+void AsteroidBelt::setup(const BeltSettings& settings)
+{
+    Settings = settings;
+    Chunks.clear();
+    Resident.clear();
+    Spheres.resize(0);
+    Lods.clear();
+    ResidentRocks = 0;
+
+    float laneWidth = 2.0f * settings.HalfWidth / Bands;
+    for (int band = 0; band < Bands; band++) {
+        BandSemiMajor[band] = settings.Radius - settings.HalfWidth + (band + 0.5f) * laneWidth;
+        BandMeanMotion[band] = meanMotion(BandSemiMajor[band], settings.GM);
+    }
+    Reach = BandSemiMajor[Bands - 1] * (1.0f + MaxEccentricity) + settings.RockRadius * MaxScale;
+
+    // each lane in Sectors sectors of equal length whatever the count, the
+    // rocks dealt round the cells of the grid in turn, so a cell holds
+    // every Cells-th rock and the count only adds or drops the last of each
+    const size_t cells = Bands * Sectors;
+    for (int band = 0; band < Bands; band++) {
+        for (size_t sector = 0; sector < Sectors; sector++) {
+            Chunk chunk;
+            chunk.Band = band;
+            chunk.Cell = band * Sectors + sector;
+            chunk.Count = settings.Rocks / cells + (chunk.Cell < settings.Rocks % cells ? 1 : 0);
+            chunk.Start = TwoPi * sector / Sectors;
+            chunk.End = TwoPi * (sector + 1) / Sectors;
+            if (chunk.Count == 0)
+                continue;
+            bound(chunk);
+            Chunks.push_back(std::move(chunk));
+        }
+    }
+    std::cout << "Asteroid belt: " << settings.Rocks << " rocks in " << Chunks.size() << " chunks, " << Bands << " lanes of "
+              << Sectors << " sectors, streamed within " << settings.StreamDistance << std::endl;
+}
+
+void AsteroidBelt::bound(Chunk& chunk) const
+{
+    // in the lane's frame, longitude 0 along x: the rocks stay between the
+    // lane's periapsis and apoapsis, within the inclination of the plane
+    // and within the margin of their chunk's longitudes
+    float semiMajor = BandSemiMajor[chunk.Band];
+    float inner = semiMajor * (1.0f - MaxEccentricity) * std::cos(MaxInclination);
+    float outer = semiMajor * (1.0f + MaxEccentricity);
+    float height = outer * std::sin(MaxInclination);
+    float half = std::min(0.5f * (chunk.End - chunk.Start) + LongitudeMargin, 0.5f * TwoPi);
+    chunk.Middle = 0.5f * (chunk.Start + chunk.End);
+
+    // centred on the middle longitude, the furthest points are the corners
+    float centre = 0.5f * (inner * std::cos(half) + outer);
+    float innerCorner = inner * inner + centre * centre - 2.0f * inner * centre * std::cos(half);
+    float outerCorner = outer * outer + centre * centre - 2.0f * outer * centre * std::cos(half);
+    chunk.CentreDistance = centre;
+    chunk.BoundRadius = std::sqrt(std::max(innerCorner, outerCorner) + height * height) + Settings.RockRadius * MaxScale;
+}
+
+OrbitElements AsteroidBelt::rock(const Chunk& chunk, size_t i) const
+{
+    // the rock's own stream, keyed on the seed and its index in the belt,
+    // which is its cell and its place there; its lane is the chunk's, its
+    // mean longitude within the chunk's
+    CounterRandom random(Settings.Seed, chunk.Cell + i * Bands * Sectors);
+    float longitude = chunk.Start + (chunk.End - chunk.Start) * random.unit();
+    OrbitElements orbit;
+    orbit.SemiMajor = BandSemiMajor[chunk.Band];
+    orbit.MeanMotion = BandMeanMotion[chunk.Band];
+    orbit.Eccentricity = MaxEccentricity * random.unit();
+    orbit.Inclination = MaxInclination * random.unit();
+    orbit.Node = TwoPi * random.unit();
+    orbit.Periapsis = TwoPi * random.unit();
+    // mean longitude is node plus periapsis plus mean anomaly
+    orbit.Phase = longitude - orbit.Node - orbit.Periapsis;
+
+    glm::vec3 axis(2.0f * random.unit() - 1.0f, 2.0f * random.unit() - 1.0f, 2.0f * random.unit() - 1.0f);
+    orbit.SpinAxis = glm::length(axis) > 0.01f ? axis : glm::vec3(0.4f, 0.5f, 0.8f);
+    orbit.Spin = TwoPi * random.unit();
+    orbit.SpinRate = random.unit() - 0.5f;
+    orbit.Scale = MinScale + (MaxScale - MinScale) * random.unit();
+    return orbit;
+}
+
+void AsteroidBelt::generate(Chunk& chunk) const
+{
+    // no rock depends on another, so they spread over the thread pool
+    // (or stay on this thread when chunks already have it)
+    chunk.Orbits.resize(chunk.Count);
+    parallelFor(chunk.Count, 1024, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            chunk.Orbits.set(i, rock(chunk, i));
+    });
+    chunk.Resident = true;
+}
+
+void AsteroidBelt::stream(const glm::vec3& eye, float time, size_t budget)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    // a quarter further out before going, so a chunk on the edge does not
+    // come and go every frame
+    float keep = Settings.StreamDistance * 1.25f;
+    std::vector<std::pair<float, size_t>> wanted;
+    bool dropped = false;
+    for (size_t i = 0; i < Chunks.size(); i++) {
+        Chunk& chunk = Chunks[i];
+        float longitude = chunk.Middle + BandMeanMotion[chunk.Band] * time;
+        chunk.Centre = chunk.CentreDistance * glm::vec3(std::cos(longitude), 0.0f, -std::sin(longitude));
+        float distance = glm::length(chunk.Centre - eye) - chunk.BoundRadius;
+        if (!chunk.Resident && distance < Settings.StreamDistance) {
+            wanted.push_back(std::make_pair(distance, i));
+        }
+        else if (chunk.Resident && distance > keep) {
+            chunk.Resident = false;
+            chunk.Orbits = OrbitSet();
+            Evicted++;
+            dropped = true;
+        }
+    }
+
+    std::sort(wanted.begin(), wanted.end());
+    std::vector<size_t> added;
+    size_t rocks = 0;
+    for (const std::pair<float, size_t>& chunk : wanted) {
+        size_t count = Chunks[chunk.second].Count;
+        if (!added.empty() && rocks + count > budget)
+            break;
+        added.push_back(chunk.second);
+        rocks += count;
+    }
+    parallelFor(added.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            generate(Chunks[added[i]]);
+    });
+    PagedIn += added.size();
+
+    if (dropped || !added.empty())
+        layOut(added);
+    StreamMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void AsteroidBelt::layOut(const std::vector<size_t>& added)
+{
+    // the chunks that stay keep their order and their rocks' levels, the new ones go after them
+    Resident.erase(std::remove_if(Resident.begin(), Resident.end(), [&](size_t i) { return !Chunks[i].Resident; }),
+                   Resident.end());
+    for (size_t i : added) {
+        Chunks[i].Slot = NoSlot;
+        Resident.push_back(i);
+    }
+
+    size_t slots = 0;
+    for (size_t i : Resident)
+        slots += (Chunks[i].Count + 7) / 8 * 8;
+    SphereSet spheres;
+    spheres.resize(slots);
+    std::vector<uint8_t> lods(slots, 0);
+    size_t slot = 0;
+    ResidentRocks = 0;
+    for (size_t i : Resident) {
+        Chunk& chunk = Chunks[i];
+        if (chunk.Slot != NoSlot)
+            std::copy(Lods.begin() + chunk.Slot, Lods.begin() + chunk.Slot + chunk.Count, lods.begin() + slot);
+        for (size_t rock = 0; rock < chunk.Count; rock++)
+            spheres.Radius[slot + rock] = Settings.RockRadius * chunk.Orbits.Scale[rock];
+        chunk.Slot = slot;
+        slot += (chunk.Count + 7) / 8 * 8;
+        ResidentRocks += chunk.Count;
+    }
+    Spheres = std::move(spheres);
+    Lods = std::move(lods);
+}
+
+void AsteroidBelt::evaluate(float time, float* matrices, float* packedSpheres)
+{
+    // a chunk per job, each evaluated on the thread that takes it
+    parallelFor(Resident.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            evaluateResident(i, time, matrices, packedSpheres);
+    });
+}
+
+SphereRange AsteroidBelt::residentSlots(size_t chunk) const
+{
+    const Chunk& resident = Chunks[Resident[chunk]];
+    return { resident.Slot, resident.Slot + (resident.Count + 7) / 8 * 8 };
+}
+
+bool AsteroidBelt::residentVisible(size_t chunk, const Frustum& frustum) const
+{
+    const Chunk& resident = Chunks[Resident[chunk]];
+    return frustum.intersectsSphere(resident.Centre, resident.BoundRadius);
+}
+
+void AsteroidBelt::evaluateResident(size_t chunk, float time, float* matrices, float* packedSpheres)
+{
+    const Chunk& resident = Chunks[Resident[chunk]];
+    evaluateOrbits(resident.Orbits, time, Spheres, resident.Slot, matrices, packedSpheres);
+}
+
+long AsteroidBelt::rockIndex(size_t slot) const
+{
+    auto after = std::upper_bound(Resident.begin(), Resident.end(), slot,
+                                  [&](size_t value, size_t chunk) { return value < Chunks[chunk].Slot; });
+    if (after == Resident.begin())
+        return -1;
+    const Chunk& chunk = Chunks[*(after - 1)];
+    size_t rock = slot - chunk.Slot;
+    return rock < chunk.Count ? (long)(chunk.Cell + rock * Bands * Sectors) : -1;
+}
+
+void AsteroidBelt::reportStats()
+{
+    // the orbits, sphere and level of every resident slot
+    const double MB = 1024.0 * 1024.0;
+    size_t slotBytes = 17 * sizeof(float) + 4 * sizeof(float) + sizeof(uint8_t);
+    frameStats.set("belt.resident_chunks", (double)Resident.size());
+    frameStats.set("belt.resident_rocks", (double)ResidentRocks);
+    frameStats.set("belt.resident_mb", slots() * slotBytes / MB);
+    frameStats.add("belt.paged_in", (double)PagedIn);
+    frameStats.add("belt.evicted", (double)Evicted);
+    frameStats.add("belt.stream_ms", StreamMs);
+    PagedIn = 0;
+    Evicted = 0;
+    StreamMs = 0.0;
+}
+
+void benchmarkBelt(size_t count)
+{
+    // a belt like the scene's, all of it at once
+    BeltSettings settings;
+    settings.Rocks = count;
+    settings.GM = 0.2f * 0.2f * 216.0f;
+    settings.StreamDistance = 1e30f;
+    AsteroidBelt belt;
+    auto start = std::chrono::steady_clock::now();
+    belt.setup(settings);
+    double setupMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    belt.stream(glm::vec3(0.0f), 0.0f, (size_t)-1);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    belt.evaluate(0.0f, nullptr, nullptr);
+
+    // the part of it near a point on the ring again, a chunk at a time, so
+    // in another order and on other threads
+    settings.StreamDistance = 1.0f;
+    AsteroidBelt again;
+    again.setup(settings);
+    for (int step = 0; step < 64; step++)
+        again.stream(glm::vec3(settings.Radius, 0.0f, 0.0f), 0.0f, 1);
+    again.evaluate(0.0f, nullptr, nullptr);
+
+    std::vector<size_t> slots(count);
+    for (size_t slot = 0; slot < belt.slots(); slot++) {
+        long rock = belt.rockIndex(slot);
+        if (rock >= 0)
+            slots[rock] = slot;
+    }
+    const SphereSet& first = belt.spheres();
+    const SphereSet& second = again.spheres();
+    size_t compared = 0, differ = 0;
+    for (size_t slot = 0; slot < again.slots(); slot++) {
+        long rock = again.rockIndex(slot);
+        if (rock < 0)
+            continue;
+        size_t other = slots[rock];
+        compared++;
+        if (first.X[other] != second.X[slot] || first.Y[other] != second.Y[slot] || first.Z[other] != second.Z[slot] ||
+            first.Radius[other] != second.Radius[slot])
+            differ++;
+    }
+    // and near the same point in a belt of twice as many, where the first
+    // count rocks have to be the same rocks in the same places
+    settings.Rocks = 2 * count;
+    AsteroidBelt doubled;
+    doubled.setup(settings);
+    for (int step = 0; step < 64; step++)
+        doubled.stream(glm::vec3(settings.Radius, 0.0f, 0.0f), 0.0f, 1);
+    doubled.evaluate(0.0f, nullptr, nullptr);
+    const SphereSet& third = doubled.spheres();
+    size_t shared = 0, moved = 0;
+    for (size_t slot = 0; slot < doubled.slots(); slot++) {
+        long rock = doubled.rockIndex(slot);
+        if (rock < 0 || (size_t)rock >= count)
+            continue;
+        size_t other = slots[rock];
+        shared++;
+        if (first.X[other] != third.X[slot] || first.Y[other] != third.Y[slot] || first.Z[other] != third.Z[slot] ||
+            first.Radius[other] != third.Radius[slot])
+            moved++;
+    }
+
+    std::cout << "Ring " << count << " rocks set up in " << setupMs << " ms, generated in " << ms << " ms ("
+              << count / ms / 1e3 << " Mrocks/s on " << ThreadPool::instance().threadCount() << " threads); " << compared << " generated again apart, " << differ
+              << " differ; " << shared << " of them in a ring of " << 2 * count << ", " << moved << " differ" << std::endl;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "Culling.h"
+#include "Orbits.h"
+#include "./Dependencies/glm/glm.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// What a belt is made of: Rocks rocks on near circular orbits with
+// semi-major axes from Radius - HalfWidth to Radius + HalfWidth, every
+// orbit's speed set by GM, the central body's gravitational parameter.
+struct BeltSettings {
+    size_t Rocks = 0;
+    float Radius = 6.0f;
+    float HalfWidth = 0.5f;
+    float GM = 1.0f;
+    // the rock mesh's bounding radius, each rock scales it by its own scale
+    float RockRadius = 1.0f;
+    // chunks come in nearer the eye than this and go a quarter further out
+    float StreamDistance = 100.0f;
+    uint32_t Seed = 1;
+};
+
+// An asteroid belt in chunks, each generated when the eye comes near it and
+// dropped when it goes, so memory follows the region around the eye and not
+// the size of the belt. The belt is cut into Bands lanes of semi-major axis
+// and each lane into sectors of mean longitude. Every rock of a lane shares
+// its semi-major axis, so the lane turns as one with the lane's mean motion;
+// a rock's eccentricity and inclination only carry it a bounded way from
+// its chunk, whose bounds therefore hold for good in the turning frame of
+// its lane. The grid of chunks is fixed, Sectors to a lane whatever the
+// count, and rock k belongs to cell k mod Bands * Sectors, so which rocks a
+// chunk holds takes no memory and a change of count only adds or drops the
+// last rocks of each chunk. Every rock draws from a counter-based generator
+// keyed on the seed and its index, so rocks are generated independently,
+// in parallel, and come out the same whenever, wherever and on however many
+// threads they are, and rock k is the same rock in a belt of any size.
+//
+// The resident rocks live in one sphere set, a chunk after another, each
+// from a multiple of 8 and padded with spheres that are never visible; a
+// rock's place there is its slot, what culling, levels of detail and the
+// matrices drawn go by. Slots change as chunks come and go.
+class AsteroidBelt
+{
+public:
+    // lanes across the belt, and sectors of mean longitude along a lane
+    static const int Bands = 16;
+    static const size_t Sectors = 64;
+
+    void setup(const BeltSettings& settings);
+
+    // brings in the chunks within reach of eye at time, nearest first and
+    // no more than budget rocks of them (at least one chunk), and drops
+    // those out of reach
+    void stream(const glm::vec3& eye, float time, size_t budget);
+    // every resident rock at time, as evaluateOrbits does with slots
+    void evaluate(float time, float* matrices, float* packedSpheres);
+
+    // the resident chunks one by one, in slot order, for jobs that take a
+    // chunk each: its slots, whether its bounds touch the frustum as of the
+    // last stream(), and its rocks evaluated as evaluate() does them all
+    size_t residentChunks() const { return Resident.size(); }
+    SphereRange residentSlots(size_t chunk) const;
+    bool residentVisible(size_t chunk, const Frustum& frustum) const;
+    void evaluateResident(size_t chunk, float time, float* matrices, float* packedSpheres);
+
+    const SphereSet& spheres() const { return Spheres; }
+    // each slot's level of detail, moved along with its chunk
+    std::vector<uint8_t>& lods() { return Lods; }
+    size_t slots() const { return Spheres.X.size(); }
+    size_t rocks() const { return Settings.Rocks; }
+    size_t residentRocks() const { return ResidentRocks; }
+    // the index in the whole belt of the rock in slot, -1 for padding
+    long rockIndex(size_t slot) const;
+    // how far from the centre any rock gets
+    float reach() const { return Reach; }
+
+    // belt.* stats since the last call
+    void reportStats();
+
+private:
+    struct Chunk {
+        int Band = 0;
+        // its place in the grid, lane by lane; its i-th rock is rock
+        // Cell + i * Bands * Sectors of the belt
+        size_t Cell = 0, Count = 0;
+        // the mean longitudes it holds in its lane's frame
+        float Start = 0.0f, End = 0.0f;
+        // its bounding sphere in that frame, centred on longitude Middle
+        float Middle = 0.0f, CentreDistance = 0.0f, BoundRadius = 0.0f;
+        // and in the world as of the last stream()
+        glm::vec3 Centre = glm::vec3(0.0f);
+
+        bool Resident = false;
+        size_t Slot = 0;
+        OrbitSet Orbits;
+    };
+
+    BeltSettings Settings;
+    float BandSemiMajor[Bands], BandMeanMotion[Bands];
+    float Reach = 0.0f;
+    std::vector<Chunk> Chunks;
+    // resident chunks in slot order
+    std::vector<size_t> Resident;
+    SphereSet Spheres;
+    std::vector<uint8_t> Lods;
+    size_t ResidentRocks = 0;
+
+    size_t PagedIn = 0, Evicted = 0;
+    double StreamMs = 0.0;
+
+    void bound(Chunk& chunk) const;
+    OrbitElements rock(const Chunk& chunk, size_t i) const;
+    void generate(Chunk& chunk) const;
+    void layOut(const std::vector<size_t>& added);
+};
+
+// --bench-ring: times generating a belt of count rocks, then checks that
+// rocks generated again in another order, and in a belt of twice as many,
+// come out the same
+void benchmarkBelt(size_t count);
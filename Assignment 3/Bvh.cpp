@@ -0,0 +1,305 @@
+#include "Bvh.h"
+#include "Culling.h"
+
+#include <algorithm>
+
+namespace {
+
+// -1 outside, 1 inside, 0 crossing; planes the box is fully inside of are cleared from the mask
+int classify(const Frustum& frustum, const glm::vec3& min, const glm::vec3& max, int& planes)
+{
+    glm::vec3 centre = (min + max) * 0.5f, extent = (max - min) * 0.5f;
+    for (int p = 0; p < 6; p++) {
+        if (!(planes & (1 << p)))
+            continue;
+        const glm::vec4& plane = frustum.Planes[p];
+        float distance = glm::dot(glm::vec3(plane), centre) + plane.w;
+        float reach = glm::dot(glm::abs(glm::vec3(plane)), extent);
+        if (distance < -reach)
+            return -1;
+        if (distance >= reach)
+            planes &= ~(1 << p);
+    }
+    return planes == 0 ? 1 : 0;
+}
+
+bool boxTouchesSphere(const glm::vec3& min, const glm::vec3& max, const glm::vec3& centre, float radiusSquared)
+{
+    glm::vec3 offset = glm::clamp(centre, min, max) - centre;
+    return glm::dot(offset, offset) <= radiusSquared;
+}
+
+const uint32_t MaxLeafItems = 4;
+const int SahBins = 12;
+// traversal stack size, the build stops splitting before it
+const int MaxDepth = 64;
+
+Aabb nodeBox(const BvhNode& node)
+{
+    Aabb box;
+    box.Min = node.Min;
+    box.Max = node.Max;
+    return box;
+}
+
+bool rayHitsBox(const glm::vec3& origin, const glm::vec3& inverseDirection, const BvhNode& node, float maxT, float& entry)
+{
+    glm::vec3 t0 = (node.Min - origin) * inverseDirection;
+    glm::vec3 t1 = (node.Max - origin) * inverseDirection;
+    glm::vec3 near = glm::min(t0, t1), far = glm::max(t0, t1);
+    entry = std::max(std::max(near.x, near.y), std::max(near.z, 0.0f));
+    float exit = std::min(std::min(far.x, far.y), std::min(far.z, maxT));
+    return entry <= exit;
+}
+
+} // namespace
+
+struct Bvh::BuildItem {
+    Aabb Box;
+    glm::vec3 Centre;
+    uint32_t Index;
+};
+
+void Bvh::build(const std::vector<Aabb>& bounds)
+{
+    Nodes.clear();
+    Items.resize(bounds.size());
+    ItemBounds.resize(bounds.size());
+    if (bounds.empty())
+        return;
+    // boxes and centroids travel with the items, so the splits stream through memory
+    std::vector<BuildItem> work(bounds.size());
+    for (uint32_t i = 0; i < bounds.size(); i++) {
+        work[i].Box = bounds[i];
+        work[i].Centre = bounds[i].centre();
+        work[i].Index = i;
+    }
+    Nodes.reserve(bounds.size() * 2 / MaxLeafItems + 1);
+    buildNode(work, 0, (uint32_t)bounds.size(), 0);
+    for (size_t i = 0; i < work.size(); i++) {
+        Items[i] = work[i].Index;
+        ItemBounds[i] = work[i].Box;
+    }
+    BuildArea = totalArea();
+}
+
+void Bvh::buildNode(std::vector<BuildItem>& work, uint32_t first, uint32_t count, int depth)
+{
+    uint32_t index = (uint32_t)Nodes.size();
+    Nodes.push_back(BvhNode());
+
+    Aabb box, centroidBox;
+    for (uint32_t i = first; i < first + count; i++) {
+        box.grow(work[i].Box);
+        centroidBox.grow(work[i].Centre);
+    }
+    Nodes[index].Min = box.Min;
+    Nodes[index].Max = box.Max;
+
+    // best split over the binned centroids of every axis
+    int bestAxis = -1, bestBin = 0;
+    float bestCost = box.surfaceArea() * count;
+    if (count > MaxLeafItems && depth < MaxDepth - 2) {
+        for (int axis = 0; axis < 3; axis++) {
+            float low = centroidBox.Min[axis], extent = centroidBox.Max[axis] - low;
+            if (extent <= 0.0f)
+                continue;
+            Aabb binBoxes[SahBins];
+            uint32_t binCounts[SahBins] = {};
+            float scale = SahBins / extent;
+            for (uint32_t i = first; i < first + count; i++) {
+                int bin = std::min(SahBins - 1, (int)((work[i].Centre[axis] - low) * scale));
+                binBoxes[bin].grow(work[i].Box);
+                binCounts[bin]++;
+            }
+            // sweep from the right, then evaluate every plane sweeping from the left
+            float rightArea[SahBins];
+            uint32_t rightCount[SahBins];
+            Aabb sweep;
+            uint32_t swept = 0;
+            for (int bin = SahBins - 1; bin > 0; bin--) {
+                sweep.grow(binBoxes[bin]);
+                swept += binCounts[bin];
+                rightArea[bin] = sweep.surfaceArea();
+                rightCount[bin] = swept;
+            }
+            sweep = Aabb();
+            swept = 0;
+            for (int bin = 0; bin < SahBins - 1; bin++) {
+                sweep.grow(binBoxes[bin]);
+                swept += binCounts[bin];
+                if (swept == 0 || rightCount[bin + 1] == 0)
+                    continue;
+                float cost = sweep.surfaceArea() * swept + rightArea[bin + 1] * rightCount[bin + 1];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = bin;
+                }
+            }
+        }
+    }
+
+    if (bestAxis < 0) {
+        Nodes[index].Index = first;
+        Nodes[index].Count = count;
+        return;
+    }
+
+    float low = centroidBox.Min[bestAxis];
+    float scale = SahBins / (centroidBox.Max[bestAxis] - low);
+    BuildItem* middle = std::partition(work.data() + first, work.data() + first + count, [&](const BuildItem& item) {
+        return std::min(SahBins - 1, (int)((item.Centre[bestAxis] - low) * scale)) <= bestBin;
+    });
+    uint32_t leftCount = (uint32_t)(middle - (work.data() + first));
+
+    Nodes[index].Count = 0;
+    buildNode(work, first, leftCount, depth + 1);
+    Nodes[index].Index = (uint32_t)Nodes.size();
+    buildNode(work, first + leftCount, count - leftCount, depth + 1);
+}
+
+float Bvh::refit(const std::vector<Aabb>& bounds)
+{
+    // children always follow their parent, so walking backwards visits them first
+    for (size_t i = Nodes.size(); i-- > 0;) {
+        BvhNode& node = Nodes[i];
+        Aabb box;
+        if (node.Count > 0) {
+            for (uint32_t item = node.Index; item < node.Index + node.Count; item++) {
+                ItemBounds[item] = bounds[Items[item]];
+                box.grow(ItemBounds[item]);
+            }
+        }
+        else {
+            box.grow(nodeBox(Nodes[i + 1]));
+            box.grow(nodeBox(Nodes[node.Index]));
+        }
+        node.Min = box.Min;
+        node.Max = box.Max;
+    }
+    return BuildArea > 0.0f ? totalArea() / BuildArea : 1.0f;
+}
+
+float Bvh::totalArea() const
+{
+    float area = 0.0f;
+    for (const BvhNode& node : Nodes)
+        area += nodeBox(node).surfaceArea();
+    return area;
+}
+
+void Bvh::queryFrustum(const Frustum& frustum, std::vector<uint32_t>& items) const
+{
+    if (Nodes.empty())
+        return;
+    // bit p of a mask set: the box may still cross plane p
+    struct Entry { uint32_t Node; int Planes; };
+    Entry stack[MaxDepth];
+    int size = 0;
+    stack[size++] = { 0, 0x3F };
+    while (size > 0) {
+        Entry entry = stack[--size];
+        const BvhNode& node = Nodes[entry.Node];
+        int planes = entry.Planes;
+        if (classify(frustum, node.Min, node.Max, planes) < 0)
+            continue;
+
+        if (node.Count > 0 && planes != 0) {
+            for (uint32_t i = node.Index; i < node.Index + node.Count; i++) {
+                int itemPlanes = planes;
+                if (classify(frustum, ItemBounds[i].Min, ItemBounds[i].Max, itemPlanes) >= 0)
+                    items.push_back(Items[i]);
+            }
+        }
+        else if (planes == 0) {
+            // a subtree's items are contiguous, from its leftmost to its rightmost leaf
+            uint32_t first = entry.Node, last = entry.Node;
+            while (Nodes[first].Count == 0)
+                first++;
+            while (Nodes[last].Count == 0)
+                last = Nodes[last].Index;
+            items.insert(items.end(), Items.begin() + Nodes[first].Index, Items.begin() + Nodes[last].Index + Nodes[last].Count);
+        }
+        else {
+            stack[size++] = { node.Index, planes };
+            stack[size++] = { entry.Node + 1, planes };
+        }
+    }
+}
+
+void Bvh::querySphere(const glm::vec3& centre, float radius, std::vector<uint32_t>& items) const
+{
+    if (Nodes.empty())
+        return;
+    uint32_t stack[MaxDepth];
+    int size = 0;
+    stack[size++] = 0;
+    float radiusSquared = radius * radius;
+    while (size > 0) {
+        const BvhNode& node = Nodes[stack[--size]];
+        if (!boxTouchesSphere(node.Min, node.Max, centre, radiusSquared))
+            continue;
+        if (node.Count > 0) {
+            for (uint32_t i = node.Index; i < node.Index + node.Count; i++)
+                if (boxTouchesSphere(ItemBounds[i].Min, ItemBounds[i].Max, centre, radiusSquared))
+                    items.push_back(Items[i]);
+        }
+        else {
+            stack[size++] = node.Index;
+            stack[size++] = (uint32_t)(&node - Nodes.data()) + 1;
+        }
+    }
+}
+
+int Bvh::raycast(const glm::vec3& origin, const glm::vec3& direction, float maxT, const RayItemFunc& hitItem, float& hitT) const
+{
+    int hit = -1;
+    hitT = maxT;
+    if (Nodes.empty())
+        return hit;
+    glm::vec3 inverseDirection = 1.0f / direction;
+
+    uint32_t stack[MaxDepth];
+    int size = 0;
+    float entry;
+    if (rayHitsBox(origin, inverseDirection, Nodes[0], hitT, entry))
+        stack[size++] = 0;
+    while (size > 0) {
+        uint32_t index = stack[--size];
+        const BvhNode& node = Nodes[index];
+        // boxes are tested before they are pushed, but a closer hit may have been found since
+        if (!rayHitsBox(origin, inverseDirection, node, hitT, entry))
+            continue;
+
+        if (node.Count > 0) {
+            for (uint32_t i = node.Index; i < node.Index + node.Count; i++) {
+                float t;
+                if (hitItem(Items[i], hitT, t) && t < hitT) {
+                    hitT = t;
+                    hit = (int)Items[i];
+                }
+            }
+            continue;
+        }
+
+        uint32_t left = index + 1, right = node.Index;
+        float leftEntry, rightEntry;
+        bool hitLeft = rayHitsBox(origin, inverseDirection, Nodes[left], hitT, leftEntry);
+        bool hitRight = rayHitsBox(origin, inverseDirection, Nodes[right], hitT, rightEntry);
+        // the nearer child goes on top
+        if (hitLeft && hitRight) {
+            if (leftEntry < rightEntry)
+                std::swap(left, right);
+            stack[size++] = left;
+            stack[size++] = right;
+        }
+        else if (hitLeft) {
+            stack[size++] = left;
+        }
+        else if (hitRight) {
+            stack[size++] = right;
+        }
+    }
+    return hit;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "./Dependencies/glm/glm.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+struct Frustum;
+
+struct Aabb {
+    glm::vec3 Min = glm::vec3(1e30f);
+    glm::vec3 Max = glm::vec3(-1e30f);
+
+    static Aabb fromSphere(const glm::vec3& centre, float radius)
+    {
+        Aabb box;
+        box.Min = centre - glm::vec3(radius);
+        box.Max = centre + glm::vec3(radius);
+        return box;
+    }
+
+    void grow(const glm::vec3& point) { Min = glm::min(Min, point); Max = glm::max(Max, point); }
+    void grow(const Aabb& box) { Min = glm::min(Min, box.Min); Max = glm::max(Max, box.Max); }
+    glm::vec3 centre() const { return (Min + Max) * 0.5f; }
+    float surfaceArea() const
+    {
+        glm::vec3 size = glm::max(Max - Min, glm::vec3(0.0f));
+        return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+};
+
+// nearest t in [0, maxT) where the ray meets the sphere, from inside it that is the exit
+inline bool intersectRaySphere(const glm::vec3& origin, const glm::vec3& direction, const glm::vec3& centre, float radius,
+                               float maxT, float& t)
+{
+    glm::vec3 offset = origin - centre;
+    float a = glm::dot(direction, direction);
+    float b = glm::dot(offset, direction);
+    float c = glm::dot(offset, offset) - radius * radius;
+    float discriminant = b * b - a * c;
+    if (discriminant < 0.0f)
+        return false;
+    float root = std::sqrt(discriminant);
+    float hit = (-b - root) / a;
+    if (hit < 0.0f)
+        hit = (-b + root) / a;
+    if (hit < 0.0f || hit >= maxT)
+        return false;
+    t = hit;
+    return true;
+}
+
+// 32 bytes, two to a cache line. Nodes are stored depth first, so the left
+// child of an inner node is the next node and only the right one is indexed.
+struct BvhNode {
+    glm::vec3 Min;
+    uint32_t Index;  // leaf: first entry of Items, inner node: right child
+    glm::vec3 Max;
+    uint32_t Count;  // items in a leaf, 0 for inner nodes
+};
+
+// Bounding volume hierarchy over caller-owned items identified by index.
+// Built top down with the surface area heuristic over binned centroids;
+// moving items are handled by refitting the boxes bottom up, which keeps the
+// topology, and rebuilding once the tree has grown too loose.
+class Bvh
+{
+public:
+    // exact test of the ray against one item, true with t when it hits closer than maxT
+    typedef std::function<bool(uint32_t item, float maxT, float& t)> RayItemFunc;
+
+    void build(const std::vector<Aabb>& bounds);
+    // same items with new bounds; returns the summed node area relative to
+    // the last build, a tree past ~2 is worth rebuilding
+    float refit(const std::vector<Aabb>& bounds);
+
+    // items whose boxes touch the frustum; subtrees fully inside are taken without further tests
+    // (results are appended, in no particular order)
+    void queryFrustum(const Frustum& frustum, std::vector<uint32_t>& items) const;
+    void querySphere(const glm::vec3& centre, float radius, std::vector<uint32_t>& items) const;
+    // closest item along the ray, nearer subtrees first; item is -1 on a miss
+    int raycast(const glm::vec3& origin, const glm::vec3& direction, float maxT, const RayItemFunc& hitItem, float& hitT) const;
+
+    const std::vector<BvhNode>& nodes() const { return Nodes; }
+    bool empty() const { return Nodes.empty(); }
+
+private:
+    std::vector<BvhNode> Nodes;
+    std::vector<uint32_t> Items;
+    // copy of the item boxes in Items order, for exact tests at the leaves
+    std::vector<Aabb> ItemBounds;
+    float BuildArea = 0.0f;
+
+    struct BuildItem;
+    void buildNode(std::vector<BuildItem>& work, uint32_t first, uint32_t count, int depth);
+    float totalArea() const;
+};
@@ -0,0 +1,89 @@
+#include "CommandList.h"
+#include "RenderQueue.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+static const uint32_t EntryMask = (1u << (32 - CommandRecorder::ListBits)) - 1;
+
+// frames of every recorder are numbered from one counter, so a thread's
+// cached list can never be mistaken for one of a later frame
+static std::atomic<unsigned long> frameCounter(0);
+
+struct LocalList {
+    const CommandRecorder* Recorder;
+    unsigned long Frame;
+    CommandList* List;
+};
+static thread_local LocalList localList = { nullptr, 0, nullptr };
+
+void CommandList::record(uint64_t key, uint32_t type, const void* data, size_t size)
+{
+    Entry entry;
+    entry.Key = key;
+    entry.Type = type;
+    entry.Offset = (uint32_t)Blocks.size();
+    Entries.push_back(entry);
+    Blocks.resize(Blocks.size() + (size + sizeof(Block) - 1) / sizeof(Block));
+    memcpy(&Blocks[entry.Offset], data, size);
+}
+
+void CommandList::clear()
+{
+    Entries.clear();
+    Blocks.clear();
+}
+
+void CommandRecorder::begin()
+{
+    for (size_t i = 0; i < Used; i++)
+        Lists[i]->clear();
+    Used = 0;
+    Frame = ++frameCounter;
+}
+
+CommandList& CommandRecorder::local()
+{
+    if (localList.Recorder == this && localList.Frame == Frame)
+        return *localList.List;
+
+    std::lock_guard<std::mutex> lock(Mutex);
+    if (Used == (size_t)MaxLists) {
+        std::cout << "More than " << MaxLists << " threads recording commands" << std::endl;
+        exit(1);
+    }
+    if (Used == Lists.size())
+        Lists.emplace_back(new CommandList());
+    CommandList* list = Lists[Used++].get();
+    localList.Recorder = this;
+    localList.Frame = Frame;
+    localList.List = list;
+    return *list;
+}
+
+void CommandRecorder::merge(RenderQueue& queue) const
+{
+    for (size_t list = 0; list < Used; list++) {
+        const CommandList& commands = *Lists[list];
+        for (size_t i = 0; i < commands.size(); i++)
+            queue.submit(commands.entry(i).Key, (uint32_t)(list << (32 - ListBits)) | (uint32_t)i);
+    }
+}
+
+const void* CommandRecorder::command(uint32_t payload, uint32_t& type) const
+{
+    const CommandList& commands = *Lists[payload >> (32 - ListBits)];
+    const CommandList::Entry& entry = commands.entry(payload & EntryMask);
+    type = entry.Type;
+    return commands.data(entry.Offset);
+}
+
+size_t CommandRecorder::commandCount() const
+{
+    size_t count = 0;
+    for (size_t i = 0; i < Used; i++)
+        count += Lists[i]->size();
+    return count;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class RenderQueue;
+
+// Render commands recorded without touching the graphics API: each is a
+// sort key, a type and a block of plain data (the draw and its uniform
+// payload) that the thread owning the context interprets on replay. Data is
+// copied into one linear buffer in 16 byte blocks, so recording is an append
+// and the memory is reused from frame to frame. One thread writes a list at
+// a time.
+class CommandList
+{
+public:
+    struct Entry {
+        uint64_t Key;
+        uint32_t Type;
+        uint32_t Offset;    // in blocks
+    };
+
+    template <typename T>
+    void record(uint64_t key, uint32_t type, const T& data)
+    {
+        record(key, type, &data, sizeof(T));
+    }
+    void record(uint64_t key, uint32_t type, const void* data, size_t size);
+    void clear();
+
+    size_t size() const { return Entries.size(); }
+    const Entry& entry(size_t i) const { return Entries[i]; }
+    const void* data(uint32_t offset) const { return &Blocks[offset]; }
+
+private:
+    struct alignas(16) Block {
+        unsigned char Bytes[16];
+    };
+
+    std::vector<Entry> Entries;
+    std::vector<Block> Blocks;
+};
+
+// A frame's command lists, one per recording thread so workers never share
+// one. The submitting thread calls begin(), lets the workers record into
+// local(), then merges every list into a RenderQueue and replays it in key
+// order through command().
+class CommandRecorder
+{
+public:
+    // list index and entry index share a queue payload
+    static const int ListBits = 8;
+    static const int MaxLists = 1 << ListBits;
+
+    // empties the lists of the last frame
+    void begin();
+    // the calling thread's list for this frame, made on first use
+    CommandList& local();
+
+    void merge(RenderQueue& queue) const;
+    // the data and type of the command a queue payload points at
+    const void* command(uint32_t payload, uint32_t& type) const;
+
+    // lists recorded into and commands in them since begin()
+    size_t listCount() const { return Used; }
+    size_t commandCount() const;
+
+private:
+    std::vector<std::unique_ptr<CommandList>> Lists;
+    size_t Used = 0;
+    unsigned long Frame = 0;
+    std::mutex Mutex;
+};
@@ -0,0 +1,219 @@
+#include "Culling.h"
+#include "Parallel.h"
+#include "Simd.h"
+
+#include "./Dependencies/glm/gtc/matrix_transform.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+
+Frustum Frustum::fromMatrix(const glm::mat4& clipFromSpace)
+{
+    // rows of the matrix, glm stores columns
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; i++)
+        rows[i] = glm::vec4(clipFromSpace[0][i], clipFromSpace[1][i], clipFromSpace[2][i], clipFromSpace[3][i]);
+
+    // -w <= x, y, z <= w
+    Frustum frustum;
+    frustum.Planes[0] = rows[3] + rows[0];
+    frustum.Planes[1] = rows[3] - rows[0];
+    frustum.Planes[2] = rows[3] + rows[1];
+    frustum.Planes[3] = rows[3] - rows[1];
+    frustum.Planes[4] = rows[3] + rows[2];
+    frustum.Planes[5] = rows[3] - rows[2];
+    for (glm::vec4& plane : frustum.Planes)
+        plane /= glm::length(glm::vec3(plane));
+    return frustum;
+}
+
+bool Frustum::intersectsSphere(const glm::vec3& centre, float radius) const
+{
+    for (const glm::vec4& plane : Planes)
+        if (glm::dot(glm::vec3(plane), centre) + plane.w < -radius)
+            return false;
+    return true;
+}
+
+void SphereSet::resize(size_t count)
+{
+    Count = count;
+    size_t padded = (count + 7) / 8 * 8;
+    X.assign(padded, 0.0f);
+    Y.assign(padded, 0.0f);
+    Z.assign(padded, 0.0f);
+    // no plane distance is ever below minus this
+    Radius.assign(padded, -1e30f);
+}
+
+void SphereSet::set(size_t index, const glm::vec3& centre, float radius)
+{
+    X[index] = centre.x;
+    Y[index] = centre.y;
+    Z[index] = centre.z;
+    Radius[index] = radius;
+}
+
+#if SIMD_AVX2
+// for every 8 bit mask, the lanes of its set bits packed to the front, one per byte
+struct CompactTable {
+    uint64_t Lanes[256];
+    uint8_t Counts[256];
+
+    CompactTable()
+    {
+        for (int mask = 0; mask < 256; mask++) {
+            uint64_t lanes = 0;
+            int count = 0;
+            for (int lane = 0; lane < 8; lane++)
+                if (mask & (1 << lane))
+                    lanes |= (uint64_t)lane << (8 * count++);
+            Lanes[mask] = lanes;
+            Counts[mask] = (uint8_t)count;
+        }
+    }
+};
+
+static const CompactTable compactTable;
+#endif
+
+// Compacts the visible indices of [begin, end) to block. The n-th visible
+// sphere is never past the n-th sphere, so every write stays within
+// end - begin of block and blocks can run concurrently on one output array.
+static size_t cullBlock(const Frustum& frustum, const SphereSet& spheres, size_t begin, size_t end, uint32_t* block)
+{
+    float8 a[6], b[6], c[6], d[6];
+    for (int p = 0; p < 6; p++) {
+        a[p] = float8(frustum.Planes[p].x);
+        b[p] = float8(frustum.Planes[p].y);
+        c[p] = float8(frustum.Planes[p].z);
+        d[p] = float8(frustum.Planes[p].w);
+    }
+
+    size_t visible = 0;
+    for (size_t i = begin; i < end; i += 8) {
+        float8 x = float8::load(&spheres.X[i]), y = float8::load(&spheres.Y[i]), z = float8::load(&spheres.Z[i]);
+        float8 negRadius = -float8::load(&spheres.Radius[i]);
+        float8 inside = fmadd(a[0], x, fmadd(b[0], y, fmadd(c[0], z, d[0]))) >= negRadius;
+        for (int p = 1; p < 6; p++)
+            inside = inside & (fmadd(a[p], x, fmadd(b[p], y, fmadd(c[p], z, d[p]))) >= negRadius);
+
+        // branchless: write 8 lanes, advance only past the visible ones
+        int mask = moveMask(inside);
+#if SIMD_AVX2
+        __m256i lanes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&compactTable.Lanes[mask]));
+        _mm256_storeu_si256((__m256i*)(block + visible), _mm256_add_epi32(lanes, _mm256_set1_epi32((int)i)));
+        visible += compactTable.Counts[mask];
+#else
+        for (int lane = 0; lane < 8; lane++) {
+            block[visible] = (uint32_t)(i + lane);
+            visible += (mask >> lane) & 1;
+        }
+#endif
+    }
+    return visible;
+}
+
+size_t cullSpheres(const Frustum& frustum, const SphereSet& spheres, std::vector<uint32_t>& visible)
+{
+    return cullSpheres(frustum, spheres, { { 0, spheres.X.size() } }, visible);
+}
+
+size_t cullSpheres(const Frustum& frustum, const SphereSet& spheres, const std::vector<SphereRange>& ranges,
+                   std::vector<uint32_t>& visible)
+{
+    // the ranges cut into blocks of at most grain spheres
+    const size_t grain = 8192;
+    std::vector<SphereRange> blocks;
+    for (const SphereRange& range : ranges)
+        for (size_t begin = range.Begin; begin < range.End; begin += grain)
+            blocks.push_back({ begin, std::min(begin + grain, range.End) });
+    visible.resize(spheres.X.size());
+    std::vector<size_t> counts(blocks.size(), 0);
+
+    parallelFor(blocks.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t block = begin; block < end; block++)
+            counts[block] = cullBlock(frustum, spheres, blocks[block].Begin, blocks[block].End, visible.data() + blocks[block].Begin);
+    });
+
+    // close the gaps between blocks, in order
+    size_t total = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        memmove(visible.data() + total, visible.data() + blocks[i].Begin, counts[i] * sizeof(uint32_t));
+        total += counts[i];
+    }
+    visible.resize(total);
+    return total;
+}
+
+size_t cullRange(const Frustum& frustum, const SphereSet& spheres, const SphereRange& range, uint32_t* out)
+{
+    return cullBlock(frustum, spheres, range.Begin, range.End, out);
+}
+
+static size_t countBlockNear(const SphereSet& spheres, size_t begin, size_t end, const glm::vec3& point, float distance)
+{
+    const float8 px(point.x), py(point.y), pz(point.z), reach(distance);
+    size_t near = 0;
+    for (size_t i = begin; i < end; i += 8) {
+        float8 dx = float8::load(&spheres.X[i]) - px, dy = float8::load(&spheres.Y[i]) - py, dz = float8::load(&spheres.Z[i]) - pz;
+        // padding has a negative radius, so its reach never gets past 0
+        float8 r = float8::load(&spheres.Radius[i]) + reach;
+        float8 inside = (fmadd(dx, dx, fmadd(dy, dy, dz * dz)) <= r * r) & (r > float8(0.0f));
+        int mask = moveMask(inside);
+        for (; mask; mask &= mask - 1)
+            near++;
+    }
+    return near;
+}
+
+size_t countSpheresNear(const SphereSet& spheres, const glm::vec3& point, float distance)
+{
+    const size_t grain = 8192;
+    std::atomic<size_t> total(0);
+    parallelFor(spheres.X.size(), grain, [&](size_t begin, size_t end) {
+        total += countBlockNear(spheres, begin, end, point, distance);
+    });
+    return total;
+}
+
+size_t countSpheresNear(const SphereSet& spheres, const SphereRange& range, const glm::vec3& point, float distance)
+{
+    return countBlockNear(spheres, range.Begin, range.End, point, distance);
+}
+
+void benchmarkCulling(size_t count)
+{
+    // a ring of spheres around the origin, seen from its centre so about a quarter is in view
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    SphereSet spheres;
+    spheres.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        float angle = unit(random) * 6.2831853f, distance = 5.0f + unit(random) * 2.0f;
+        spheres.set(i, glm::vec3(std::sin(angle) * distance, unit(random) - 0.5f, std::cos(angle) * distance), 0.05f + unit(random) * 0.1f);
+    }
+    glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 1.5f, 0.0f), glm::vec3(6.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    glm::mat4 projection = glm::perspective(glm::radians(45.0f), 16.0f / 9.0f, 0.5f, 100.0f);
+    Frustum frustum = Frustum::fromMatrix(projection * view);
+
+    std::vector<uint32_t> visible;
+    cullSpheres(frustum, spheres, visible);
+    const int runs = 50;
+    auto start = std::chrono::steady_clock::now();
+    size_t found = 0;
+    for (int run = 0; run < runs; run++)
+        found = cullSpheres(frustum, spheres, visible);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / runs;
+
+    size_t expected = 0;
+    for (size_t i = 0; i < count; i++)
+        expected += frustum.intersectsSphere(glm::vec3(spheres.X[i], spheres.Y[i], spheres.Z[i]), spheres.Radius[i]);
+    std::cout << "Cull " << count << " spheres: " << found << " visible (" << (found == expected ? "matches" : "DIFFERS from")
+              << " the scalar test), " << ms << " ms (" << count / ms / 1e3 << " Mspheres/s on "
+              << ThreadPool::instance().threadCount() << " threads)" << std::endl;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "./Dependencies/glm/glm.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Six planes, inside where dot(plane.xyz, p) + plane.w >= 0, normalized so
+// the value is a distance in the units of the space they were extracted in.
+struct Frustum {
+    glm::vec4 Planes[6];
+
+    // from a clip-from-space matrix; projection * view * model gives the
+    // frustum in model space, where bounding spheres can be tested as they are
+    static Frustum fromMatrix(const glm::mat4& clipFromSpace);
+
+    bool intersectsSphere(const glm::vec3& centre, float radius) const;
+};
+
+// Bounding spheres in structure-of-arrays layout, padded to a multiple of 8
+// with spheres that are never visible so the culling loop needs no tail.
+struct SphereSet {
+    std::vector<float> X, Y, Z, Radius;
+    size_t Count = 0;
+
+    void resize(size_t count);
+    void set(size_t index, const glm::vec3& centre, float radius);
+};
+
+// Writes the indices of the spheres touching the frustum to visible in
+// ascending order and returns how many there are. 8 spheres per SIMD step,
+// blocks of them spread over the thread pool.
+size_t cullSpheres(const Frustum& frustum, const SphereSet& spheres, std::vector<uint32_t>& visible);
+
+// A run of spheres from Begin to End, both multiples of 8.
+struct SphereRange {
+    size_t Begin, End;
+};
+
+// The same over only the spheres of ranges, given in ascending order; for
+// sets whose groups have bounds of their own that were tested first.
+size_t cullSpheres(const Frustum& frustum, const SphereSet& spheres, const std::vector<SphereRange>& ranges,
+                   std::vector<uint32_t>& visible);
+
+// The same over one range on the calling thread, for jobs that own a range
+// each; out needs room for every sphere of the range.
+size_t cullRange(const Frustum& frustum, const SphereSet& spheres, const SphereRange& range, uint32_t* out);
+
+// How many spheres come within distance of point, 8 per SIMD step over the
+// thread pool like cullSpheres; for spheres that move too much to keep a tree over.
+size_t countSpheresNear(const SphereSet& spheres, const glm::vec3& point, float distance);
+// and over one range, on the calling thread
+size_t countSpheresNear(const SphereSet& spheres, const SphereRange& range, const glm::vec3& point, float distance);
+
+// --bench-cull: times cullSpheres on count random spheres and prints the result
+void benchmarkCulling(size_t count);
@@ -0,0 +1,386 @@
+#include "EnvironmentLight.h"
+#include "GLState.h"
+#include "Parallel.h"
+#include "Residency.h"
+#include "Shader.h"
+#include "Simd.h"
+
+#include "./Dependencies/glew/glew.h"
+#include "./Dependencies/stb_image/stb_image.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sys/stat.h>
+
+static const float Pi = 3.14159265358979f;
+
+// exponents of the Phong lobes, one per mip level starting at SpecularSize
+static const int SpecularLevels = 5;
+
+struct EnvironmentCacheHeader {
+    char magic[4];
+    uint32_t keyCount;
+    uint32_t size, levels;
+};
+
+// GL cubemap face addressing: direction = U * u + V * v + C for face
+// coordinates u, v in [-1, 1], with v = -1 on the first uploaded row
+struct FaceBasis {
+    float U[3], V[3], C[3];
+};
+
+static const FaceBasis faceBases[6] = {
+    { { 0, 0, -1 }, { 0, -1, 0 }, { 1, 0, 0 } },   // +X
+    { { 0, 0, 1 }, { 0, -1, 0 }, { -1, 0, 0 } },   // -X
+    { { 1, 0, 0 }, { 0, 0, 1 }, { 0, 1, 0 } },     // +Y
+    { { 1, 0, 0 }, { 0, 0, -1 }, { 0, -1, 0 } },   // -Y
+    { { 1, 0, 0 }, { 0, -1, 0 }, { 0, 0, 1 } },    // +Z
+    { { -1, 0, 0 }, { 0, -1, 0 }, { 0, 0, -1 } },  // -Z
+};
+
+static glm::vec3 faceDirection(int face, float u, float v)
+{
+    const FaceBasis& b = faceBases[face];
+    return glm::normalize(glm::vec3(b.U[0] * u + b.V[0] * v + b.C[0],
+                                    b.U[1] * u + b.V[1] * v + b.C[1],
+                                    b.U[2] * u + b.V[2] * v + b.C[2]));
+}
+
+// solid angle covered by the texel at face coordinates u, v
+static float texelSolidAngle(float u, float v, int width, int height)
+{
+    float r2 = 1.0f + u * u + v * v;
+    return 4.0f / (width * height) / (r2 * std::sqrt(r2));
+}
+
+// one face as planar floats, rows padded to a multiple of 8 for the SIMD loops
+struct Face {
+    int Width = 0, Height = 0, Stride = 0;
+    std::vector<float> R, G, B;
+};
+
+static Face loadFace(const std::string& path)
+{
+    // same orientation as the cubemap the skybox draws
+    stbi_set_flip_vertically_on_load(true);
+    int width, height, bpp;
+    unsigned char* data = stbi_load(path.c_str(), &width, &height, &bpp, 3);
+    if (!data) {
+        std::cout << "Cubemap texture failed to load at path: " << path << std::endl;
+        exit(1);
+    }
+
+    Face face;
+    face.Width = width;
+    face.Height = height;
+    face.Stride = (width + 7) & ~7;
+    size_t size = (size_t)face.Stride * height;
+    face.R.assign(size, 0.0f);
+    face.G.assign(size, 0.0f);
+    face.B.assign(size, 0.0f);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++) {
+            const unsigned char* texel = data + ((size_t)y * width + x) * 3;
+            size_t i = (size_t)y * face.Stride + x;
+            face.R[i] = texel[0] / 255.0f;
+            face.G[i] = texel[1] / 255.0f;
+            face.B[i] = texel[2] / 255.0f;
+        }
+    stbi_image_free(data);
+    return face;
+}
+
+// area average of a face down to size x size texels
+static Face downsampleFace(const Face& src, int size)
+{
+    Face dst;
+    dst.Width = dst.Height = dst.Stride = size;
+    dst.R.assign((size_t)size * size, 0.0f);
+    dst.G.assign((size_t)size * size, 0.0f);
+    dst.B.assign((size_t)size * size, 0.0f);
+    for (int cy = 0; cy < size; cy++) {
+        int y0 = cy * src.Height / size, y1 = std::max(y0 + 1, (cy + 1) * src.Height / size);
+        for (int cx = 0; cx < size; cx++) {
+            int x0 = cx * src.Width / size, x1 = std::max(x0 + 1, (cx + 1) * src.Width / size);
+            float r = 0.0f, g = 0.0f, b = 0.0f;
+            for (int y = y0; y < y1; y++)
+                for (int x = x0; x < x1; x++) {
+                    size_t i = (size_t)y * src.Stride + x;
+                    r += src.R[i];
+                    g += src.G[i];
+                    b += src.B[i];
+                }
+            float n = 1.0f / ((y1 - y0) * (x1 - x0));
+            size_t o = (size_t)cy * size + cx;
+            dst.R[o] = r * n;
+            dst.G[o] = g * n;
+            dst.B[o] = b * n;
+        }
+    }
+    return dst;
+}
+
+// integrate radiance times the 9 SH polynomials (without their constants)
+// over all faces; returns the summed solid angle in weightSum
+static void projectSH(const std::vector<Face>& faces, double sums[9][3], double& weightSum)
+{
+    std::mutex mergeMutex;
+    for (int f = 0; f < 6; f++) {
+        const Face& face = faces[f];
+        const FaceBasis& b = faceBases[f];
+        parallelFor(face.Height, 8, [&](size_t begin, size_t end) {
+            float8 acc[9][3];
+            for (int i = 0; i < 9; i++)
+                for (int c = 0; c < 3; c++)
+                    acc[i][c] = float8(0.0f);
+            float8 weights(0.0f);
+
+            float du = 2.0f / face.Width;
+            float8 solidAngleScale(4.0f / ((float)face.Width * face.Height));
+            for (size_t y = begin; y < end; y++) {
+                float v = (y + 0.5f) * 2.0f / face.Height - 1.0f;
+                float8 v2(v * v);
+                float8 rowX(b.V[0] * v + b.C[0]), rowY(b.V[1] * v + b.C[1]), rowZ(b.V[2] * v + b.C[2]);
+                const float* red = face.R.data() + y * face.Stride;
+                const float* green = face.G.data() + y * face.Stride;
+                const float* blue = face.B.data() + y * face.Stride;
+
+                for (int x = 0; x < face.Width; x += 8) {
+                    float8 u = float8::ramp((x + 0.5f) * du - 1.0f, du);
+                    float8 r2 = fmadd(u, u, v2 + float8(1.0f));
+                    float8 invLen = float8(1.0f) / sqrt(r2);
+                    // padding lanes past the row end get no weight
+                    float8 w = select(u < float8(1.0f), solidAngleScale * invLen * invLen * invLen, float8(0.0f));
+
+                    float8 dx = fmadd(float8(b.U[0]), u, rowX) * invLen;
+                    float8 dy = fmadd(float8(b.U[1]), u, rowY) * invLen;
+                    float8 dz = fmadd(float8(b.U[2]), u, rowZ) * invLen;
+
+                    float8 basis[9] = {
+                        float8(1.0f), dy, dz, dx,
+                        dx * dy, dy * dz, fmadd(float8(3.0f), dz * dz, float8(-1.0f)), dx * dz, dx * dx - dy * dy
+                    };
+                    float8 colour[3] = { float8::load(red + x) * w, float8::load(green + x) * w, float8::load(blue + x) * w };
+                    for (int i = 0; i < 9; i++)
+                        for (int c = 0; c < 3; c++)
+                            acc[i][c] = fmadd(colour[c], basis[i], acc[i][c]);
+                    weights += w;
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(mergeMutex);
+            for (int i = 0; i < 9; i++)
+                for (int c = 0; c < 3; c++)
+                    sums[i][c] += reduceAdd(acc[i][c]);
+            weightSum += reduceAdd(weights);
+        });
+    }
+}
+
+void EnvironmentLight::compute(const std::vector<std::string>& facePaths)
+{
+    std::vector<Face> faces;
+    for (const std::string& path : facePaths)
+        faces.push_back(loadFace(path));
+
+    // irradiance: E(n) = sum A_l * L_lm * Y_lm(n), scaled by 1/pi so a white
+    // environment gives 1. Y_lm = K_lm * p_lm(n), so the shader only needs
+    // the polynomials p_lm once K_lm^2 * A_l / pi is folded in.
+    double sums[9][3] = {};
+    double weightSum = 0.0;
+    projectSH(faces, sums, weightSum);
+
+    const float K[9] = { 0.282095f, 0.488603f, 0.488603f, 0.488603f,
+                         1.092548f, 1.092548f, 0.315392f, 1.092548f, 0.546274f };
+    const float A[9] = { 1.0f, 2.0f / 3.0f, 2.0f / 3.0f, 2.0f / 3.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f };
+    // the discrete solid angles do not add up to exactly 4 pi
+    double norm = 4.0 * Pi / weightSum;
+    for (int i = 0; i < 9; i++)
+        SH[i] = glm::vec3(sums[i][0], sums[i][1], sums[i][2]) * (float)(norm * K[i] * K[i] * A[i]);
+
+    // specular: every output texel is the Phong-lobe weighted average of a
+    // 32x32 per face version of the sky, laid out SoA for the SIMD loop
+    std::vector<float> srcX, srcY, srcZ, srcR, srcG, srcB, srcW;
+    for (int f = 0; f < 6; f++) {
+        Face small = downsampleFace(faces[f], SpecularSize);
+        for (int y = 0; y < SpecularSize; y++)
+            for (int x = 0; x < SpecularSize; x++) {
+                float u = (x + 0.5f) * 2.0f / SpecularSize - 1.0f;
+                float v = (y + 0.5f) * 2.0f / SpecularSize - 1.0f;
+                glm::vec3 dir = faceDirection(f, u, v);
+                float w = texelSolidAngle(u, v, SpecularSize, SpecularSize);
+                size_t i = (size_t)y * SpecularSize + x;
+                srcX.push_back(dir.x);
+                srcY.push_back(dir.y);
+                srcZ.push_back(dir.z);
+                srcR.push_back(small.R[i] * w);
+                srcG.push_back(small.G[i] * w);
+                srcB.push_back(small.B[i] * w);
+                srcW.push_back(w);
+            }
+    }
+    size_t sourceCount = srcX.size(); // 6 * 32 * 32, a multiple of 8
+
+    Levels = SpecularLevels;
+    Specular.assign(Levels, std::vector<float>());
+    for (int level = 0; level < Levels; level++) {
+        int size = std::max(1, SpecularSize >> level);
+        // exponent 256 >> (2 * level), raised by repeated squaring
+        int squarings = 2 * (SpecularLevels - 1 - level);
+        std::vector<float>& out = Specular[level];
+        out.assign((size_t)6 * size * size * 3, 0.0f);
+
+        parallelFor((size_t)6 * size * size, 16, [&](size_t begin, size_t end) {
+            for (size_t texel = begin; texel < end; texel++) {
+                int f = (int)(texel / (size * size));
+                int y = (int)(texel / size % size), x = (int)(texel % size);
+                glm::vec3 n = faceDirection(f, (x + 0.5f) * 2.0f / size - 1.0f, (y + 0.5f) * 2.0f / size - 1.0f);
+                float8 nx(n.x), ny(n.y), nz(n.z);
+
+                float8 r(0.0f), g(0.0f), bl(0.0f), w(0.0f);
+                for (size_t s = 0; s < sourceCount; s += 8) {
+                    float8 c = fmadd(nx, float8::load(&srcX[s]), fmadd(ny, float8::load(&srcY[s]), nz * float8::load(&srcZ[s])));
+                    c = max(c, float8(0.0f));
+                    for (int i = 0; i < squarings; i++)
+                        c = c * c;
+                    r = fmadd(c, float8::load(&srcR[s]), r);
+                    g = fmadd(c, float8::load(&srcG[s]), g);
+                    bl = fmadd(c, float8::load(&srcB[s]), bl);
+                    w = fmadd(c, float8::load(&srcW[s]), w);
+                }
+                float total = std::max(reduceAdd(w), 1e-12f);
+                out[texel * 3 + 0] = reduceAdd(r) / total;
+                out[texel * 3 + 1] = reduceAdd(g) / total;
+                out[texel * 3 + 2] = reduceAdd(bl) / total;
+            }
+        });
+    }
+}
+
+bool EnvironmentLight::loadCache(const char* cachePath, const std::vector<unsigned long long>& key)
+{
+    std::ifstream file(cachePath, std::ios::binary);
+    if (!file)
+        return false;
+
+    EnvironmentCacheHeader header;
+    if (!file.read((char*)&header, sizeof(header)) || memcmp(header.magic, "ENV1", 4) != 0 ||
+        header.keyCount != key.size() || header.size != (uint32_t)SpecularSize || header.levels != (uint32_t)SpecularLevels)
+        return false;
+
+    std::vector<unsigned long long> storedKey(key.size());
+    file.read((char*)storedKey.data(), storedKey.size() * sizeof(unsigned long long));
+    if (!file || storedKey != key)
+        return false;
+
+    float coefficients[27];
+    file.read((char*)coefficients, sizeof(coefficients));
+    for (int i = 0; i < 9; i++)
+        SH[i] = glm::vec3(coefficients[i * 3], coefficients[i * 3 + 1], coefficients[i * 3 + 2]);
+
+    Levels = SpecularLevels;
+    Specular.assign(Levels, std::vector<float>());
+    for (int level = 0; level < Levels; level++) {
+        int size = std::max(1, SpecularSize >> level);
+        Specular[level].resize((size_t)6 * size * size * 3);
+        file.read((char*)Specular[level].data(), Specular[level].size() * sizeof(float));
+    }
+    return (bool)file;
+}
+
+void EnvironmentLight::saveCache(const char* cachePath, const std::vector<unsigned long long>& key) const
+{
+    std::ofstream file(cachePath, std::ios::binary);
+    if (!file) {
+        std::cout << "Failed to write environment cache: " << cachePath << std::endl;
+        return;
+    }
+
+    EnvironmentCacheHeader header;
+    memcpy(header.magic, "ENV1", 4);
+    header.keyCount = (uint32_t)key.size();
+    header.size = SpecularSize;
+    header.levels = Levels;
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)key.data(), key.size() * sizeof(unsigned long long));
+    for (int i = 0; i < 9; i++)
+        file.write((const char*)&SH[i][0], 3 * sizeof(float));
+    for (const std::vector<float>& level : Specular)
+        file.write((const char*)level.data(), level.size() * sizeof(float));
+}
+
+void EnvironmentLight::upload()
+{
+    glGenTextures(1, &ID);
+    glState.bindTexture(GL_TEXTURE_CUBE_MAP, ID);
+
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, Levels - 1);
+
+    size_t bytes = 0;
+    for (int level = 0; level < Levels; level++) {
+        int size = std::max(1, SpecularSize >> level);
+        size_t faceFloats = (size_t)size * size * 3;
+        for (int f = 0; f < 6; f++)
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + f, level, GL_RGB16F, size, size, 0, GL_RGB, GL_FLOAT,
+                         Specular[level].data() + f * faceFloats);
+        bytes += (size_t)size * size * 6 * 6;
+    }
+    glState.bindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    Residency = residency.trackTexture("environment specular", bytes);
+}
+
+void EnvironmentLight::setup(const std::vector<std::string>& facePaths, const char* cachePath)
+{
+    // size and modification time of every face decide whether the cache is stale
+    std::vector<unsigned long long> key;
+    for (const std::string& path : facePaths) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            std::cout << "Cubemap texture failed to load at path: " << path << std::endl;
+            exit(1);
+        }
+        key.push_back((unsigned long long)st.st_size);
+        key.push_back((unsigned long long)st.st_mtime);
+    }
+
+    if (loadCache(cachePath, key)) {
+        std::cout << "Load environment lighting from " << cachePath << std::endl;
+    }
+    else {
+        auto start = std::chrono::steady_clock::now();
+        compute(facePaths);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Project environment lighting in " << ms << " ms on "
+                  << ThreadPool::instance().threadCount() << " threads" << std::endl;
+        saveCache(cachePath, key);
+    }
+
+    upload();
+    // the CPU copy is only needed to write the cache
+    Specular.clear();
+}
+
+void EnvironmentLight::setUniforms(const Shader& shader, unsigned int specularSlot) const
+{
+    shader.setVec3Array("envSH", SH, 9);
+    shader.setInt("envSpecular", specularSlot);
+    shader.setFloat("envSpecularMaxLod", (float)(Levels - 1));
+}
+
+void EnvironmentLight::bind(unsigned int slot) const
+{
+    residency.touch(Residency);
+    glState.bindTextureUnit(slot, GL_TEXTURE_CUBE_MAP, ID);
+}
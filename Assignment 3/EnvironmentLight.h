@@ -0,0 +1,43 @@
+#pragma once
+
+#include "./Dependencies/glm/glm.hpp"
+
+#include <string>
+#include <vector>
+
+class Shader;
+
+// Image-based ambient lighting derived from the skybox. The six faces are
+// projected into 9 spherical harmonics coefficients of irradiance (evaluated
+// per fragment with a handful of multiply-adds) and convolved into a small
+// prefiltered specular cubemap, one Phong lobe per mip level. Both are
+// computed on the CPU once and cached next to the skybox.
+class EnvironmentLight
+{
+public:
+    // faces in GL order +X -X +Y -Y +Z -Z, loaded like Texture::setupTextureCubemap
+    void setup(const std::vector<std::string>& facePaths, const char* cachePath);
+
+    // envSH[9], the envSpecular sampler slot and envSpecularMaxLod
+    void setUniforms(const Shader& shader, unsigned int specularSlot) const;
+    void bind(unsigned int slot) const;
+
+    const glm::vec3* irradianceSH() const { return SH; }
+    int specularLevels() const { return Levels; }
+
+    static const int SpecularSize = 32;
+
+private:
+    // irradiance coefficients with the SH basis constants and the cosine lobe folded in
+    glm::vec3 SH[9];
+    // per level: 6 faces of RGB floats
+    std::vector<std::vector<float>> Specular;
+    int Levels = 0;
+    unsigned int ID = 0;
+    int Residency = -1;
+
+    void compute(const std::vector<std::string>& facePaths);
+    bool loadCache(const char* cachePath, const std::vector<unsigned long long>& key);
+    void saveCache(const char* cachePath, const std::vector<unsigned long long>& key) const;
+    void upload();
+};
@@ -0,0 +1,42 @@
+#include "FixedStepThread.h"
+
+#include <chrono>
+
+double FixedStepThread::now()
+{
+    static const std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - origin).count();
+}
+
+void FixedStepThread::start(double stepSeconds, const StepFunc& step)
+{
+    stop();
+    Step = stepSeconds;
+    Running = true;
+    Thread = std::thread([this, step]() {
+        long tick = 0;
+        double next = now();
+        while (Running.load(std::memory_order_relaxed)) {
+            step(tick++);
+            next += Step;
+
+            double late = now() - next;
+            if (late > MaxCatchUp * Step) {
+                long behind = (long)(late / Step);
+                Skipped.fetch_add(behind, std::memory_order_relaxed);
+                tick += behind;
+                next += behind * Step;
+            }
+            else if (late < 0.0) {
+                std::this_thread::sleep_for(std::chrono::duration<double>(-late));
+            }
+        }
+    });
+}
+
+void FixedStepThread::stop()
+{
+    Running = false;
+    if (Thread.joinable())
+        Thread.join();
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+// Calls a step function at a fixed rate on a thread of its own, which is how
+// the simulation runs apart from rendering. A step that starts late is made
+// up for by running the next ones back to back, at most MaxCatchUp of them;
+// past that the schedule skips ahead rather than fall further behind.
+class FixedStepThread
+{
+public:
+    static const int MaxCatchUp = 5;
+    // called with the tick number, from 0
+    typedef std::function<void(long tick)> StepFunc;
+
+    // seconds on the clock ticks are scheduled by, from any thread
+    static double now();
+
+    void start(double stepSeconds, const StepFunc& step);
+    // waits for the step in progress
+    void stop();
+    ~FixedStepThread() { stop(); }
+
+    double stepSeconds() const { return Step; }
+    // steps skipped to catch up since start
+    long skipped() const { return Skipped.load(std::memory_order_relaxed); }
+
+private:
+    std::thread Thread;
+    std::atomic<bool> Running{ false };
+    std::atomic<long> Skipped{ 0 };
+    double Step = 1.0 / 60.0;
+};
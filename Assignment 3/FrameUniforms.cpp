@@ -0,0 +1,11 @@
+#include "FrameUniforms.h"
+#include "GLState.h"
+#include "UploadRing.h"
+
+#include "./Dependencies/glew/glew.h"
+
+void FrameUniforms::update(const FrameData& data)
+{
+    UploadRing::Allocation uniforms = uploadRing.upload(&data, sizeof(FrameData), uploadRing.uniformAlignment());
+    glState.bindBufferRange(GL_UNIFORM_BUFFER, FrameDataBinding, uniforms.Buffer, uniforms.Offset, sizeof(FrameData));
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "./Dependencies/glm/glm.hpp"
+
+// binding point of the FrameData uniform block; Shader attaches every
+// program that declares the block to it at link time
+const unsigned int FrameDataBinding = 0;
+
+// CPU mirror of the std140 FrameData block in the shaders. Members are
+// ordered so std140 needs no padding, vec3s are widened to vec4.
+struct FrameData {
+    glm::mat4 ViewMatrix;
+    glm::mat4 ProjectionMatrix;
+    glm::mat4 SkyboxViewMatrix;  // view without the translation
+    glm::vec4 LightPos;          // w unused
+    glm::vec4 ViewPos;           // w unused
+    float LightBrightness;
+    float Time;
+    float Padding[2];
+};
+
+static_assert(sizeof(FrameData) == 3 * 64 + 3 * 16, "FrameData must match the std140 layout");
+
+// Per-frame constants shared by every program through one uniform block,
+// written once per frame instead of set on each program. Each frame's copy
+// is a range of the upload ring, so the GPU can still be reading the last.
+class FrameUniforms
+{
+public:
+    void update(const FrameData& data);
+};
@@ -0,0 +1,162 @@
+#include "GLState.h"
+#include "Stats.h"
+
+#include "./Dependencies/glew/glew.h"
+
+GLStateCache glState;
+
+// slots of the tracked targets, anything else is passed straight through
+enum { BufferArray, BufferElement, BufferUniform, BufferPixelPack, BufferPixelUnpack, BufferDrawIndirect, BufferShaderStorage };
+
+static int textureTargetIndex(unsigned int target)
+{
+    switch (target) {
+        case GL_TEXTURE_2D: return 0;
+        case GL_TEXTURE_2D_ARRAY: return 1;
+        case GL_TEXTURE_CUBE_MAP: return 2;
+        case GL_TEXTURE_BUFFER: return 3;
+    }
+    return -1;
+}
+
+static int bufferTargetIndex(unsigned int target)
+{
+    switch (target) {
+        case GL_ARRAY_BUFFER: return BufferArray;
+        case GL_ELEMENT_ARRAY_BUFFER: return BufferElement;
+        case GL_UNIFORM_BUFFER: return BufferUniform;
+        case GL_PIXEL_PACK_BUFFER: return BufferPixelPack;
+        case GL_PIXEL_UNPACK_BUFFER: return BufferPixelUnpack;
+        case GL_DRAW_INDIRECT_BUFFER: return BufferDrawIndirect;
+        case GL_SHADER_STORAGE_BUFFER: return BufferShaderStorage;
+    }
+    return -1;
+}
+
+bool GLStateCache::unchanged(unsigned int& shadow, unsigned int value)
+{
+    if (shadow == value) {
+        Elided++;
+        return true;
+    }
+    shadow = value;
+    Issued++;
+    return false;
+}
+
+void GLStateCache::useProgram(unsigned int program)
+{
+    if (!unchanged(Program, program))
+        glUseProgram(program);
+}
+
+void GLStateCache::activeTexture(unsigned int unit)
+{
+    if (!unchanged(ActiveUnit, unit))
+        glActiveTexture(unit);
+}
+
+void GLStateCache::bindTexture(unsigned int target, unsigned int texture)
+{
+    int index = textureTargetIndex(target);
+    unsigned int unit = ActiveUnit - GL_TEXTURE0;
+    if (index < 0 || unit >= MaxUnits) {
+        Issued++;
+        glBindTexture(target, texture);
+        return;
+    }
+    if (!unchanged(Textures[unit][index], texture))
+        glBindTexture(target, texture);
+}
+
+void GLStateCache::bindTextureUnit(unsigned int unit, unsigned int target, unsigned int texture)
+{
+    int index = textureTargetIndex(target);
+    if (index >= 0 && unit < MaxUnits && Textures[unit][index] == texture) {
+        Elided++;
+        return;
+    }
+    activeTexture(GL_TEXTURE0 + unit);
+    bindTexture(target, texture);
+}
+
+void GLStateCache::bindVertexArray(unsigned int vao)
+{
+    if (unchanged(VertexArray, vao))
+        return;
+    glBindVertexArray(vao);
+    Buffers[BufferElement] = Unknown;
+}
+
+void GLStateCache::bindBuffer(unsigned int target, unsigned int buffer)
+{
+    int index = bufferTargetIndex(target);
+    if (index < 0) {
+        Issued++;
+        glBindBuffer(target, buffer);
+        return;
+    }
+    if (!unchanged(Buffers[index], buffer))
+        glBindBuffer(target, buffer);
+}
+
+void GLStateCache::bindBufferBase(unsigned int target, unsigned int index, unsigned int buffer)
+{
+    Issued++;
+    glBindBufferBase(target, index, buffer);
+    int generic = bufferTargetIndex(target);
+    if (generic >= 0)
+        Buffers[generic] = buffer;
+}
+
+void GLStateCache::bindBufferRange(unsigned int target, unsigned int index, unsigned int buffer, size_t offset,
+                                   size_t size)
+{
+    Issued++;
+    glBindBufferRange(target, index, buffer, (GLintptr)offset, (GLsizeiptr)size);
+    int generic = bufferTargetIndex(target);
+    if (generic >= 0)
+        Buffers[generic] = buffer;
+}
+
+void GLStateCache::depthFunc(unsigned int func)
+{
+    if (!unchanged(DepthFunc, func))
+        glDepthFunc(func);
+}
+
+void GLStateCache::deleteTextures(int count, const unsigned int* textures)
+{
+    glDeleteTextures(count, textures);
+    for (int i = 0; i < count; i++)
+        for (int unit = 0; unit < MaxUnits; unit++)
+            for (unsigned int& bound : Textures[unit])
+                if (bound == textures[i])
+                    bound = 0;
+}
+
+void GLStateCache::deleteBuffers(int count, const unsigned int* buffers)
+{
+    glDeleteBuffers(count, buffers);
+    for (int i = 0; i < count; i++)
+        for (unsigned int& bound : Buffers)
+            if (bound == buffers[i])
+                bound = 0;
+}
+
+void GLStateCache::invalidate()
+{
+    Program = ActiveUnit = VertexArray = DepthFunc = Unknown;
+    for (int unit = 0; unit < MaxUnits; unit++)
+        for (unsigned int& bound : Textures[unit])
+            bound = Unknown;
+    for (unsigned int& bound : Buffers)
+        bound = Unknown;
+}
+
+void GLStateCache::reportStats()
+{
+    frameStats.add("gl.binds_issued", (double)Issued);
+    frameStats.add("gl.binds_elided", (double)Elided);
+    Issued = Elided = 0;
+}
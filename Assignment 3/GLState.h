@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+
+// Shadow copy of the binding state the renderer touches every frame. Binds
+// go through glState so a call that would leave the state unchanged is never
+// issued to the driver. Anything that changes this state behind its back
+// (a new context, third party code) must be followed by invalidate().
+class GLStateCache
+{
+public:
+    void useProgram(unsigned int program);
+    void activeTexture(unsigned int unit);  // GL_TEXTURE0 + i
+    // binds on the active unit
+    void bindTexture(unsigned int target, unsigned int texture);
+    // activates the unit only when the binding actually changes
+    void bindTextureUnit(unsigned int unit, unsigned int target, unsigned int texture);
+    void bindVertexArray(unsigned int vao);
+    // GL_ELEMENT_ARRAY_BUFFER is part of the VAO and forgotten when it changes
+    void bindBuffer(unsigned int target, unsigned int buffer);
+    // also binds the generic binding point, like the GL does
+    void bindBufferBase(unsigned int target, unsigned int index, unsigned int buffer);
+    void bindBufferRange(unsigned int target, unsigned int index, unsigned int buffer, size_t offset, size_t size);
+    void depthFunc(unsigned int func);
+
+    // deleting a texture unbinds it, and its name may be handed out again
+    void deleteTextures(int count, const unsigned int* textures);
+    // the same for buffers; indexed bindings are never elided, so only the
+    // generic binding points have anything to forget
+    void deleteBuffers(int count, const unsigned int* buffers);
+
+    void invalidate();
+
+    // gl.binds_issued and gl.binds_elided since the last call
+    void reportStats();
+
+    static const int MaxUnits = 32;
+
+private:
+    static const unsigned int Unknown = ~0u;
+    static const int TextureTargets = 4;
+    static const int BufferTargets = 7;
+
+    unsigned int Program = Unknown;
+    unsigned int ActiveUnit = Unknown;
+    unsigned int Textures[MaxUnits][TextureTargets];
+    unsigned int VertexArray = Unknown;
+    unsigned int Buffers[BufferTargets];
+    unsigned int DepthFunc = Unknown;
+
+    unsigned long Issued = 0;
+    unsigned long Elided = 0;
+
+    // true and counted as elided when the shadow already holds value
+    bool unchanged(unsigned int& shadow, unsigned int value);
+
+public:
+    GLStateCache() { invalidate(); }
+};
+
+extern GLStateCache glState;
@@ -0,0 +1,199 @@
+#include "GeometryPool.h"
+#include "GLState.h"
+#include "Residency.h"
+#include "Shader.h"
+#include "Stats.h"
+#include "UploadRing.h"
+
+#include "./Dependencies/glew/glew.h"
+
+#include <cstdlib>
+#include <iterator>
+#include <iostream>
+
+void RangeAllocator::reset(size_t capacity)
+{
+    Free.clear();
+    if (capacity > 0)
+        Free[0] = capacity;
+}
+
+size_t RangeAllocator::allocate(size_t count)
+{
+    for (auto it = Free.begin(); it != Free.end(); ++it) {
+        if (it->second < count)
+            continue;
+        size_t offset = it->first, remaining = it->second - count;
+        Free.erase(it);
+        if (remaining > 0)
+            Free[offset + count] = remaining;
+        return offset;
+    }
+    return Invalid;
+}
+
+void RangeAllocator::free(size_t offset, size_t count)
+{
+    auto next = Free.lower_bound(offset);
+    if (next != Free.end() && offset + count == next->first) {
+        count += next->second;
+        next = Free.erase(next);
+    }
+    if (next != Free.begin()) {
+        auto previous = std::prev(next);
+        if (previous->first + previous->second == offset) {
+            previous->second += count;
+            return;
+        }
+    }
+    Free[offset] = count;
+}
+
+void GeometryPool::setup(size_t vertexCapacity, size_t indexCapacity)
+{
+    glGenVertexArrays(1, &VAO);
+    glGenBuffers(1, &VertexBuffer);
+    glGenBuffers(1, &IndexBuffer);
+    glState.bindVertexArray(VAO);
+    glState.bindBuffer(GL_ARRAY_BUFFER, VertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, vertexCapacity * sizeof(PoolVertex), NULL, GL_STATIC_DRAW);
+    glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, IndexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCapacity * sizeof(unsigned int), NULL, GL_STATIC_DRAW);
+    setVertexFormat();
+
+    Vertices.reset(vertexCapacity);
+    Indices.reset(indexCapacity);
+    Residency.push_back(residency.trackBuffer("geometry pool vertices", vertexCapacity * sizeof(PoolVertex)));
+    Residency.push_back(residency.trackBuffer("geometry pool indices", indexCapacity * sizeof(unsigned int)));
+}
+
+void GeometryPool::setVertexFormat() const
+{
+    glState.bindBuffer(GL_ARRAY_BUFFER, VertexBuffer);
+    glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, IndexBuffer);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(PoolVertex), (void*)offsetof(PoolVertex, Position));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(PoolVertex), (void*)offsetof(PoolVertex, UV));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(PoolVertex), (void*)offsetof(PoolVertex, Normal));
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(PoolVertex), (void*)offsetof(PoolVertex, Tangent));
+}
+
+int GeometryPool::add(const Model& model, const std::vector<glm::vec3>& tangents)
+{
+    size_t vertexOffset = Vertices.allocate(model.vertices.size());
+    size_t indexOffset = Indices.allocate(model.indices.size());
+    if (vertexOffset == RangeAllocator::Invalid || indexOffset == RangeAllocator::Invalid) {
+        std::cout << "Geometry pool is full, cannot add a mesh of " << model.vertices.size() << " vertices and "
+                  << model.indices.size() << " indices" << std::endl;
+        exit(1);
+    }
+
+    std::vector<PoolVertex> vertices(model.vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++) {
+        vertices[i].Position = model.vertices[i].position;
+        vertices[i].UV = model.vertices[i].uv;
+        vertices[i].Normal = model.vertices[i].normal;
+        vertices[i].Tangent = i < tangents.size() ? tangents[i] : glm::vec3(0.0f);
+    }
+    glState.bindBuffer(GL_ARRAY_BUFFER, VertexBuffer);
+    glBufferSubData(GL_ARRAY_BUFFER, vertexOffset * sizeof(PoolVertex), vertices.size() * sizeof(PoolVertex), vertices.data());
+    // the element binding belongs to whichever VAO is bound, go through the pool's
+    glState.bindVertexArray(VAO);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indexOffset * sizeof(unsigned int), model.indices.size() * sizeof(unsigned int), model.indices.data());
+
+    PoolMesh mesh;
+    mesh.BaseVertex = (int)vertexOffset;
+    mesh.FirstIndex = (unsigned int)indexOffset;
+    mesh.IndexCount = (unsigned int)model.indices.size();
+    mesh.VertexCount = (unsigned int)model.vertices.size();
+    Meshes.push_back(mesh);
+    return (int)Meshes.size() - 1;
+}
+
+void GeometryPool::remove(int mesh)
+{
+    PoolMesh& removed = Meshes[mesh];
+    if (removed.VertexCount > 0)
+        Vertices.free(removed.BaseVertex, removed.VertexCount);
+    if (removed.IndexCount > 0)
+        Indices.free(removed.FirstIndex, removed.IndexCount);
+    // ids stay valid, the record just draws nothing
+    removed = PoolMesh();
+}
+
+void GeometryPool::bind() const
+{
+    touch();
+    glState.bindVertexArray(VAO);
+}
+
+void GeometryPool::touch() const
+{
+    residency.touch(Residency);
+}
+
+void GeometryPool::draw(int mesh, int instances) const
+{
+    const PoolMesh& drawn = Meshes[mesh];
+    glDrawElementsInstancedBaseVertex(GL_TRIANGLES, (GLsizei)drawn.IndexCount, GL_UNSIGNED_INT,
+                                      (void*)(drawn.FirstIndex * sizeof(unsigned int)), instances, drawn.BaseVertex);
+}
+
+bool DrawBatch::multiDrawSupported()
+{
+    return (GLEW_VERSION_4_3 || (GLEW_ARB_multi_draw_indirect && GLEW_ARB_shader_storage_buffer_object &&
+                                 GLEW_ARB_program_interface_query)) && GLEW_ARB_shader_draw_parameters;
+}
+
+void DrawBatch::clear()
+{
+    Commands.clear();
+    Draws.clear();
+}
+
+void DrawBatch::add(const GeometryPool& pool, int mesh, const DrawData& data)
+{
+    const PoolMesh& drawn = pool.mesh(mesh);
+    if (drawn.IndexCount == 0)
+        return;
+    Command command;
+    command.Count = drawn.IndexCount;
+    command.InstanceCount = 1;
+    command.FirstIndex = drawn.FirstIndex;
+    command.BaseVertex = drawn.BaseVertex;
+    command.BaseInstance = 0;
+    Commands.push_back(command);
+    Draws.push_back(data);
+}
+
+void DrawBatch::draw(const Shader& shader)
+{
+    if (Commands.empty())
+        return;
+    frameStats.add("geometry.draw_commands", (double)Commands.size());
+
+    if (!multiDrawSupported()) {
+        constexpr UniformName modelMatrixName("modelMatrix"), layerName("layer");
+        for (size_t i = 0; i < Commands.size(); i++) {
+            shader.setMat4(modelMatrixName, Draws[i].ModelMatrix);
+            shader.setInt(layerName, Draws[i].Layer);
+            glDrawElementsBaseVertex(GL_TRIANGLES, (GLsizei)Commands[i].Count, GL_UNSIGNED_INT,
+                                     (void*)(Commands[i].FirstIndex * sizeof(unsigned int)), Commands[i].BaseVertex);
+        }
+        frameStats.add("geometry.draw_calls", (double)Commands.size());
+        return;
+    }
+
+    // both arrays go in the frame's upload region, so a batch drawn again
+    // later in the frame never waits for the GPU to finish with the last
+    size_t dataBytes = Draws.size() * sizeof(DrawData);
+    UploadRing::Allocation data = uploadRing.upload(Draws.data(), dataBytes, uploadRing.storageAlignment());
+    UploadRing::Allocation commands = uploadRing.upload(Commands.data(), Commands.size() * sizeof(Command));
+    glState.bindBufferRange(GL_SHADER_STORAGE_BUFFER, DrawDataBinding, data.Buffer, data.Offset, dataBytes);
+    glState.bindBuffer(GL_DRAW_INDIRECT_BUFFER, commands.Buffer);
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)commands.Offset, (GLsizei)Commands.size(), 0);
+    frameStats.add("geometry.draw_calls", 1.0);
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "Misc.h"
+#include "./Dependencies/glm/glm.hpp"
+
+#include <cstddef>
+#include <map>
+#include <vector>
+
+class Shader;
+
+// binding point of the DrawDataBlock storage buffer; Shader attaches every
+// program that declares the block to it at link time
+const unsigned int DrawDataBinding = 1;
+
+// Shared vertex format of every mesh in a GeometryPool, locations 0-3.
+struct PoolVertex {
+    glm::vec3 Position;
+    glm::vec2 UV;
+    glm::vec3 Normal;
+    glm::vec3 Tangent;  // zero for meshes without one
+};
+
+// First fit over [0, capacity) elements; freed ranges merge with their neighbours.
+class RangeAllocator
+{
+public:
+    static const size_t Invalid = ~(size_t)0;
+
+    void reset(size_t capacity);
+    size_t allocate(size_t count);
+    void free(size_t offset, size_t count);
+
+private:
+    std::map<size_t, size_t> Free;  // offset -> count
+};
+
+// Where a mesh lives in the pool, in vertices and indices.
+struct PoolMesh {
+    int BaseVertex = 0;
+    unsigned int FirstIndex = 0;
+    unsigned int IndexCount = 0;
+    unsigned int VertexCount = 0;
+};
+
+// All static meshes in one vertex and one index buffer behind a single VAO,
+// so switching meshes is a matter of offsets rather than rebinding state.
+// Capacity is fixed at setup.
+class GeometryPool
+{
+public:
+    void setup(size_t vertexCapacity, size_t indexCapacity);
+
+    // returns the mesh id; tangents are per vertex and optional
+    int add(const Model& model, const std::vector<glm::vec3>& tangents = std::vector<glm::vec3>());
+    void remove(int mesh);
+    const PoolMesh& mesh(int id) const { return Meshes[id]; }
+
+    // the pool VAO
+    void bind() const;
+    // points attributes 0-3 of the bound VAO at the pool, for VAOs that add
+    // streams of their own (per-instance data)
+    void setVertexFormat() const;
+    void touch() const;
+
+    // one direct draw of a mesh with the pool or a VAO made with setVertexFormat bound
+    void draw(int mesh, int instances = 1) const;
+
+private:
+    unsigned int VAO = 0;
+    unsigned int VertexBuffer = 0;
+    unsigned int IndexBuffer = 0;
+    RangeAllocator Vertices, Indices;
+    std::vector<PoolMesh> Meshes;
+    std::vector<int> Residency;
+};
+
+// std430 mirror of DrawData in vert.glsl
+struct DrawData {
+    glm::mat4 ModelMatrix;
+    int Layer;
+    int Padding[3];
+};
+
+static_assert(sizeof(DrawData) == 80, "DrawData must match the std430 layout");
+
+// The draws of one pipeline state, rebuilt every frame. With multi-draw
+// indirect they go to the GPU as one command array and one DrawData storage
+// array in the upload ring, indexed by gl_DrawIDARB in the MULTI_DRAW shader variant. Without
+// it (GL 4.1 on macOS) each command becomes a direct draw with its DrawData
+// set as the modelMatrix and layer uniforms.
+class DrawBatch
+{
+public:
+    static bool multiDrawSupported();
+
+    void clear();
+    void add(const GeometryPool& pool, int mesh, const DrawData& data);
+    // with the pool bound
+    void draw(const Shader& shader);
+
+    size_t size() const { return Commands.size(); }
+
+private:
+    // layout fixed by glMultiDrawElementsIndirect
+    struct Command {
+        unsigned int Count;
+        unsigned int InstanceCount;
+        unsigned int FirstIndex;
+        int BaseVertex;
+        unsigned int BaseInstance;
+    };
+
+    std::vector<Command> Commands;
+    std::vector<DrawData> Draws;
+};
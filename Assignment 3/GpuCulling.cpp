@@ -0,0 +1,257 @@
+#include "GpuCulling.h"
+#include "Culling.h"
+#include "GeometryPool.h"
+#include "GLState.h"
+#include "Residency.h"
+#include "Stats.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+bool GpuCuller::supported()
+{
+    return GLEW_VERSION_4_3 != 0;
+}
+
+bool GpuCuller::setup(const GeometryPool& pool, const std::vector<int>& lodMeshes, const std::vector<float>& lodRadiusError,
+                      const SphereSet& spheres)
+{
+    if (lodMeshes.empty() || lodMeshes.size() > (size_t)MaxLods) {
+        std::cout << "GPU culling takes 1 to " << MaxLods << " levels of detail" << std::endl;
+        return false;
+    }
+    if (!CullShader.setupCompute("cull.comp") || !DepthReduceShader.setupCompute("hiz.comp", "#define FROM_DEPTH\n") ||
+        !PyramidReduceShader.setupCompute("hiz.comp"))
+        return false;
+
+    SphereCount = (int)spheres.Count;
+    Commands.clear();
+    for (size_t lod = 0; lod < lodMeshes.size(); lod++) {
+        const PoolMesh& mesh = pool.mesh(lodMeshes[lod]);
+        Command command;
+        command.Count = mesh.IndexCount;
+        command.InstanceCount = 0;
+        command.FirstIndex = mesh.FirstIndex;
+        command.BaseVertex = mesh.BaseVertex;
+        command.BaseInstance = 0;
+        Commands.push_back(command);
+        LodRadiusError[(int)lod] = lod < lodRadiusError.size() ? lodRadiusError[lod] : 0.0f;
+    }
+
+    std::vector<glm::vec4> packed(spheres.Count);
+    for (size_t i = 0; i < spheres.Count; i++)
+        packed[i] = glm::vec4(spheres.X[i], spheres.Y[i], spheres.Z[i], spheres.Radius[i]);
+
+    glGenBuffers(1, &SphereBuffer);
+    glGenBuffers(1, &VisibleBuffer);
+    glGenBuffers(1, &CommandBuffer);
+    glGenBuffers(StatsFrames, StatsBuffers);
+    glGenBuffers(1, &LodBuffer);
+    SphereBufferBytes = std::max<size_t>(1, packed.size()) * sizeof(glm::vec4);
+    glState.bindBuffer(GL_SHADER_STORAGE_BUFFER, SphereBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, SphereBufferBytes, packed.data(), GL_STATIC_DRAW);
+    glState.bindBuffer(GL_DRAW_INDIRECT_BUFFER, CommandBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, Commands.size() * sizeof(Command), Commands.data(), GL_DYNAMIC_DRAW);
+    for (unsigned int buffer : StatsBuffers) {
+        glState.bindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, Commands.size() * sizeof(Command), NULL, GL_STREAM_READ);
+    }
+    Residency = residency.trackBuffer("gpu culling", 0);
+    Capacity = 0;
+    reserve(std::max<size_t>(1, spheres.Count));
+
+    // the pool's vertices plus the surviving instance indices
+    glGenVertexArrays(1, &VAO);
+    glState.bindVertexArray(VAO);
+    pool.setVertexFormat();
+    glState.bindBuffer(GL_ARRAY_BUFFER, VisibleBuffer);
+    glEnableVertexAttribArray(4);
+    glVertexAttribIPointer(4, 1, GL_UNSIGNED_INT, sizeof(unsigned int), (void*)0);
+    glVertexAttribDivisor(4, 1);
+    return true;
+}
+
+void GpuCuller::moveSpheres(unsigned int buffer, size_t offset, size_t count)
+{
+    MovedSpheres = buffer;
+    MovedSphereOffset = offset;
+    SphereCount = (int)count;
+    reserve(count);
+}
+
+void GpuCuller::reserve(size_t count)
+{
+    if (count <= Capacity)
+        return;
+    // every level has room for all instances, its list starts at its base
+    // instance; grown with room to spare, as the count creeps up
+    Capacity = Capacity == 0 ? count : std::max(count, Capacity * 3 / 2);
+    for (size_t lod = 0; lod < Commands.size(); lod++)
+        Commands[lod].BaseInstance = (unsigned int)(lod * Capacity);
+    size_t visibleBytes = Commands.size() * Capacity * sizeof(unsigned int);
+    glState.bindBuffer(GL_SHADER_STORAGE_BUFFER, VisibleBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, visibleBytes, NULL, GL_DYNAMIC_COPY);
+    // every instance starts at the most detailed level
+    std::vector<unsigned int> levels(Capacity, 0);
+    glState.bindBuffer(GL_SHADER_STORAGE_BUFFER, LodBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, levels.size() * sizeof(unsigned int), levels.data(), GL_DYNAMIC_COPY);
+    residency.resize(Residency, SphereBufferBytes + visibleBytes + (1 + StatsFrames) * Commands.size() * sizeof(Command) + levels.size() * sizeof(unsigned int));
+}
+
+void GpuCuller::cull(const glm::mat4& viewFromSpace, const glm::mat4& projection, int width, int height, const LodSettings& lod)
+{
+    residency.touch(Residency);
+    glState.bindBuffer(GL_DRAW_INDIRECT_BUFFER, CommandBuffer);
+    glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, Commands.size() * sizeof(Command), Commands.data());
+
+    Frustum frustum = Frustum::fromMatrix(projection * viewFromSpace);
+    CullShader.use();
+    CullShader.setInt("sphereCount", SphereCount);
+    CullShader.setVec4Array("frustumPlanes", frustum.Planes, 6);
+    CullShader.setMat4("viewFromSpace", viewFromSpace);
+    CullShader.setVec4("projection", glm::vec4(projection[0][0], projection[1][1], projection[2][2], projection[3][2]));
+    CullShader.setVec2("screenSize", glm::vec2((float)width, (float)height));
+    CullShader.setInt("lodCount", (int)Commands.size());
+    CullShader.setVec4("lodRadiusError", LodRadiusError);
+    CullShader.setFloat("lodPixelError", lod.PixelError);
+    CullShader.setFloat("lodHysteresis", lod.Hysteresis);
+    CullShader.setInt("pyramidLevels", PyramidValid ? PyramidLevels : 0);
+    if (PyramidValid) {
+        residency.touch(PyramidResidency);
+        glState.bindTextureUnit(TextureUnit, GL_TEXTURE_2D, Pyramid);
+        CullShader.setInt("depthPyramid", TextureUnit);
+        CullShader.setMat4("pyramidViewFromSpace", PyramidViewFromSpace);
+    }
+
+    if (MovedSpheres != 0)
+        glState.bindBufferRange(GL_SHADER_STORAGE_BUFFER, CullSphereBinding, MovedSpheres, MovedSphereOffset,
+                                std::max(1, SphereCount) * sizeof(glm::vec4));
+    else
+        glState.bindBufferBase(GL_SHADER_STORAGE_BUFFER, CullSphereBinding, SphereBuffer);
+    glState.bindBufferBase(GL_SHADER_STORAGE_BUFFER, CullVisibleBinding, VisibleBuffer);
+    glState.bindBufferBase(GL_SHADER_STORAGE_BUFFER, CullCommandBinding, CommandBuffer);
+    glState.bindBufferBase(GL_SHADER_STORAGE_BUFFER, CullLodBinding, LodBuffer);
+    glDispatchCompute((SphereCount + 63) / 64, 1, 1);
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    // the counts go back through the next stats buffer, unless all of them
+    // still wait to be read, when this frame's are not kept
+    GLsync& fence = StatsFences[StatsWrite];
+    if (fence)
+        return;
+    glState.bindBuffer(GL_COPY_READ_BUFFER, CommandBuffer);
+    glState.bindBuffer(GL_COPY_WRITE_BUFFER, StatsBuffers[StatsWrite]);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, Commands.size() * sizeof(Command));
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    StatsWrite = (StatsWrite + 1) % StatsFrames;
+}
+
+void GpuCuller::draw() const
+{
+    glState.bindVertexArray(VAO);
+    glState.bindBuffer(GL_DRAW_INDIRECT_BUFFER, CommandBuffer);
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, 0, (GLsizei)Commands.size(), 0);
+    frameStats.add("geometry.draw_calls", 1.0);
+}
+
+void GpuCuller::resizePyramid(int width, int height)
+{
+    if (DepthTexture != 0)
+        glState.deleteTextures(1, &DepthTexture);
+    if (Pyramid != 0)
+        glState.deleteTextures(1, &Pyramid);
+    Width = width;
+    Height = height;
+
+    glGenTextures(1, &DepthTexture);
+    glState.activeTexture(GL_TEXTURE0 + TextureUnit);
+    glState.bindTexture(GL_TEXTURE_2D, DepthTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+
+    // level 0 is half the screen, down to a single texel
+    int baseWidth = std::max(1, width / 2), baseHeight = std::max(1, height / 2);
+    PyramidLevels = 1;
+    while ((std::max(baseWidth, baseHeight) >> PyramidLevels) > 0)
+        PyramidLevels++;
+    glGenTextures(1, &Pyramid);
+    glState.bindTexture(GL_TEXTURE_2D, Pyramid);
+    glTexStorage2D(GL_TEXTURE_2D, PyramidLevels, GL_R32F, baseWidth, baseHeight);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    size_t bytes = (size_t)width * height * 4 + mipChainBytes(baseWidth, baseHeight, 4);
+    if (PyramidResidency < 0)
+        PyramidResidency = residency.trackTexture("depth pyramid", bytes);
+    else
+        residency.resize(PyramidResidency, bytes);
+}
+
+void GpuCuller::captureDepth(const glm::mat4& viewFromSpace, int width, int height)
+{
+    if (width <= 0 || height <= 0)
+        return;
+    if (width != Width || height != Height)
+        resizePyramid(width, height);
+    residency.touch(PyramidResidency);
+
+    // copies go to the texture of the active unit
+    glState.activeTexture(GL_TEXTURE0 + TextureUnit);
+    glState.bindTexture(GL_TEXTURE_2D, DepthTexture);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, width, height);
+
+    DepthReduceShader.use();
+    DepthReduceShader.setInt("source", TextureUnit);
+    glBindImageTexture(1, Pyramid, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+    int levelWidth = std::max(1, width / 2), levelHeight = std::max(1, height / 2);
+    glDispatchCompute((levelWidth + 7) / 8, (levelHeight + 7) / 8, 1);
+
+    PyramidReduceShader.use();
+    for (int level = 1; level < PyramidLevels; level++) {
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+        levelWidth = std::max(1, levelWidth / 2);
+        levelHeight = std::max(1, levelHeight / 2);
+        glBindImageTexture(0, Pyramid, level - 1, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+        glBindImageTexture(1, Pyramid, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        glDispatchCompute((levelWidth + 7) / 8, (levelHeight + 7) / 8, 1);
+    }
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+    PyramidViewFromSpace = viewFromSpace;
+    PyramidValid = true;
+}
+
+size_t GpuCuller::reportStats(std::vector<size_t>* levelCounts)
+{
+    // every copy the GPU has finished, oldest first, polled without
+    // waiting; when none has, the counts last read stand for this frame too
+    std::vector<Command> counts(Commands.size());
+    while (StatsFences[StatsRead]) {
+        GLsync& fence = StatsFences[StatsRead];
+        GLenum status = glClientWaitSync(fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            break;
+        glDeleteSync(fence);
+        fence = nullptr;
+        glState.bindBuffer(GL_COPY_READ_BUFFER, StatsBuffers[StatsRead]);
+        glGetBufferSubData(GL_COPY_READ_BUFFER, 0, counts.size() * sizeof(Command), counts.data());
+        LastCounts.resize(counts.size());
+        for (size_t lod = 0; lod < counts.size(); lod++)
+            LastCounts[lod] = counts[lod].InstanceCount;
+        StatsRead = (StatsRead + 1) % StatsFrames;
+    }
+
+    if (levelCounts)
+        levelCounts->assign(Commands.size(), 0);
+    size_t total = 0;
+    for (size_t lod = 0; lod < LastCounts.size(); lod++) {
+        frameStats.add("gpu_cull.lod" + std::to_string(lod), (double)LastCounts[lod]);
+        total += LastCounts[lod];
+        if (levelCounts)
+            (*levelCounts)[lod] = LastCounts[lod];
+    }
+    return total;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "Lod.h"
+#include "Shader.h"
+#include "./Dependencies/glm/glm.hpp"
+
+#include <vector>
+
+class GeometryPool;
+struct SphereSet;
+
+// storage buffer bindings of cull.comp
+const unsigned int CullSphereBinding = 2;
+const unsigned int CullVisibleBinding = 3;
+const unsigned int CullCommandBinding = 4;
+const unsigned int CullLodBinding = 5;
+
+// GPU-driven culling of one instanced mesh. A compute pass tests every
+// instance's bounding sphere against the frustum and against a depth
+// pyramid built from the previous frame, picks a level of detail by
+// screen-space error (with the same hysteresis as selectLod, each
+// instance's level kept in a buffer) and appends the survivors to that level's instance list,
+// counting them into an indirect draw command with an atomic. The CPU
+// uploads a handful of uniforms and the zeroed commands per frame and never
+// touches per-instance data. Occlusion is tested in the view of the frame
+// the pyramid came from, so an instance that comes into view from behind
+// an occluder can be missing for one frame.
+class GpuCuller
+{
+public:
+    static const int MaxLods = LodMaxLevels;
+    // where the pass samples its depth textures, clear of the units the
+    // scene's programs read
+    static const int TextureUnit = 2;
+
+    // compute shaders, storage buffers, image load/store and multi-draw
+    // indirect, all GL 4.3; the macOS context stops at 4.1
+    static bool supported();
+
+    // spheres in the space the instances are drawn in, one pool mesh per
+    // level of detail, most detailed first, each with its geometric error
+    // as a fraction of the bounding radius
+    bool setup(const GeometryPool& pool, const std::vector<int>& lodMeshes, const std::vector<float>& lodRadiusError,
+               const SphereSet& spheres);
+
+    // the spheres of this frame in place of the ones given to setup, count
+    // of them as packed centre and radius at offset in buffer, until the
+    // next call. The instance lists grow to fit; the levels kept for
+    // hysteresis go by index, so instances that change index start from the
+    // level of whichever had theirs before.
+    void moveSpheres(unsigned int buffer, size_t offset, size_t count);
+
+    // fills the indirect commands for this frame, the viewport in pixels
+    void cull(const glm::mat4& viewFromSpace, const glm::mat4& projection, int width, int height, const LodSettings& lod);
+    // every level in one multi-draw with the instance index at attribute 4,
+    // for the program that reads it bound
+    void draw() const;
+    // once the frame is rendered: the read framebuffer's depth becomes the
+    // pyramid for the next cull
+    void captureDepth(const glm::mat4& viewFromSpace, int width, int height);
+
+    // instances drawn per level (gpu_cull.lod<n>) as of the last frame whose
+    // counts the GPU has finished copying back, never waiting on it; returns
+    // their total and, when asked, the count of each level
+    size_t reportStats(std::vector<size_t>* levelCounts = nullptr);
+
+private:
+    // layout fixed by glMultiDrawElementsIndirect
+    struct Command {
+        unsigned int Count;
+        unsigned int InstanceCount;
+        unsigned int FirstIndex;
+        int BaseVertex;
+        unsigned int BaseInstance;
+    };
+
+    Shader CullShader, DepthReduceShader, PyramidReduceShader;
+    std::vector<Command> Commands;
+    glm::vec4 LodRadiusError = glm::vec4(0.0f);
+    int SphereCount = 0;
+    // instances the lists have room for
+    size_t Capacity = 0;
+    size_t SphereBufferBytes = 0;
+
+    unsigned int VAO = 0;
+    unsigned int SphereBuffer = 0, VisibleBuffer = 0, CommandBuffer = 0, LodBuffer = 0;
+    unsigned int MovedSpheres = 0;
+    size_t MovedSphereOffset = 0;
+    // the counts come back through these in turn, each fenced after its
+    // copy and read once the fence has signalled
+    static const int StatsFrames = 3;
+    unsigned int StatsBuffers[StatsFrames] = {};
+    GLsync StatsFences[StatsFrames] = {};
+    int StatsWrite = 0, StatsRead = 0;
+    std::vector<size_t> LastCounts;
+
+    unsigned int DepthTexture = 0, Pyramid = 0;
+    int Width = 0, Height = 0, PyramidLevels = 0;
+    bool PyramidValid = false;
+    glm::mat4 PyramidViewFromSpace;
+    int Residency = -1, PyramidResidency = -1;
+
+    void reserve(size_t count);
+    void resizePyramid(int width, int height);
+};
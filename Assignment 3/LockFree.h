@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// Single writer, single reader triple buffer. The writer fills back() and
+// publishes it with one atomic exchange, the reader picks up the latest
+// published value with another, so neither ever waits for the other and the
+// reader always sees a whole value, skipping any it was too slow for.
+template <typename T>
+class TripleBuffer
+{
+public:
+    TripleBuffer() : Middle(1) {}
+
+    // the writer's slot, left as it was two publishes ago
+    T& back() { return Slots[Back]; }
+    void publish()
+    {
+        Back = Middle.exchange(Back | Fresh, std::memory_order_acq_rel) & IndexMask;
+    }
+
+    // takes the newest published value if there is one; true when front() changed
+    bool update()
+    {
+        if (!(Middle.load(std::memory_order_relaxed) & Fresh))
+            return false;
+        Front = Middle.exchange(Front, std::memory_order_acq_rel) & IndexMask;
+        return true;
+    }
+    const T& front() const { return Slots[Front]; }
+
+private:
+    // the middle slot's index, with a flag for a value the reader has not taken
+    static const unsigned int IndexMask = 3;
+    static const unsigned int Fresh = 4;
+
+    T Slots[3];
+    unsigned int Back = 0, Front = 2;
+    std::atomic<unsigned int> Middle;
+};
+
+// Bounded single producer, single consumer queue on a ring of Capacity slots
+// (a power of two). push() fails rather than waits when the ring is full.
+template <typename T, size_t Capacity>
+class SpscQueue
+{
+public:
+    static_assert((Capacity & (Capacity - 1)) == 0, "SpscQueue capacity must be a power of two");
+
+    SpscQueue() : Head(0), Tail(0) {}
+
+    bool push(const T& value)
+    {
+        size_t head = Head.load(std::memory_order_relaxed);
+        if (head - Tail.load(std::memory_order_acquire) == Capacity)
+            return false;
+        Slots[head & (Capacity - 1)] = value;
+        Head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& value)
+    {
+        size_t tail = Tail.load(std::memory_order_relaxed);
+        if (tail == Head.load(std::memory_order_acquire))
+            return false;
+        value = Slots[tail & (Capacity - 1)];
+        Tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    T Slots[Capacity];
+    // apart, so the two threads do not share a cache line
+    alignas(64) std::atomic<size_t> Head;
+    alignas(64) std::atomic<size_t> Tail;
+};
@@ -0,0 +1,169 @@
+#include "Lod.h"
+#include "GeometryPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+
+// vertices closer than a quarter of the texture apart count as the same
+// side of a seam
+static const float SeamBuckets = 4.0f;
+// levels below this many triangles are not worth a draw of their own
+static const unsigned int MinTriangles = 8;
+
+LodLevel clusterVertices(const Model& model, const std::vector<glm::vec3>& tangents, float cellSize)
+{
+    LodLevel level;
+    if (model.vertices.empty())
+        return level;
+    bool hasTangents = tangents.size() == model.vertices.size();
+
+    glm::vec3 low = model.vertices[0].position;
+    for (const Vertex& vertex : model.vertices)
+        low = glm::min(low, vertex.position);
+
+    // cells give the position, cells split at seams the attributes
+    struct Cell { glm::vec3 Sum; unsigned int Count; };
+    struct Corner { glm::vec2 UV; glm::vec3 Normal, Tangent; unsigned int Cell, Count; };
+    std::unordered_map<uint64_t, unsigned int> cellIds, cornerIds;
+    std::vector<Cell> cells;
+    std::vector<Corner> corners;
+    std::vector<unsigned int> vertexCell(model.vertices.size()), vertexCorner(model.vertices.size());
+    for (size_t i = 0; i < model.vertices.size(); i++) {
+        const Vertex& vertex = model.vertices[i];
+        glm::vec3 grid = glm::floor((vertex.position - low) / cellSize);
+        uint64_t cellKey = (uint64_t)grid.x | (uint64_t)grid.y << 21 | (uint64_t)grid.z << 42;
+        auto cell = cellIds.insert(std::make_pair(cellKey, (unsigned int)cells.size()));
+        if (cell.second)
+            cells.push_back(Cell{ glm::vec3(0.0f), 0 });
+        cells[cell.first->second].Sum += vertex.position;
+        cells[cell.first->second].Count++;
+        vertexCell[i] = cell.first->second;
+
+        glm::vec2 side = glm::floor(vertex.uv * SeamBuckets);
+        uint64_t cornerKey = (uint64_t)cell.first->second << 32 | (uint64_t)(uint16_t)(int)side.x << 16 | (uint16_t)(int)side.y;
+        auto corner = cornerIds.insert(std::make_pair(cornerKey, (unsigned int)corners.size()));
+        if (corner.second)
+            corners.push_back(Corner{ glm::vec2(0.0f), glm::vec3(0.0f), glm::vec3(0.0f), cell.first->second, 0 });
+        Corner& merged = corners[corner.first->second];
+        merged.UV += vertex.uv;
+        merged.Normal += vertex.normal;
+        if (hasTangents)
+            merged.Tangent += tangents[i];
+        merged.Count++;
+        vertexCorner[i] = corner.first->second;
+    }
+
+    for (size_t i = 0; i < model.vertices.size(); i++) {
+        const Cell& cell = cells[vertexCell[i]];
+        level.Error = std::max(level.Error, glm::length(model.vertices[i].position - cell.Sum / (float)cell.Count));
+    }
+
+    // triangles that still span three cells, with only the corners they use
+    std::vector<unsigned int> remap(corners.size(), ~0u);
+    for (size_t i = 0; i + 2 < model.indices.size(); i += 3) {
+        unsigned int a = model.indices[i], b = model.indices[i + 1], c = model.indices[i + 2];
+        if (vertexCell[a] == vertexCell[b] || vertexCell[b] == vertexCell[c] || vertexCell[a] == vertexCell[c])
+            continue;
+        for (unsigned int original : { a, b, c }) {
+            unsigned int& index = remap[vertexCorner[original]];
+            if (index == ~0u) {
+                const Corner& corner = corners[vertexCorner[original]];
+                const Cell& cell = cells[corner.Cell];
+                Vertex vertex;
+                vertex.position = cell.Sum / (float)cell.Count;
+                vertex.uv = corner.UV / (float)corner.Count;
+                vertex.normal = glm::length(corner.Normal) > 0.0f ? glm::normalize(corner.Normal) : model.vertices[original].normal;
+                index = (unsigned int)level.Mesh.vertices.size();
+                level.Mesh.vertices.push_back(vertex);
+                if (hasTangents) {
+                    // back at right angles to the averaged normal
+                    glm::vec3 tangent = corner.Tangent - vertex.normal * glm::dot(vertex.normal, corner.Tangent);
+                    level.Tangents.push_back(glm::length(tangent) > 0.0f ? glm::normalize(tangent) : tangents[original]);
+                }
+            }
+            level.Mesh.indices.push_back(index);
+        }
+    }
+    return level;
+}
+
+std::vector<LodLevel> buildLodLevels(const Model& model, const std::vector<glm::vec3>& tangents, int maxLevels)
+{
+    std::vector<LodLevel> levels(1);
+    levels[0].Mesh = model;
+    levels[0].Tangents = tangents;
+    if (model.vertices.empty())
+        return levels;
+
+    glm::vec3 low = model.vertices[0].position, high = low;
+    for (const Vertex& vertex : model.vertices) {
+        low = glm::min(low, vertex.position);
+        high = glm::max(high, vertex.position);
+    }
+    float extent = std::max(high.x - low.x, std::max(high.y - low.y, high.z - low.z));
+
+    // grow the cells until the level is down to its share of triangles
+    float cellSize = extent / 256.0f;
+    while ((int)levels.size() < maxLevels) {
+        size_t previous = levels.back().Mesh.indices.size() / 3;
+        size_t target = previous / 3;
+        LodLevel level;
+        do {
+            cellSize *= 1.25f;
+            level = clusterVertices(model, tangents, cellSize);
+        } while (level.Mesh.indices.size() / 3 > target && cellSize < extent);
+
+        size_t triangles = level.Mesh.indices.size() / 3;
+        if (triangles < MinTriangles || triangles >= previous)
+            break;
+        level.Error = std::max(level.Error, levels.back().Error);
+        levels.push_back(level);
+    }
+    return levels;
+}
+
+void LodChain::add(GeometryPool& pool, const std::vector<LodLevel>& levels)
+{
+    Meshes.clear();
+    Error.clear();
+    Triangles.clear();
+    for (const LodLevel& level : levels) {
+        Meshes.push_back(pool.add(level.Mesh, level.Tangents));
+        Error.push_back(level.Error);
+        Triangles.push_back((unsigned int)(level.Mesh.indices.size() / 3));
+    }
+}
+
+LodView LodView::fromProjection(const glm::mat4& projection, int viewportHeight)
+{
+    // glm::perspective puts 1 / tan(fovy / 2) in [1][1]; the near plane
+    // comes back out of the depth terms
+    LodView view;
+    view.Scale = projection[1][1] * 0.5f * (float)viewportHeight;
+    view.Near = projection[3][2] / (projection[2][2] - 1.0f);
+    return view;
+}
+
+int selectLod(const float* errors, int levels, float pixelsPerUnit, int current, const LodSettings& settings)
+{
+    if (levels <= 1)
+        return 0;
+    current = std::min(std::max(current, 0), levels - 1);
+    float threshold = settings.PixelError;
+
+    int target = 0;
+    while (target + 1 < levels && errors[target + 1] * pixelsPerUnit <= threshold)
+        target++;
+
+    if (target > current) {
+        // coarser, but only as far as the levels comfortably under the threshold
+        while (target > current && errors[target] * pixelsPerUnit > threshold * (1.0f - settings.Hysteresis))
+            target--;
+        return target;
+    }
+    if (target < current && errors[current] * pixelsPerUnit > threshold * (1.0f + settings.Hysteresis))
+        return target;
+    return current;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "Misc.h"
+#include "./Dependencies/glm/glm.hpp"
+
+#include <vector>
+
+class GeometryPool;
+
+// most levels any mesh is built with, the GPU culler's limit too
+const int LodMaxLevels = 4;
+
+struct LodSettings {
+    // largest screen-space error a level may show, in pixels
+    float PixelError = 1.0f;
+    // a level is kept until its error is this fraction over the threshold,
+    // and a coarser one only taken once its error is this fraction under,
+    // so objects hovering at a boundary do not pop back and forth
+    float Hysteresis = 0.25f;
+};
+
+// One generated level: the mesh, its tangents when the source had them and
+// the farthest any vertex moved from where the full mesh has it.
+struct LodLevel {
+    Model Mesh;
+    std::vector<glm::vec3> Tangents;
+    float Error = 0.0f;
+};
+
+// Vertex clustering: vertices in the same cell of a grid collapse to their
+// mean and triangles left with less than three corners go. Vertices of one
+// cell stay apart across texture seams (and keep their own UVs), but share
+// the position, so no cracks open along the seam.
+LodLevel clusterVertices(const Model& model, const std::vector<glm::vec3>& tangents, float cellSize);
+
+// The mesh itself followed by up to maxLevels - 1 coarser ones, each with
+// about a third of the triangles of the one before, for meshes that ship
+// with a single level. Stops early when a level would have too few
+// triangles to be worth it. Errors never decrease down the chain.
+std::vector<LodLevel> buildLodLevels(const Model& model, const std::vector<glm::vec3>& tangents = std::vector<glm::vec3>(),
+                                     int maxLevels = LodMaxLevels);
+
+// A mesh at every level of detail in a GeometryPool, most detailed first.
+struct LodChain {
+    std::vector<int> Meshes;
+    std::vector<float> Error;               // in model units, 0 for level 0
+    std::vector<unsigned int> Triangles;
+
+    void add(GeometryPool& pool, const std::vector<LodLevel>& levels);
+    int levels() const { return (int)Meshes.size(); }
+};
+
+// Screen-space error of a glm::perspective view: a geometric error e seen
+// at distance d covers e * Scale / d pixels of the viewport's height.
+struct LodView {
+    float Scale = 1.0f;
+    float Near = 0.1f;
+
+    static LodView fromProjection(const glm::mat4& projection, int viewportHeight);
+
+    // pixels per model unit at the nearest point of an object's bounding
+    // sphere, for a model matrix that scales by objectScale
+    float pixelsPerUnit(float objectScale, float centreDistance, float radius) const
+    {
+        float distance = centreDistance - radius;
+        return Scale * objectScale / (distance > Near ? distance : Near);
+    }
+};
+
+// The coarsest level whose error stays under the threshold, moving away from
+// the current level only past the hysteresis band.
+int selectLod(const float* errors, int levels, float pixelsPerUnit, int current, const LodSettings& settings);
+
+inline int selectLod(const LodChain& chain, float pixelsPerUnit, int current, const LodSettings& settings)
+{
+    return selectLod(chain.Error.data(), chain.levels(), pixelsPerUnit, current, settings);
+}
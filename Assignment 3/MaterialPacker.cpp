@@ -0,0 +1,205 @@
+#include "MaterialPacker.h"
+#include "GLState.h"
+#include "Residency.h"
+#include "Texture.h"
+
+#include "./Dependencies/glew/glew.h"
+#include "./Dependencies/stb_image/stb_image.h"
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <utility>
+
+// halve with a 2x2 box filter while the image is at least twice the target,
+// then finish with a bilinear resample
+static std::vector<unsigned char> resizeRGBA(const std::vector<unsigned char>& src, int width, int height,
+                                             int newWidth, int newHeight)
+{
+    std::vector<unsigned char> current = src;
+    while (width >= 2 * newWidth && height >= 2 * newHeight)
+        current = halveImage(current, width, height, 4);
+    if (width == newWidth && height == newHeight)
+        return current;
+
+    std::vector<unsigned char> out((size_t)newWidth * newHeight * 4);
+    for (int y = 0; y < newHeight; y++) {
+        float sy = std::max(0.0f, (y + 0.5f) * height / newHeight - 0.5f);
+        int y0 = std::min((int)sy, height - 1), y1 = std::min(y0 + 1, height - 1);
+        float fy = sy - y0;
+        for (int x = 0; x < newWidth; x++) {
+            float sx = std::max(0.0f, (x + 0.5f) * width / newWidth - 0.5f);
+            int x0 = std::min((int)sx, width - 1), x1 = std::min(x0 + 1, width - 1);
+            float fx = sx - x0;
+            for (int c = 0; c < 4; c++) {
+                float top = current[((size_t)y0 * width + x0) * 4 + c] * (1 - fx) + current[((size_t)y0 * width + x1) * 4 + c] * fx;
+                float bottom = current[((size_t)y1 * width + x0) * 4 + c] * (1 - fx) + current[((size_t)y1 * width + x1) * 4 + c] * fx;
+                out[((size_t)y * newWidth + x) * 4 + c] = (unsigned char)(top * (1 - fy) + bottom * fy + 0.5f);
+            }
+        }
+    }
+    return out;
+}
+
+// empty if the file cannot be read
+static std::vector<unsigned char> loadRGBA(const char* texturePath, int& width, int& height)
+{
+    // tell stb_image.h to flip loaded texture's on the y-axis.
+    stbi_set_flip_vertically_on_load(true);
+    int bpp;
+    unsigned char* data = stbi_load(texturePath, &width, &height, &bpp, 4);
+    if (!data)
+        return std::vector<unsigned char>();
+    std::vector<unsigned char> pixels(data, data + (size_t)width * height * 4);
+    stbi_image_free(data);
+    return pixels;
+}
+
+Material* MaterialPacker::add(const char* texturePath)
+{
+    std::unique_ptr<Entry> entry(new Entry());
+    entry->Path = texturePath;
+    entry->Pixels = loadRGBA(texturePath, entry->Width, entry->Height);
+    if (entry->Pixels.empty()) {
+        std::cout << "Failed to load texture: " << texturePath << std::endl;
+        exit(1);
+    }
+
+    Material* handle = &entry->Handle;
+    Entries.push_back(std::move(entry));
+    return handle;
+}
+
+size_t MaterialPacker::upload(PackedArray& array, int firstLevel, unsigned int copyFrom)
+{
+    glGenTextures(1, &array.ID);
+    glState.bindTexture(GL_TEXTURE_2D_ARRAY, array.ID);
+
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+
+    // every level is specified before any is copied, copies need the texture complete
+    int levels = (int)array.Levels.size();
+    int width = std::max(1, array.Width >> firstLevel), height = std::max(1, array.Height >> firstLevel);
+    for (int level = firstLevel, w = width, h = height; level < levels; level++) {
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, level - firstLevel, GL_RGBA8, w, h, array.Layers, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                     copyFrom ? NULL : array.Levels[level].data());
+        w = std::max(1, w / 2);
+        h = std::max(1, h / 2);
+    }
+    for (int level = firstLevel, w = width, h = height; copyFrom && level < levels; level++) {
+        glCopyImageSubData(copyFrom, GL_TEXTURE_2D_ARRAY, level - array.Dropped, 0, 0, 0,
+                           array.ID, GL_TEXTURE_2D_ARRAY, level - firstLevel, 0, 0, 0, w, h, array.Layers);
+        w = std::max(1, w / 2);
+        h = std::max(1, h / 2);
+    }
+    glState.bindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    array.Dropped = firstLevel;
+    array.Bytes = mipChainBytes(width, height, 4, array.Layers);
+    return array.Bytes;
+}
+
+void MaterialPacker::build(bool resizeToCommonSize)
+{
+    // group by size, optionally folding every group into the most common size
+    std::map<std::pair<int, int>, std::vector<Entry*>> groups;
+    for (const std::unique_ptr<Entry>& entry : Entries)
+        groups[std::make_pair(entry->Width, entry->Height)].push_back(entry.get());
+
+    if (resizeToCommonSize && groups.size() > 1) {
+        std::pair<int, int> common = groups.begin()->first;
+        for (auto& group : groups)
+            if (group.second.size() > groups[common].size() ||
+                (group.second.size() == groups[common].size() && group.first.first * group.first.second > common.first * common.second))
+                common = group.first;
+
+        std::vector<Entry*> merged;
+        for (auto& group : groups)
+            for (Entry* entry : group.second) {
+                if (group.first != common) {
+                    std::cout << "Resize " << entry->Path << " to " << common.first << "x" << common.second << std::endl;
+                    entry->Pixels = resizeRGBA(entry->Pixels, entry->Width, entry->Height, common.first, common.second);
+                    entry->Width = common.first;
+                    entry->Height = common.second;
+                }
+                merged.push_back(entry);
+            }
+        groups.clear();
+        groups[common] = merged;
+    }
+
+    for (auto& group : groups) {
+        PackedArray array;
+        array.Width = group.first.first;
+        array.Height = group.first.second;
+
+        array.Layers = (int)group.second.size();
+
+        // the whole chain stays in memory, dropped levels come back from it
+        size_t layerBytes = (size_t)array.Width * array.Height * 4;
+        array.Levels.emplace_back();
+        array.Levels.back().reserve(layerBytes * array.Layers);
+        for (size_t layer = 0; layer < group.second.size(); layer++) {
+            Entry* entry = group.second[layer];
+            entry->Handle.Array = (int)Arrays.size();
+            entry->Handle.Layer = (int)layer;
+            array.Levels.back().insert(array.Levels.back().end(), entry->Pixels.begin(), entry->Pixels.end());
+            std::vector<unsigned char>().swap(entry->Pixels);
+        }
+        for (int width = array.Width, height = array.Height; width > 1 || height > 1;) {
+            const std::vector<unsigned char>& above = array.Levels.back();
+            size_t aboveBytes = (size_t)width * height * 4;
+            std::vector<unsigned char> level;
+            int halfWidth = width, halfHeight = height;
+            for (int layer = 0; layer < array.Layers; layer++) {
+                halfWidth = width;
+                halfHeight = height;
+                std::vector<unsigned char> image(above.begin() + layer * aboveBytes, above.begin() + (layer + 1) * aboveBytes);
+                image = halveImage(image, halfWidth, halfHeight, 4);
+                level.insert(level.end(), image.begin(), image.end());
+            }
+            width = halfWidth;
+            height = halfHeight;
+            array.Levels.push_back(std::move(level));
+        }
+        size_t bytes = upload(array, 0);
+
+        // at most down to 16 texels on the short side
+        int maxDropped = 0;
+        while ((std::min(array.Width, array.Height) >> (maxDropped + 1)) >= 16)
+            maxDropped++;
+        int index = (int)Arrays.size();
+        array.Residency = residency.trackTexture("material array " + std::to_string(index), bytes, maxDropped,
+                                                 [this, index](int dropped) { return setDroppedLevels(index, dropped); });
+
+        std::cout << "Pack " << group.second.size() << " textures into a " << array.Width << "x" << array.Height
+                  << " texture array successfully!" << std::endl;
+        Arrays.push_back(std::move(array));
+    }
+}
+
+size_t MaterialPacker::setDroppedLevels(int index, int droppedLevels)
+{
+    // dropping, the levels that stay are on the GPU already and are copied
+    // there (GL 4.3); restoring, or without copies, they come from memory
+    PackedArray& array = Arrays[index];
+    unsigned int old = array.ID;
+    bool copy = droppedLevels > array.Dropped && (GLEW_VERSION_4_3 || GLEW_ARB_copy_image);
+    size_t bytes = upload(array, droppedLevels, copy ? old : 0);
+    glState.deleteTextures(1, &old);
+    return bytes;
+}
+
+void MaterialPacker::bind(const Material& material, unsigned int slot) const
+{
+    residency.touch(Arrays[material.Array].Residency);
+    glState.bindTextureUnit(slot, GL_TEXTURE_2D_ARRAY, Arrays[material.Array].ID);
+}
+
+void MaterialPacker::unbind() const
+{
+    glState.bindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
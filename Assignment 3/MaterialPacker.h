@@ -0,0 +1,59 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// where a packed texture ended up: which array texture and which layer of it
+struct Material {
+    int Array = -1;
+    int Layer = 0;
+};
+
+// Packs textures into GL_TEXTURE_2D_ARRAYs so draws that share an array only
+// switch a layer index instead of rebinding textures. Everything is stored as
+// RGBA8; textures of a different size are resized to the most common size so
+// they can share one array.
+class MaterialPacker
+{
+public:
+    // queue a texture file, the returned handle is valid after build()
+    Material* add(const char* texturePath);
+    void build(bool resizeToCommonSize = true);
+
+    void bind(const Material& material, unsigned int slot) const;
+    void unbind() const;
+
+    int arrayCount() const { return (int)Arrays.size(); }
+
+    // re-create one array without its top mip levels, returns the new size in
+    // bytes; never reads the disk, levels kept are copied on the GPU or come
+    // from the chain in memory
+    size_t setDroppedLevels(int array, int droppedLevels);
+
+private:
+    struct Entry {
+        std::string Path;
+        int Width = 0, Height = 0;
+        std::vector<unsigned char> Pixels;
+        Material Handle;
+    };
+
+    struct PackedArray {
+        unsigned int ID = 0;
+        int Width = 0, Height = 0, Layers = 0;
+        int Residency = -1;
+        size_t Bytes = 0;
+        // the whole mip chain, each level every layer after another, and how
+        // many of its top levels the texture is without
+        std::vector<std::vector<unsigned char>> Levels;
+        int Dropped = 0;
+    };
+
+    // owned one by one, so the handles add() gave out keep their addresses
+    std::vector<std::unique_ptr<Entry>> Entries;
+    std::vector<PackedArray> Arrays;
+
+    // the chain from firstLevel on, from memory or copied from the texture copyFrom
+    size_t upload(PackedArray& array, int firstLevel, unsigned int copyFrom = 0);
+};
@@ -0,0 +1,220 @@
+#include "NormalBaker.h"
+#include "Parallel.h"
+#include "Simd.h"
+#include "VirtualTexture.h"
+
+#include "./Dependencies/stb_image/stb_image.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+// DDS header for uncompressed RGBA8 with mipmaps, as 32 little endian dwords
+static void writeDdsHeader(unsigned char* dst, int width, int height, int levels)
+{
+    uint32_t header[32] = {};
+    memcpy(&header[0], "DDS ", 4);
+    header[1] = 124;                                                // header size
+    header[2] = 0x1 | 0x2 | 0x4 | 0x8 | 0x1000 | 0x20000;           // caps, height, width, pitch, pixel format, mipmap count
+    header[3] = height;
+    header[4] = width;
+    header[5] = width * 4;                                          // pitch
+    header[7] = levels;
+    header[19] = 32;                                                // pixel format size
+    header[20] = 0x1 | 0x40;                                        // alpha pixels, RGB
+    header[22] = 32;                                                // bits per pixel
+    header[23] = 0x000000ff;                                        // R, G, B, A masks
+    header[24] = 0x0000ff00;
+    header[25] = 0x00ff0000;
+    header[26] = 0xff000000;
+    header[27] = 0x8 | 0x1000 | 0x400000;                           // complex, texture, mipmap
+    memcpy(dst, header, sizeof(header));
+}
+
+// decoded heights of one row with a texel of padding on either side
+// (wrapped or clamped) and room for a full SIMD step past the end
+static void fillRow(float* row, const uint16_t* heights, int width, int height, int y, bool spherical, float scale)
+{
+    // stepping over a pole lands on the same latitude half way around the sphere
+    int shift = 0;
+    if (y < 0 || y >= height) {
+        y = y < 0 ? -1 - y : 2 * height - 1 - y;
+        y = std::min(std::max(y, 0), height - 1);
+        shift = spherical ? width / 2 : 0;
+    }
+    const uint16_t* src = heights + (size_t)y * width;
+
+    if (shift == 0) {
+        int x = 0;
+        for (; x + 8 <= width; x += 8)
+            (float8::loadU16(src + x) * float8(scale)).store(row + 1 + x);
+        for (; x < width; x++)
+            row[1 + x] = src[x] * scale;
+    }
+    else {
+        for (int x = 0; x < width; x++)
+            row[1 + x] = src[(x + shift) % width] * scale;
+    }
+
+    row[0] = spherical ? row[width] : row[1];
+    row[width + 1] = spherical ? row[1] : row[width];
+    for (int x = width + 2; x < width + 10; x++)
+        row[x] = row[width + 1];
+}
+
+static void bakeLevel0(const uint16_t* heights, int width, int height, const NormalBakeSettings& settings, unsigned char* dst)
+{
+    const float Pi = 3.14159265358979f;
+    // heights in texels, Scharr weights 3-10-3 over a 2 texel span
+    float scale = settings.Strength / 65535.0f;
+    float kernelNorm = 1.0f / 32.0f;
+    size_t rowFloats = (size_t)width + 10;
+
+    parallelFor(height, 16, [&](size_t begin, size_t end) {
+        std::vector<float> buffer(rowFloats * 3);
+        float* above = buffer.data();
+        float* centre = above + rowFloats;
+        float* below = centre + rowFloats;
+        fillRow(above, heights, width, height, (int)begin - 1, settings.Spherical, scale);
+        fillRow(centre, heights, width, height, (int)begin, settings.Spherical, scale);
+
+        float r[8], g[8], b[8];
+        for (size_t y = begin; y < end; y++) {
+            fillRow(below, heights, width, height, (int)y + 1, settings.Spherical, scale);
+
+            // an east-west texel at latitude phi is only cos(phi) as wide as at the equator
+            float xScale = kernelNorm;
+            if (settings.Spherical) {
+                float latitude = (0.5f - (y + 0.5f) / height) * Pi;
+                xScale /= std::cos(latitude) * 2.0f * height / width;
+            }
+            float8 dxScale(xScale), dyScale(kernelNorm), three(3.0f), ten(10.0f);
+
+            unsigned char* out = dst + (size_t)y * width * 4;
+            for (int x = 0; x < width; x += 8) {
+                float8 tl = float8::load(above + x), tm = float8::load(above + x + 1), tr = float8::load(above + x + 2);
+                float8 ml = float8::load(centre + x), mr = float8::load(centre + x + 2);
+                float8 bl = float8::load(below + x), bm = float8::load(below + x + 1), br = float8::load(below + x + 2);
+
+                float8 gx = fmadd(three, (tr - tl) + (br - bl), ten * (mr - ml)) * dxScale;
+                float8 gy = fmadd(three, (bl - tl) + (br - tr), ten * (bm - tm)) * dyScale;
+
+                // n = (-dh/du, -dh/dv, 1) with v pointing up, rows running down
+                float8 invLen = float8(1.0f) / sqrt(fmadd(gx, gx, fmadd(gy, gy, float8(1.0f))));
+                float8 half(127.5f);
+                fmadd(-gx * invLen, half, half).store(r);
+                fmadd(gy * invLen, half, half).store(g);
+                fmadd(invLen, half, half).store(b);
+
+                int count = std::min(8, width - x);
+                for (int i = 0; i < count; i++) {
+                    unsigned char* texel = out + (size_t)(x + i) * 4;
+                    texel[0] = (unsigned char)(r[i] + 0.5f);
+                    texel[1] = (unsigned char)(g[i] + 0.5f);
+                    texel[2] = (unsigned char)(b[i] + 0.5f);
+                    texel[3] = 255;
+                }
+            }
+            std::swap(above, centre);
+            std::swap(centre, below);
+        }
+    });
+}
+
+// average of the decoded 2x2 normals, renormalized
+static void bakeMip(const unsigned char* src, int srcWidth, int srcHeight, unsigned char* dst, int width, int height)
+{
+    parallelFor(height, 32, [&](size_t begin, size_t end) {
+        for (size_t y = begin; y < end; y++) {
+            int y0 = std::min((int)y * 2, srcHeight - 1), y1 = std::min((int)y * 2 + 1, srcHeight - 1);
+            for (int x = 0; x < width; x++) {
+                int x0 = std::min(x * 2, srcWidth - 1), x1 = std::min(x * 2 + 1, srcWidth - 1);
+                const unsigned char* taps[4] = {
+                    src + ((size_t)y0 * srcWidth + x0) * 4, src + ((size_t)y0 * srcWidth + x1) * 4,
+                    src + ((size_t)y1 * srcWidth + x0) * 4, src + ((size_t)y1 * srcWidth + x1) * 4
+                };
+                float n[3] = { 0.0f, 0.0f, 0.0f };
+                for (const unsigned char* tap : taps)
+                    for (int c = 0; c < 3; c++)
+                        n[c] += tap[c] / 127.5f - 1.0f;
+                float len = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+                float inv = len > 0.0f ? 1.0f / len : 0.0f;
+
+                unsigned char* texel = dst + ((size_t)y * width + x) * 4;
+                for (int c = 0; c < 3; c++)
+                    texel[c] = (unsigned char)((n[c] * inv * 0.5f + 0.5f) * 255.0f + 0.5f);
+                texel[3] = 255;
+            }
+        }
+    });
+}
+
+bool bakeNormalMap(const NormalBakeSettings& settings)
+{
+    auto start = std::chrono::steady_clock::now();
+    const char* path = settings.HeightPath.c_str();
+
+    // rows top first, the way DDS stores them
+    stbi_set_flip_vertically_on_load(false);
+    int width, height, channels;
+    std::vector<uint16_t> widened;
+    stbi_us* heights16 = nullptr;
+    if (stbi_is_16_bit(path)) {
+        heights16 = stbi_load_16(path, &width, &height, &channels, 1);
+    }
+    else {
+        stbi_uc* heights8 = stbi_load(path, &width, &height, &channels, 1);
+        if (heights8) {
+            widened.resize((size_t)width * height);
+            for (size_t i = 0; i < widened.size(); i++)
+                widened[i] = (uint16_t)(heights8[i] * 257);
+            stbi_image_free(heights8);
+        }
+    }
+    const uint16_t* heights = heights16 ? heights16 : (widened.empty() ? nullptr : widened.data());
+    if (!heights) {
+        std::cout << "Failed to load heightmap: " << path << std::endl;
+        return false;
+    }
+    auto loaded = std::chrono::steady_clock::now();
+
+    int levels = 1;
+    while ((std::max(width, height) >> levels) > 0)
+        levels++;
+    std::vector<size_t> offsets;
+    size_t fileSize = 128;
+    for (int level = 0; level < levels; level++) {
+        offsets.push_back(fileSize);
+        fileSize += (size_t)std::max(1, width >> level) * std::max(1, height >> level) * 4;
+    }
+
+    MappedFile out;
+    if (!out.create(settings.OutputPath.c_str(), fileSize)) {
+        std::cout << "Failed to create normal map: " << settings.OutputPath << std::endl;
+        if (heights16)
+            stbi_image_free(heights16);
+        return false;
+    }
+    writeDdsHeader(out.data, width, height, levels);
+
+    bakeLevel0(heights, width, height, settings, out.data + offsets[0]);
+    if (heights16)
+        stbi_image_free(heights16);
+    for (int level = 1; level < levels; level++)
+        bakeMip(out.data + offsets[level - 1], std::max(1, width >> (level - 1)), std::max(1, height >> (level - 1)),
+                out.data + offsets[level], std::max(1, width >> level), std::max(1, height >> level));
+    out.close();
+
+    auto done = std::chrono::steady_clock::now();
+    double loadSeconds = std::chrono::duration<double>(loaded - start).count();
+    double bakeSeconds = std::chrono::duration<double>(done - loaded).count();
+    std::cout << "Bake " << width << "x" << height << " normal map with " << levels << " levels into "
+              << settings.OutputPath << ": load " << loadSeconds << " s, bake " << bakeSeconds << " s ("
+              << (double)width * height / bakeSeconds / 1e6 << " Mtexel/s on "
+              << ThreadPool::instance().threadCount() << " threads)" << std::endl;
+    return true;
+}
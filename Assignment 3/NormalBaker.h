@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+
+struct NormalBakeSettings {
+    std::string HeightPath;
+    std::string OutputPath;
+    // height of a full-white texel, in texels of the equator
+    float Strength = 8.0f;
+    // equirectangular map of a sphere: wrap at the longitude seam, continue
+    // across the poles and widen the slope as texels shrink towards them
+    bool Spherical = true;
+};
+
+// Offline baker behind --bake-normal: turns a heightmap (8 or 16 bit, any
+// stb_image format) into a tangent-space normal map with a Scharr kernel,
+// bands of rows in parallel and 8 texels per SIMD step. Writes an
+// uncompressed RGBA8 DDS with the full mip chain, rows top first.
+bool bakeNormalMap(const NormalBakeSettings& settings);
@@ -0,0 +1,274 @@
+#include "Occlusion.h"
+#include "Culling.h"
+#include "Parallel.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// a triangle set up for rasterization in pixels: three edge functions that
+// are >= 0 inside, the plane of 1 / w and the tiles its bounds overlap
+struct OcclusionBuffer::Triangle {
+    float EdgeA[3], EdgeB[3], EdgeC[3];
+    float DepthA, DepthB, DepthC;
+    float MinDepth;
+    int TileX0, TileY0, TileX1, TileY1;
+};
+
+void OcclusionBuffer::setup(int width, int height)
+{
+    TilesX = (width + TileSize - 1) / TileSize;
+    TilesY = (height + TileSize - 1) / TileSize;
+    BlocksX = (TilesX + BlockTiles - 1) / BlockTiles;
+    BlocksY = (TilesY + BlockTiles - 1) / BlockTiles;
+    Tiles.resize((size_t)TilesX * TilesY);
+    Blocks.resize((size_t)BlocksX * BlocksY);
+    begin(glm::mat4(1.0f));
+}
+
+void OcclusionBuffer::begin(const glm::mat4& projection)
+{
+    ScaleX = projection[0][0];
+    ScaleY = projection[1][1];
+    Near = projection[3][2] / (projection[2][2] - 1.0f);
+    Tile empty = { 0, 0.0f, 0.0f };
+    std::fill(Tiles.begin(), Tiles.end(), empty);
+    std::fill(Blocks.begin(), Blocks.end(), 0.0f);
+}
+
+void OcclusionBuffer::rasterize(const glm::mat4& viewFromModel, const std::vector<glm::vec3>& vertices, const std::vector<uint32_t>& indices)
+{
+    float width = (float)this->width(), height = (float)this->height();
+
+    // to pixels with y up, depth as 1 / w
+    std::vector<glm::vec3> screen(vertices.size());
+    std::vector<bool> clipped(vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++) {
+        glm::vec3 view = glm::vec3(viewFromModel * glm::vec4(vertices[i], 1.0f));
+        float w = -view.z;
+        clipped[i] = w < Near;
+        float depth = 1.0f / w;
+        screen[i] = glm::vec3((ScaleX * view.x * depth * 0.5f + 0.5f) * width, (ScaleY * view.y * depth * 0.5f + 0.5f) * height, depth);
+    }
+
+    std::vector<Triangle> triangles;
+    triangles.reserve(indices.size() / 3);
+    for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+        uint32_t i0 = indices[i], i1 = indices[i + 1], i2 = indices[i + 2];
+        if (clipped[i0] || clipped[i1] || clipped[i2])
+            continue;
+        const glm::vec3 &v0 = screen[i0], &v1 = screen[i1], &v2 = screen[i2];
+
+        // counter-clockwise, so front facing triangles have positive area
+        float area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+        if (!(area > 0.0f))
+            continue;
+
+        Triangle triangle;
+        const glm::vec3* corners[3] = { &v0, &v1, &v2 };
+        for (int e = 0; e < 3; e++) {
+            const glm::vec3& a = *corners[e];
+            const glm::vec3& b = *corners[(e + 1) % 3];
+            triangle.EdgeA[e] = a.y - b.y;
+            triangle.EdgeB[e] = b.x - a.x;
+            triangle.EdgeC[e] = -(triangle.EdgeA[e] * a.x + triangle.EdgeB[e] * a.y);
+        }
+        triangle.DepthA = ((v1.z - v0.z) * (v2.y - v0.y) - (v2.z - v0.z) * (v1.y - v0.y)) / area;
+        triangle.DepthB = ((v1.x - v0.x) * (v2.z - v0.z) - (v2.x - v0.x) * (v1.z - v0.z)) / area;
+        triangle.DepthC = v0.z - triangle.DepthA * v0.x - triangle.DepthB * v0.y;
+        triangle.MinDepth = std::min(v0.z, std::min(v1.z, v2.z));
+
+        float minX = std::min(v0.x, std::min(v1.x, v2.x)), maxX = std::max(v0.x, std::max(v1.x, v2.x));
+        float minY = std::min(v0.y, std::min(v1.y, v2.y)), maxY = std::max(v0.y, std::max(v1.y, v2.y));
+        if (maxX < 0.0f || maxY < 0.0f || minX >= width || minY >= height)
+            continue;
+        triangle.TileX0 = std::max(0, (int)minX / TileSize);
+        triangle.TileY0 = std::max(0, (int)minY / TileSize);
+        triangle.TileX1 = std::min(TilesX - 1, (int)maxX / TileSize);
+        triangle.TileY1 = std::min(TilesY - 1, (int)maxY / TileSize);
+        triangles.push_back(triangle);
+    }
+    if (triangles.empty())
+        return;
+
+    // every band sees all triangles in the same order, so the result does
+    // not depend on how the rows were split
+    parallelFor(TilesY, 2, [&](size_t begin, size_t end) {
+        rasterizeBand(triangles, (int)begin, (int)end);
+    });
+}
+
+void OcclusionBuffer::rasterizeBand(const std::vector<Triangle>& triangles, int firstRow, int endRow)
+{
+    const uint64_t full = ~(uint64_t)0;
+    const float last = (float)(TileSize - 1);
+
+    for (const Triangle& triangle : triangles) {
+        int y0 = std::max(triangle.TileY0, firstRow), y1 = std::min(triangle.TileY1, endRow - 1);
+        for (int ty = y0; ty <= y1; ty++) {
+            for (int tx = triangle.TileX0; tx <= triangle.TileX1; tx++) {
+                // pixel centres of the tile
+                float px = tx * TileSize + 0.5f, py = ty * TileSize + 0.5f;
+
+                // one row of 8 pixels per step, stepping the edges down the rows
+                float8 xs = float8::ramp(px, 1.0f);
+                float8 e0 = fmadd(float8(triangle.EdgeA[0]), xs, float8(triangle.EdgeB[0] * py + triangle.EdgeC[0]));
+                float8 e1 = fmadd(float8(triangle.EdgeA[1]), xs, float8(triangle.EdgeB[1] * py + triangle.EdgeC[1]));
+                float8 e2 = fmadd(float8(triangle.EdgeA[2]), xs, float8(triangle.EdgeB[2] * py + triangle.EdgeC[2]));
+                float8 step0(triangle.EdgeB[0]), step1(triangle.EdgeB[1]), step2(triangle.EdgeB[2]), zero(0.0f);
+                uint64_t mask = 0;
+                for (int row = 0; row < TileSize; row++) {
+                    float8 inside = (e0 >= zero) & (e1 >= zero) & (e2 >= zero);
+                    mask |= (uint64_t)moveMask(inside) << (row * TileSize);
+                    e0 += step0;
+                    e1 += step1;
+                    e2 += step2;
+                }
+                if (mask == 0)
+                    continue;
+
+                // the farthest the triangle gets over the tile, the plane is
+                // extreme at a corner and never beyond the farthest vertex
+                float depthX0 = triangle.DepthA * px, depthX1 = triangle.DepthA * (px + last);
+                float depthY0 = triangle.DepthB * py + triangle.DepthC, depthY1 = triangle.DepthB * (py + last) + triangle.DepthC;
+                float depth = std::min(std::min(depthX0, depthX1) + depthY0, std::min(depthX0, depthX1) + depthY1);
+                depth = std::max(depth, triangle.MinDepth);
+
+                Tile& tile = Tiles[(size_t)ty * TilesX + tx];
+                if (depth <= tile.Far0)
+                    continue;
+                if (mask == full) {
+                    tile.Far0 = depth;
+                    if (tile.Far1 <= tile.Far0)
+                        tile.Mask = 0;
+                    continue;
+                }
+                // a triangle much nearer than the working layer starts a new one
+                // rather than being dragged back to its depth
+                if (tile.Mask != 0 && depth - tile.Far1 > tile.Far1 - tile.Far0)
+                    tile.Mask = 0;
+                tile.Far1 = tile.Mask ? std::min(tile.Far1, depth) : depth;
+                tile.Mask |= mask;
+                if (tile.Mask == full) {
+                    tile.Far0 = std::max(tile.Far0, tile.Far1);
+                    tile.Mask = 0;
+                }
+            }
+        }
+    }
+}
+
+void OcclusionBuffer::finish()
+{
+    for (int by = 0; by < BlocksY; by++) {
+        for (int bx = 0; bx < BlocksX; bx++) {
+            float farthest = 1e30f;
+            for (int ty = by * BlockTiles; ty < std::min(TilesY, (by + 1) * BlockTiles); ty++)
+                for (int tx = bx * BlockTiles; tx < std::min(TilesX, (bx + 1) * BlockTiles); tx++)
+                    farthest = std::min(farthest, Tiles[(size_t)ty * TilesX + tx].Far0);
+            Blocks[(size_t)by * BlocksX + bx] = farthest;
+        }
+    }
+}
+
+bool OcclusionBuffer::sphereVisible(const glm::vec3& centre, float radius) const
+{
+    float distance = -centre.z;
+    if (distance - radius <= Near)
+        return true;
+    float nearest = 1.0f / (distance - radius);
+
+    // the projected extent of the sphere's box: each side is widest at the
+    // near face when it points away from the axis and at the far face otherwise
+    float left = centre.x - radius, right = centre.x + radius;
+    float bottom = centre.y - radius, top = centre.y + radius;
+    float minX = ScaleX * left / (left < 0.0f ? distance - radius : distance + radius);
+    float maxX = ScaleX * right / (right >= 0.0f ? distance - radius : distance + radius);
+    float minY = ScaleY * bottom / (bottom < 0.0f ? distance - radius : distance + radius);
+    float maxY = ScaleY * top / (top >= 0.0f ? distance - radius : distance + radius);
+
+    float width = (float)this->width(), height = (float)this->height();
+    minX = (minX * 0.5f + 0.5f) * width;
+    maxX = (maxX * 0.5f + 0.5f) * width;
+    minY = (minY * 0.5f + 0.5f) * height;
+    maxY = (maxY * 0.5f + 0.5f) * height;
+    // off screen is for the frustum to decide
+    if (maxX < 0.0f || maxY < 0.0f || minX >= width || minY >= height)
+        return true;
+    int tx0 = std::max(0, (int)minX / TileSize), tx1 = std::min(TilesX - 1, (int)maxX / TileSize);
+    int ty0 = std::max(0, (int)minY / TileSize), ty1 = std::min(TilesY - 1, (int)maxY / TileSize);
+
+    // coarse blocks first, tiles only where a block is not conclusive
+    for (int by = ty0 / BlockTiles; by <= ty1 / BlockTiles; by++) {
+        for (int bx = tx0 / BlockTiles; bx <= tx1 / BlockTiles; bx++) {
+            if (nearest < Blocks[(size_t)by * BlocksX + bx])
+                continue;
+            int rowEnd = std::min(ty1, (by + 1) * BlockTiles - 1), columnEnd = std::min(tx1, (bx + 1) * BlockTiles - 1);
+            for (int ty = std::max(ty0, by * BlockTiles); ty <= rowEnd; ty++)
+                for (int tx = std::max(tx0, bx * BlockTiles); tx <= columnEnd; tx++)
+                    if (nearest >= Tiles[(size_t)ty * TilesX + tx].Far0)
+                        return true;
+        }
+    }
+    return false;
+}
+
+size_t OcclusionBuffer::cullOccluded(const glm::mat4& viewFromSpace, const SphereSet& spheres, std::vector<uint32_t>& indices) const
+{
+    // the space is only rotated and moved relative to the view, radii carry over
+    const size_t grain = 4096;
+    size_t count = indices.size();
+    size_t blocks = (count + grain - 1) / grain;
+    std::vector<size_t> counts(blocks, 0);
+
+    parallelFor(count, grain, [&](size_t begin, size_t end) {
+        size_t kept = begin;
+        for (size_t i = begin; i < end; i++) {
+            uint32_t index = indices[i];
+            glm::vec3 centre = glm::vec3(viewFromSpace * glm::vec4(spheres.X[index], spheres.Y[index], spheres.Z[index], 1.0f));
+            if (sphereVisible(centre, spheres.Radius[index]))
+                indices[kept++] = index;
+        }
+        counts[begin / grain] = kept - begin;
+    });
+
+    size_t total = counts.empty() ? 0 : counts[0];
+    for (size_t i = 1; i < blocks; i++) {
+        memmove(indices.data() + total, indices.data() + i * grain, counts[i] * sizeof(uint32_t));
+        total += counts[i];
+    }
+    indices.resize(total);
+    return count - total;
+}
+
+void buildSphereOccluder(float radius, int stacks, int slices, std::vector<glm::vec3>& vertices, std::vector<uint32_t>& indices)
+{
+    const float Pi = 3.14159265358979f;
+    vertices.clear();
+    indices.clear();
+    for (int stack = 0; stack <= stacks; stack++) {
+        float phi = Pi * stack / stacks;
+        for (int slice = 0; slice < slices; slice++) {
+            float theta = 2.0f * Pi * slice / slices;
+            vertices.push_back(radius * glm::vec3(std::sin(phi) * std::cos(theta), std::cos(phi), std::sin(phi) * std::sin(theta)));
+        }
+    }
+    for (int stack = 0; stack < stacks; stack++) {
+        for (int slice = 0; slice < slices; slice++) {
+            uint32_t a = stack * slices + slice, d = stack * slices + (slice + 1) % slices;
+            uint32_t b = a + slices, c = d + slices;
+            // the triangles touching a pole collapse to lines there
+            if (stack != stacks - 1) {
+                indices.push_back(a);
+                indices.push_back(c);
+                indices.push_back(b);
+            }
+            if (stack != 0) {
+                indices.push_back(a);
+                indices.push_back(d);
+                indices.push_back(c);
+            }
+        }
+    }
+}
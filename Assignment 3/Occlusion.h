@@ -0,0 +1,68 @@
+#pragma once
+
+#include "./Dependencies/glm/glm.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct SphereSet;
+
+// Low resolution CPU depth buffer for occlusion culling, in the style of
+// masked occlusion culling: instead of a depth per pixel every 8x8 tile keeps
+// a 64 bit coverage mask and two depths, a layer known to cover the whole
+// tile and a working layer for the pixels in the mask, merged into the first
+// once the mask is full. A coarse level holds the farthest depth of each
+// 4x4 block of tiles so most tests touch a single value. Depths are 1 / w,
+// larger is nearer and 0 is infinitely far, so an empty buffer hides nothing.
+// Occluders must lie inside the geometry they stand for; everything is
+// conservative from there on.
+class OcclusionBuffer
+{
+public:
+    static const int TileSize = 8;
+    static const int BlockTiles = 4;
+
+    // in pixels, rounded up to whole tiles
+    void setup(int width, int height);
+
+    // clears the buffer for a frame seen through a glm::perspective projection
+    void begin(const glm::mat4& projection);
+    // front facing triangles of an occluder, a row of 8 pixels per SIMD
+    // step (one AVX2 register in the x86 builds, two NEON ones on ARM)
+    // with bands of tile rows spread over the thread pool; triangles
+    // reaching behind the near plane are left out
+    void rasterize(const glm::mat4& viewFromModel, const std::vector<glm::vec3>& vertices, const std::vector<uint32_t>& indices);
+    // builds the coarse level, call after the last occluder
+    void finish();
+
+    // false when the sphere (centre in view space) is certainly hidden
+    bool sphereVisible(const glm::vec3& centre, float radius) const;
+    // removes the hidden spheres from indices, keeping the order, and
+    // returns how many there were; blocks of spheres run in parallel
+    size_t cullOccluded(const glm::mat4& viewFromSpace, const SphereSet& spheres, std::vector<uint32_t>& indices) const;
+
+    int width() const { return TilesX * TileSize; }
+    int height() const { return TilesY * TileSize; }
+
+private:
+    struct Tile {
+        uint64_t Mask;   // pixels covered by the working layer
+        float Far0;      // whole tile is at least this near
+        float Far1;      // the masked pixels are at least this near
+    };
+    struct Triangle;
+
+    int TilesX = 0, TilesY = 0;
+    int BlocksX = 0, BlocksY = 0;
+    std::vector<Tile> Tiles;
+    std::vector<float> Blocks;
+    float ScaleX = 1.0f, ScaleY = 1.0f, Near = 0.1f;
+
+    void rasterizeBand(const std::vector<Triangle>& triangles, int firstRow, int endRow);
+};
+
+// Triangles of a UV sphere with its vertices on the given radius, wound
+// counter-clockwise from outside. Every face lies inside the sphere, so a
+// radius no larger than that of the object's inscribed sphere makes a safe occluder.
+void buildSphereOccluder(float radius, int stacks, int slices, std::vector<glm::vec3>& vertices, std::vector<uint32_t>& indices);
@@ -0,0 +1,280 @@
+#include "Orbits.h"
+#include "Culling.h"
+#include "Parallel.h"
+#include "Simd.h"
+
+#include "./Dependencies/glm/gtc/matrix_transform.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+
+// Newton steps on Kepler's equation, enough for the near circular orbits of
+// a ring; each roughly squares the error. evaluateOrbits expects
+// eccentricities below about 0.3.
+static const int KeplerIterations = 2;
+
+float meanMotion(float semiMajor, float gm)
+{
+    return std::sqrt(gm / (semiMajor * semiMajor * semiMajor));
+}
+
+// the orbital plane's axes, periapsis first; the textbook z up frame turned
+// so its z becomes y
+static void orbitAxes(const OrbitElements& orbit, glm::vec3& p, glm::vec3& q)
+{
+    float cosNode = std::cos(orbit.Node), sinNode = std::sin(orbit.Node);
+    float cosPeri = std::cos(orbit.Periapsis), sinPeri = std::sin(orbit.Periapsis);
+    float cosIncl = std::cos(orbit.Inclination), sinIncl = std::sin(orbit.Inclination);
+    glm::vec3 pz(cosNode * cosPeri - sinNode * sinPeri * cosIncl, sinNode * cosPeri + cosNode * sinPeri * cosIncl, sinPeri * sinIncl);
+    glm::vec3 qz(-cosNode * sinPeri - sinNode * cosPeri * cosIncl, -sinNode * sinPeri + cosNode * cosPeri * cosIncl, cosPeri * sinIncl);
+    p = glm::vec3(pz.x, pz.z, -pz.y);
+    q = glm::vec3(qz.x, qz.z, -qz.y);
+}
+
+glm::vec3 orbitPosition(const OrbitElements& orbit, float time)
+{
+    float e = orbit.Eccentricity;
+    float mean = std::remainder(orbit.Phase + orbit.MeanMotion * time, 6.28318531f);
+    float eccentric = mean + e * std::sin(mean);
+    for (int i = 0; i < KeplerIterations; i++)
+        eccentric -= (eccentric - e * std::sin(eccentric) - mean) / (1.0f - e * std::cos(eccentric));
+
+    glm::vec3 p, q;
+    orbitAxes(orbit, p, q);
+    float semiMinor = orbit.SemiMajor * std::sqrt(1.0f - e * e);
+    return p * (orbit.SemiMajor * (std::cos(eccentric) - e)) + q * (semiMinor * std::sin(eccentric));
+}
+
+glm::mat4 orbitMatrix(const OrbitElements& orbit, float time)
+{
+    glm::mat4 model = glm::translate(glm::mat4(1.0f), orbitPosition(orbit, time));
+    model = glm::rotate(model, orbit.Spin + orbit.SpinRate * time, glm::normalize(orbit.SpinAxis));
+    return glm::scale(model, glm::vec3(orbit.Scale));
+}
+
+void OrbitSet::resize(size_t count)
+{
+    Count = count;
+    size_t padded = (count + 7) / 8 * 8;
+    for (std::vector<float>* array : { &SemiMajor, &SemiMinor, &Eccentricity, &MeanMotion, &Phase, &PX, &PY, &PZ, &QX, &QY, &QZ,
+                                       &AxisX, &AxisY, &AxisZ, &Spin, &SpinRate, &Scale })
+        array->assign(padded, 0.0f);
+    // padding stays a valid rotation about y
+    std::fill(AxisY.begin(), AxisY.end(), 1.0f);
+}
+
+void OrbitSet::set(size_t index, const OrbitElements& orbit)
+{
+    float e = orbit.Eccentricity;
+    SemiMajor[index] = orbit.SemiMajor;
+    SemiMinor[index] = orbit.SemiMajor * std::sqrt(1.0f - e * e);
+    Eccentricity[index] = e;
+    MeanMotion[index] = orbit.MeanMotion;
+    Phase[index] = orbit.Phase;
+
+    glm::vec3 p, q;
+    orbitAxes(orbit, p, q);
+    PX[index] = p.x;
+    PY[index] = p.y;
+    PZ[index] = p.z;
+    QX[index] = q.x;
+    QY[index] = q.y;
+    QZ[index] = q.z;
+
+    glm::vec3 axis = glm::normalize(orbit.SpinAxis);
+    AxisX[index] = axis.x;
+    AxisY[index] = axis.y;
+    AxisZ[index] = axis.z;
+    Spin[index] = orbit.Spin;
+    SpinRate[index] = orbit.SpinRate;
+    Scale[index] = orbit.Scale;
+}
+
+// 12 matrix elements of 8 bodies, one body after another, so the
+// destination fills in order
+static inline void storeMatrices(const float8* elements, float* out, size_t lanes)
+{
+#if SIMD_AVX2
+    if (lanes == 8) {
+        // elements 0 to 7 as an 8x8 transpose, 8 to 11 as two 4x4 ones
+        __m256 t0 = _mm256_unpacklo_ps(elements[0].v, elements[1].v), t1 = _mm256_unpackhi_ps(elements[0].v, elements[1].v);
+        __m256 t2 = _mm256_unpacklo_ps(elements[2].v, elements[3].v), t3 = _mm256_unpackhi_ps(elements[2].v, elements[3].v);
+        __m256 t4 = _mm256_unpacklo_ps(elements[4].v, elements[5].v), t5 = _mm256_unpackhi_ps(elements[4].v, elements[5].v);
+        __m256 t6 = _mm256_unpacklo_ps(elements[6].v, elements[7].v), t7 = _mm256_unpackhi_ps(elements[6].v, elements[7].v);
+        __m256 u0 = _mm256_shuffle_ps(t0, t2, 0x44), u1 = _mm256_shuffle_ps(t0, t2, 0xEE);
+        __m256 u2 = _mm256_shuffle_ps(t1, t3, 0x44), u3 = _mm256_shuffle_ps(t1, t3, 0xEE);
+        __m256 u4 = _mm256_shuffle_ps(t4, t6, 0x44), u5 = _mm256_shuffle_ps(t4, t6, 0xEE);
+        __m256 u6 = _mm256_shuffle_ps(t5, t7, 0x44), u7 = _mm256_shuffle_ps(t5, t7, 0xEE);
+        __m256 lanes03[4] = { u0, u1, u2, u3 }, lanes47[4] = { u4, u5, u6, u7 };
+
+        __m256 v0 = _mm256_unpacklo_ps(elements[8].v, elements[9].v), v1 = _mm256_unpackhi_ps(elements[8].v, elements[9].v);
+        __m256 v2 = _mm256_unpacklo_ps(elements[10].v, elements[11].v), v3 = _mm256_unpackhi_ps(elements[10].v, elements[11].v);
+        __m256 tail[4] = { _mm256_shuffle_ps(v0, v2, 0x44), _mm256_shuffle_ps(v0, v2, 0xEE), _mm256_shuffle_ps(v1, v3, 0x44),
+                           _mm256_shuffle_ps(v1, v3, 0xEE) };
+        for (int lane = 0; lane < 4; lane++) {
+            _mm256_storeu_ps(out + lane * 12, _mm256_permute2f128_ps(lanes03[lane], lanes47[lane], 0x20));
+            _mm_storeu_ps(out + lane * 12 + 8, _mm256_castps256_ps128(tail[lane]));
+        }
+        for (int lane = 0; lane < 4; lane++) {
+            _mm256_storeu_ps(out + (lane + 4) * 12, _mm256_permute2f128_ps(lanes03[lane], lanes47[lane], 0x31));
+            _mm_storeu_ps(out + (lane + 4) * 12 + 8, _mm256_extractf128_ps(tail[lane], 1));
+        }
+        return;
+    }
+#endif
+    alignas(32) float rows[12][8];
+    for (int element = 0; element < 12; element++)
+        elements[element].store(rows[element]);
+    for (size_t lane = 0; lane < lanes; lane++)
+        for (int element = 0; element < 12; element++)
+            *out++ = rows[element][lane];
+}
+
+// centre and radius of 8 bodies, one body after another
+static inline void storeSpheres(const float8& x, const float8& y, const float8& z, const float8& radius, float* out)
+{
+#if SIMD_AVX2
+    // a 4x4 transpose in each half: bodies 0 to 3 in the low halves, 4 to 7 in the high ones
+    __m256 t0 = _mm256_unpacklo_ps(x.v, y.v), t1 = _mm256_unpackhi_ps(x.v, y.v);
+    __m256 t2 = _mm256_unpacklo_ps(z.v, radius.v), t3 = _mm256_unpackhi_ps(z.v, radius.v);
+    __m256 u0 = _mm256_shuffle_ps(t0, t2, 0x44), u1 = _mm256_shuffle_ps(t0, t2, 0xEE);
+    __m256 u2 = _mm256_shuffle_ps(t1, t3, 0x44), u3 = _mm256_shuffle_ps(t1, t3, 0xEE);
+    _mm256_storeu_ps(out, _mm256_permute2f128_ps(u0, u1, 0x20));
+    _mm256_storeu_ps(out + 8, _mm256_permute2f128_ps(u2, u3, 0x20));
+    _mm256_storeu_ps(out + 16, _mm256_permute2f128_ps(u0, u1, 0x31));
+    _mm256_storeu_ps(out + 24, _mm256_permute2f128_ps(u2, u3, 0x31));
+#else
+    alignas(32) float rows[4][8];
+    x.store(rows[0]);
+    y.store(rows[1]);
+    z.store(rows[2]);
+    radius.store(rows[3]);
+    for (int lane = 0; lane < 8; lane++)
+        for (int element = 0; element < 4; element++)
+            *out++ = rows[element][lane];
+#endif
+}
+
+void evaluateOrbits(const OrbitSet& orbits, float time, SphereSet& spheres, size_t first, float* matrices,
+                    float* packedSpheres)
+{
+    size_t blocks = (orbits.Count + 7) / 8;
+    parallelFor(blocks, 256, [&](size_t begin, size_t end) {
+        const float8 t(time), one(1.0f);
+        for (size_t block = begin; block < end; block++) {
+            size_t i = block * 8;
+
+            // Kepler's equation for the eccentric anomaly E = M + d. Only M
+            // needs a full sin and cos; d stays small on the near circular
+            // orbits of a ring, so sin and cos of M + d come from short series
+            float8 e = float8::load(&orbits.Eccentricity[i]);
+            float8 mean = fmadd(float8::load(&orbits.MeanMotion[i]), t, float8::load(&orbits.Phase[i]));
+            float8 sinM, cosM, sinE, cosE;
+            sincos(mean, sinM, cosM);
+            float8 d = e * sinM;
+            for (int iteration = 0; iteration <= KeplerIterations; iteration++) {
+                float8 d2 = d * d;
+                float8 sinD = d * fmadd(d2, fmadd(d2, fmadd(d2, float8(-1.0f / 5040.0f), float8(1.0f / 120.0f)), float8(-1.0f / 6.0f)), one);
+                float8 cosD = fmadd(d2, fmadd(d2, fmadd(d2, fmadd(d2, float8(1.0f / 40320.0f), float8(-1.0f / 720.0f)), float8(1.0f / 24.0f)), float8(-0.5f)), one);
+                sinE = fmadd(sinM, cosD, cosM * sinD);
+                cosE = cosM * cosD - sinM * sinD;
+                if (iteration == KeplerIterations)
+                    break;
+                d = d - (d - e * sinE) / (one - e * cosE);
+            }
+            float8 along = float8::load(&orbits.SemiMajor[i]) * (cosE - e);
+            float8 across = float8::load(&orbits.SemiMinor[i]) * sinE;
+            float8 x = fmadd(float8::load(&orbits.PX[i]), along, float8::load(&orbits.QX[i]) * across);
+            float8 y = fmadd(float8::load(&orbits.PY[i]), along, float8::load(&orbits.QY[i]) * across);
+            float8 z = fmadd(float8::load(&orbits.PZ[i]), along, float8::load(&orbits.QZ[i]) * across);
+            size_t slot = first + i;
+            x.store(&spheres.X[slot]);
+            y.store(&spheres.Y[slot]);
+            z.store(&spheres.Z[slot]);
+
+            // padding too, its radius keeps it from ever being visible
+            if (packedSpheres)
+                storeSpheres(x, y, z, float8::load(&spheres.Radius[slot]), packedSpheres + slot * 4);
+            if (!matrices)
+                continue;
+
+            // rotation about the spin axis (Rodrigues), scaled, then the
+            // translation as each row's last column
+            float8 angle = fmadd(float8::load(&orbits.SpinRate[i]), t, float8::load(&orbits.Spin[i]));
+            float8 s, c;
+            sincos(angle, s, c);
+            float8 k = one - c;
+            float8 ax = float8::load(&orbits.AxisX[i]), ay = float8::load(&orbits.AxisY[i]), az = float8::load(&orbits.AxisZ[i]);
+            float8 scale = float8::load(&orbits.Scale[i]);
+            float8 kxy = k * ax * ay, kxz = k * ax * az, kyz = k * ay * az;
+            float8 sx = s * ax, sy = s * ay, sz = s * az;
+            float8 elements[12] = {
+                fmadd(k * ax, ax, c) * scale, (kxy - sz) * scale, (kxz + sy) * scale, x,
+                (kxy + sz) * scale, fmadd(k * ay, ay, c) * scale, (kyz - sx) * scale, y,
+                (kxz - sy) * scale, (kyz + sx) * scale, fmadd(k * az, az, c) * scale, z,
+            };
+            storeMatrices(elements, matrices + slot * 12, std::min<size_t>(8, orbits.Count - i));
+        }
+    });
+}
+
+void benchmarkOrbits(size_t count)
+{
+    // a ring like the scene's, orbits near circular and close to one plane
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<OrbitElements> elements(count);
+    OrbitSet orbits;
+    orbits.resize(count);
+    SphereSet spheres;
+    spheres.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        OrbitElements& orbit = elements[i];
+        orbit.SemiMajor = 5.0f + 2.0f * unit(random);
+        orbit.Eccentricity = 0.05f * unit(random);
+        orbit.Inclination = 0.05f * unit(random);
+        orbit.Node = 6.2831853f * unit(random);
+        orbit.Periapsis = 6.2831853f * unit(random);
+        orbit.Phase = 6.2831853f * unit(random);
+        orbit.MeanMotion = meanMotion(orbit.SemiMajor, 43.2f);
+        orbit.SpinAxis = glm::vec3(unit(random), unit(random), unit(random)) - 0.5f;
+        orbit.Spin = 6.2831853f * unit(random);
+        orbit.SpinRate = 2.0f * unit(random) - 1.0f;
+        orbit.Scale = 0.05f + 0.1f * unit(random);
+        orbits.set(i, orbit);
+        spheres.Radius[i] = orbit.Scale;
+    }
+    std::vector<float> matrices(count * 12), packed(spheres.X.size() * 4);
+
+    const float time = 100.0f;
+    const int runs = 20;
+    evaluateOrbits(orbits, time, spheres, 0, matrices.data(), packed.data());
+    auto start = std::chrono::steady_clock::now();
+    for (int run = 0; run < runs; run++)
+        evaluateOrbits(orbits, time, spheres, 0, matrices.data(), packed.data());
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / runs;
+    // and on one thread, from inside a job, where parallelFor stays on the calling thread
+    double serialMs = 0.0;
+    parallelFor(1, 1, [&](size_t, size_t) {
+        auto start = std::chrono::steady_clock::now();
+        for (int run = 0; run < runs; run++)
+            evaluateOrbits(orbits, time, spheres, 0, matrices.data(), packed.data());
+        serialMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / runs;
+    });
+
+    // a thousand of them against the scalar reference
+    float error = 0.0f;
+    for (size_t i = 0; i < count; i += std::max<size_t>(1, count / 1000)) {
+        glm::mat4 expected = orbitMatrix(elements[i], time);
+        for (int row = 0; row < 3; row++)
+            for (int column = 0; column < 4; column++)
+                error = std::max(error, std::abs(matrices[i * 12 + row * 4 + column] - expected[column][row]));
+        error = std::max(error, std::abs(packed[i * 4] - expected[3][0]));
+    }
+    std::cout << "Orbit " << count << " bodies: max error " << error << " against the scalar reference, " << ms << " ms ("
+              << count / ms / 1e3 << " Mbodies/s on " << ThreadPool::instance().threadCount() << " threads), " << serialMs
+              << " ms on 1 thread (" << simdName() << ")" << std::endl;
+}
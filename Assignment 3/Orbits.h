@@ -0,0 +1,60 @@
+#pragma once
+
+#include "./Dependencies/glm/glm.hpp"
+
+#include <cstddef>
+#include <vector>
+
+struct SphereSet;
+
+// One body's Keplerian orbit about the origin, with y up, plus how it
+// tumbles. Angles are in radians, rates in radians per second.
+struct OrbitElements {
+    float SemiMajor = 1.0f;
+    float Eccentricity = 0.0f;
+    float Inclination = 0.0f;   // to the xz plane
+    float Node = 0.0f;          // longitude of the ascending node
+    float Periapsis = 0.0f;     // argument of periapsis
+    float Phase = 0.0f;         // mean anomaly at time 0
+    float MeanMotion = 0.0f;
+    glm::vec3 SpinAxis = glm::vec3(0.0f, 1.0f, 0.0f);
+    float Spin = 0.0f;          // at time 0
+    float SpinRate = 0.0f;
+    float Scale = 1.0f;
+};
+
+// mean motion of an orbit by Kepler's third law, gm the central body's
+// gravitational parameter
+float meanMotion(float semiMajor, float gm);
+
+// scalar reference: position and model matrix (rotation and uniform scale
+// about the body's origin, then translation) at time seconds
+glm::vec3 orbitPosition(const OrbitElements& orbit, float time);
+glm::mat4 orbitMatrix(const OrbitElements& orbit, float time);
+
+// Orbits in structure of arrays layout for evaluateOrbits, padded to whole
+// blocks of 8. The orbital plane is stored as two unit vectors, towards
+// periapsis and 90 degrees on in the direction of motion, so nothing about
+// it is recomputed per frame.
+struct OrbitSet {
+    std::vector<float> SemiMajor, SemiMinor, Eccentricity, MeanMotion, Phase;
+    std::vector<float> PX, PY, PZ, QX, QY, QZ;
+    std::vector<float> AxisX, AxisY, AxisZ, Spin, SpinRate, Scale;
+    size_t Count = 0;
+
+    void resize(size_t count);
+    void set(size_t index, const OrbitElements& orbit);
+};
+
+// Every orbit at time seconds, 8 per SIMD step over the thread pool. Body i
+// goes to slot first + i, first a multiple of 8: its centre into spheres
+// (the radii are left alone) and, when given, the first 3 rows of its model
+// matrix to matrices, 12 floats a slot, and centre and radius to
+// packedSpheres, 4 floats a slot, padding up to the next 8 included. Both
+// may point straight into mapped GPU memory, they are written front to
+// back. Eccentricities are expected below about 0.3.
+void evaluateOrbits(const OrbitSet& orbits, float time, SphereSet& spheres, size_t first, float* matrices,
+                    float* packedSpheres = nullptr);
+
+// --bench-orbits: times evaluateOrbits on count random orbits and prints the result
+void benchmarkOrbits(size_t count);
@@ -0,0 +1,102 @@
+#include "Parallel.h"
+
+#include <algorithm>
+
+static thread_local bool insideJob = false;
+
+ThreadPool& ThreadPool::instance()
+{
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    return pool;
+}
+
+ThreadPool::ThreadPool(unsigned int workers)
+    : Next(0)
+{
+    for (unsigned int i = 0; i < workers; i++)
+        Workers.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        Quit = true;
+    }
+    Wake.notify_all();
+    for (auto& worker : Workers)
+        worker.join();
+}
+
+void ThreadPool::runChunks(const RangeFunc& func, size_t count, size_t grain)
+{
+    insideJob = true;
+    while (true) {
+        size_t begin = Next.fetch_add(grain);
+        if (begin >= count)
+            break;
+        func(begin, std::min(begin + grain, count));
+    }
+    insideJob = false;
+}
+
+void ThreadPool::workerLoop()
+{
+    unsigned long seen = 0;
+    while (true) {
+        const RangeFunc* func;
+        size_t count, grain;
+        {
+            std::unique_lock<std::mutex> lock(Mutex);
+            Wake.wait(lock, [&]() { return Quit || Generation != seen; });
+            if (Quit)
+                return;
+            // the loop as it is now, with seen: woken too late for one that
+            // has already returned, there is nothing to join. Otherwise it
+            // waits for Busy, so neither the loop nor Next change under us
+            seen = Generation;
+            if (!Func)
+                continue;
+            func = Func;
+            count = Count;
+            grain = Grain;
+            Busy++;
+        }
+        runChunks(*func, count, grain);
+        {
+            std::lock_guard<std::mutex> lock(Mutex);
+            Busy--;
+        }
+        Done.notify_one();
+    }
+}
+
+void ThreadPool::parallelFor(size_t count, size_t grain, const RangeFunc& func)
+{
+    if (count == 0)
+        return;
+    grain = std::max<size_t>(1, grain);
+
+    std::unique_lock<std::mutex> submit(SubmitMutex, std::try_to_lock);
+    if (insideJob || Workers.empty() || count <= grain || !submit.owns_lock()) {
+        func(0, count);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        Func = &func;
+        Count = count;
+        Grain = grain;
+        Next = 0;
+        Generation++;
+    }
+    Wake.notify_all();
+
+    runChunks(func, count, grain);
+
+    // wait for workers still finishing a chunk; late wakers find no work left
+    std::unique_lock<std::mutex> lock(Mutex);
+    Done.wait(lock, [&]() { return Busy == 0; });
+    Func = nullptr;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent worker threads for data-parallel loops. parallelFor hands out
+// chunks of [0, count) to the workers and the calling thread and returns when
+// all of them are done. Calls made from inside a job, or while another thread
+// owns the pool, simply run on the calling thread.
+class ThreadPool
+{
+public:
+    typedef std::function<void(size_t begin, size_t end)> RangeFunc;
+
+    static ThreadPool& instance();
+
+    // workers plus the calling thread
+    unsigned int threadCount() const { return (unsigned int)Workers.size() + 1; }
+
+    void parallelFor(size_t count, size_t grain, const RangeFunc& func);
+
+    ~ThreadPool();
+
+private:
+    explicit ThreadPool(unsigned int workers);
+    void workerLoop();
+    void runChunks(const RangeFunc& func, size_t count, size_t grain);
+
+    std::vector<std::thread> Workers;
+    std::mutex Mutex;
+    std::mutex SubmitMutex;
+    std::condition_variable Wake;
+    std::condition_variable Done;
+
+    // the loop being run, null between loops; workers take a copy under
+    // Mutex, never read these unlocked
+    const RangeFunc* Func = nullptr;
+    size_t Count = 0, Grain = 1;
+    std::atomic<size_t> Next;
+    unsigned long Generation = 0;
+    unsigned int Busy = 0;
+    bool Quit = false;
+};
+
+template <typename Func>
+inline void parallelFor(size_t count, size_t grain, Func func)
+{
+    ThreadPool::RangeFunc range = func;
+    ThreadPool::instance().parallelFor(count, grain, range);
+}
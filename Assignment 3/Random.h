@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+
+// Counter-based random numbers: the n-th number of a stream is a hash of the
+// stream's key and n, so every stream stands alone and any of them can be
+// drawn on any thread, in any order, with the same result. The hash is
+// SplitMix64's: its state steps by the golden ratio and each step is mixed,
+// here from a start that is itself the mix of the seed and the stream's index.
+class CounterRandom
+{
+public:
+    CounterRandom(uint64_t seed, uint64_t index) : State(mix(mix(seed) + index * Golden)) {}
+
+    uint64_t next()
+    {
+        State += Golden;
+        return mix(State);
+    }
+
+    // uniform in [0, 1), on all 24 bits of a float's mantissa
+    float unit() { return (float)(next() >> 40) * (1.0f / 16777216.0f); }
+
+private:
+    static const uint64_t Golden = 0x9E3779B97F4A7C15ull;
+    uint64_t State;
+
+    static uint64_t mix(uint64_t z)
+    {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+};
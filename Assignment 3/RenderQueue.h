@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A frame's draws as 64 bit sort keys, each with a payload the caller gives
+// meaning to (an index into its own draw records). Keys order by pass, then
+// program, texture set and vertex input, so draws that share state end up
+// next to each other, and last by depth so opaque draws within a state go
+// front to back. The fields are small ids the caller picks; ids too wide for
+// their field only cost a few extra state changes.
+class RenderQueue
+{
+public:
+    // width of each key field, from the most significant
+    static const int PassBits = 4;
+    static const int ProgramBits = 10;
+    static const int TextureBits = 10;
+    static const int VertexBits = 8;
+    static const int DepthBits = 32;
+
+    struct Item {
+        uint64_t Key;
+        uint32_t Payload;
+    };
+
+    // depth is the distance from the eye, negative counts as 0; back to
+    // front reverses it for blended passes
+    static uint64_t makeKey(unsigned pass, unsigned program, unsigned textures, unsigned vertexInput, float depth,
+                            bool backToFront = false);
+    // the key without its depth: draws with the same state run back to back
+    static uint64_t stateOf(uint64_t key) { return key >> DepthBits; }
+    static unsigned passOf(uint64_t key) { return (unsigned)(key >> (64 - PassBits)); }
+
+    void clear() { Items.clear(); }
+    void submit(uint64_t key, uint32_t payload);
+    // LSD radix sort on the bytes of the key that differ between items this
+    // frame, so a frame where most fields are shared pays for one or two
+    // passes; stable, equal keys keep their submission order
+    void sort();
+
+    size_t size() const { return Items.size(); }
+    const Item& operator[](size_t i) const { return Items[i]; }
+    // state changes between consecutive items, after sort()
+    size_t stateChanges() const;
+
+private:
+    std::vector<Item> Items, Scratch;
+};
+
+// behind --bench-queue: sorts that many random draws and checks the order
+void benchmarkRenderQueue(size_t count);
@@ -0,0 +1,123 @@
+#include "Residency.h"
+#include "Stats.h"
+
+#include <algorithm>
+#include <iostream>
+
+ResidencyManager residency;
+
+size_t mipChainBytes(int width, int height, int bytesPerTexel, int layers)
+{
+    size_t bytes = 0;
+    while (true) {
+        bytes += (size_t)width * height * bytesPerTexel * layers;
+        if (width == 1 && height == 1)
+            break;
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+    }
+    return bytes;
+}
+
+int ResidencyManager::trackBuffer(const std::string& name, size_t bytes)
+{
+    return trackTexture(name, bytes);
+}
+
+int ResidencyManager::trackTexture(const std::string& name, size_t bytes, int maxDroppedLevels, DropFunc drop)
+{
+    Resource resource;
+    resource.Name = name;
+    resource.Bytes = bytes;
+    resource.LastUsed = Frame;
+    resource.MaxDropped = drop ? maxDroppedLevels : 0;
+    resource.Drop = drop;
+    Resources.push_back(resource);
+
+    Current += bytes;
+    Peak = std::max(Peak, Current);
+    return (int)Resources.size() - 1;
+}
+
+void ResidencyManager::resize(int handle, size_t bytes)
+{
+    Resource& resource = Resources[handle];
+    Current = Current - resource.Bytes + bytes;
+    resource.Bytes = bytes;
+    Peak = std::max(Peak, Current);
+}
+
+void ResidencyManager::touch(int handle)
+{
+    Resources[handle].LastUsed = Frame;
+}
+
+void ResidencyManager::touch(const std::vector<int>& handles)
+{
+    for (int handle : handles)
+        Resources[handle].LastUsed = Frame;
+}
+
+void ResidencyManager::setDropped(Resource& resource, int dropped)
+{
+    size_t bytes = resource.Drop(dropped);
+    resource.Dropped = dropped;
+    Current = Current - resource.Bytes + bytes;
+    resource.Bytes = bytes;
+    Peak = std::max(Peak, Current);
+}
+
+void ResidencyManager::beginFrame()
+{
+    Frame++;
+
+    // give levels back to textures used last frame, one level per frame, if
+    // that still fits with an eighth of the budget to spare, so a restore
+    // does not push the next frame over and out again
+    for (Resource& resource : Resources) {
+        if (resource.Dropped == 0 || resource.LastUsed + 1 < Frame)
+            continue;
+        size_t grown = Current - resource.Bytes + resource.Bytes * 4;
+        if (Budget == 0 || grown <= Budget - Budget / 8) {
+            setDropped(resource, resource.Dropped - 1);
+            Restores++;
+        }
+    }
+
+    if (Budget == 0 || Current <= Budget)
+        return;
+
+    // least recently used first, larger first among equals
+    std::vector<Resource*> candidates;
+    for (Resource& resource : Resources)
+        if (resource.Drop && resource.Dropped < resource.MaxDropped)
+            candidates.push_back(&resource);
+    std::sort(candidates.begin(), candidates.end(), [](const Resource* a, const Resource* b) {
+        return a->LastUsed != b->LastUsed ? a->LastUsed < b->LastUsed : a->Bytes > b->Bytes;
+    });
+
+    for (Resource* resource : candidates) {
+        while (Current > Budget && resource->Dropped < resource->MaxDropped) {
+            setDropped(*resource, resource->Dropped + 1);
+            Evictions++;
+        }
+        if (Current <= Budget)
+            break;
+    }
+}
+
+void ResidencyManager::reportStats() const
+{
+    const double MB = 1024.0 * 1024.0;
+    int dropped = 0;
+    for (const Resource& resource : Resources)
+        dropped += resource.Dropped;
+
+    frameStats.set("vram.current_mb", Current / MB);
+    frameStats.set("vram.peak_mb", Peak / MB);
+    frameStats.set("vram.budget_mb", Budget / MB);
+    frameStats.set("vram.resources", (double)Resources.size());
+    frameStats.set("vram.dropped_levels", dropped);
+    frameStats.set("vram.evictions", Evictions);
+    frameStats.set("vram.restores", Restores);
+}
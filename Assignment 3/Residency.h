@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Accounts for every GPU buffer and texture allocation and keeps the total
+// under a configurable budget. Textures that can shrink register a callback
+// that re-specifies them with the top mip levels dropped; it returns the new
+// size in bytes. The callbacks run inside beginFrame on the render thread,
+// so they work from what is in memory or on the GPU, never the disk. Least
+// recently used textures shrink first and grow back once they are used
+// again and fit with room to spare.
+class ResidencyManager
+{
+public:
+    typedef std::function<size_t(int droppedLevels)> DropFunc;
+
+    int trackBuffer(const std::string& name, size_t bytes);
+    int trackTexture(const std::string& name, size_t bytes, int maxDroppedLevels = 0, DropFunc drop = DropFunc());
+    void resize(int handle, size_t bytes);
+
+    void touch(int handle);
+    void touch(const std::vector<int>& handles);
+
+    // advance the frame clock and evict or restore to meet the budget
+    void beginFrame();
+
+    size_t currentBytes() const { return Current; }
+    size_t peakBytes() const { return Peak; }
+    void reportStats() const;
+
+    size_t Budget = 0; // 0 = unlimited
+
+private:
+    struct Resource {
+        std::string Name;
+        size_t Bytes = 0;
+        unsigned int LastUsed = 0;
+        int Dropped = 0;
+        int MaxDropped = 0;
+        DropFunc Drop;
+    };
+
+    std::vector<Resource> Resources;
+    size_t Current = 0, Peak = 0;
+    unsigned int Frame = 0;
+    int Evictions = 0, Restores = 0;
+
+    void setDropped(Resource& resource, int dropped);
+};
+
+extern ResidencyManager residency;
+
+// bytes of a 2D image with its full mip chain
+size_t mipChainBytes(int width, int height, int bytesPerTexel, int layers = 1);
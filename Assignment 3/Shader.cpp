@@ -1,80 +1,452 @@
 #include "Shader.h"
+#include "GLState.h"
+#include "FrameUniforms.h"
+#include "GeometryPool.h"
+#include "Stats.h"
 //#include <glm/gtc/type_ptr.hpp>
 #include "./Dependencies/glm/gtc/type_ptr.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
 
-void Shader::setupShader(const char* vertexPath, const char* fragmentPath)
+unsigned long Shader::Uploads = 0;
+unsigned long Shader::Skipped = 0;
+unsigned long Shader::CacheHits = 0;
+unsigned long Shader::CacheMisses = 0;
+unsigned long Shader::CacheRejects = 0;
+double Shader::SavedMs = 0.0;
+
+static const char* ProgramCacheDir = "shadercache";
+
+struct ProgramCacheHeader {
+	char magic[4];
+	uint32_t format;
+	uint32_t length;
+	float compileMs;
+};
+
+static uint64_t hashString(const char* text, uint64_t h = 14695981039346656037ull)
+{
+	// FNV-1a, the terminating zero included so concatenations differ
+	do {
+		h ^= (unsigned char)*text;
+		h *= 1099511628211ull;
+	} while (*text++);
+	return h;
+}
+
+static bool programBinarySupported()
+{
+	if (!GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary)
+		return false;
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return formats > 0;
+}
+
+static std::string injectDefines(const std::string& code, const std::string& defines)
+{
+	if (defines.empty() || code.compare(0, 8, "#version") != 0)
+		return defines + code;
+	size_t lineEnd = code.find('\n');
+	if (lineEnd == std::string::npos)
+		return code + "\n" + defines;
+	// the defines must not shift the line numbers of error messages
+	return code.substr(0, lineEnd + 1) + defines + "#line 2 0\n" + code.substr(lineEnd + 1);
+}
+
+void Shader::setupShader(const char* vertexPath, const char* fragmentPath, const std::string& defines)
+{
+	submit(vertexPath, fragmentPath, defines);
+	finish();
+}
+
+void Shader::submit(const char* vertexPath, const char* fragmentPath, const std::string& defines)
+{
+	Build = Pending();
+	std::vector<std::string> included;
+	Build.VertexCode = injectDefines(preprocess(vertexPath, included), defines);
+	included.clear();
+	Build.FragmentCode = injectDefines(preprocess(fragmentPath, included), defines);
+	Build.Start = std::chrono::steady_clock::now();
+
+	// a binary is only valid for the exact sources and driver it was built by
+	if (programBinarySupported()) {
+		uint64_t key = hashString(Build.VertexCode.c_str());
+		key = hashString(Build.FragmentCode.c_str(), key);
+		key = hashString((const char*)glGetString(GL_VENDOR), key);
+		key = hashString((const char*)glGetString(GL_RENDERER), key);
+		key = hashString((const char*)glGetString(GL_VERSION), key);
+		char name[32];
+		snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)key);
+		Build.CachePath = std::string(ProgramCacheDir) + name;
+
+		if (submitProgramBinary())
+			return;
+	}
+	submitSources();
+}
+
+// queue compile and link; asking for their status here would wait on the driver
+void Shader::submitSources()
 {
 	// similar to the installShaders() in the assignment 1
-	unsigned int vertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	unsigned int fragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+	Build.VertexShader = glCreateShader(GL_VERTEX_SHADER);
+	Build.FragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
 
-	const GLchar* vCode;
-	std::string temp = readShaderCode(vertexPath);
-	vCode = temp.c_str();
-	glShaderSource(vertexShaderID, 1, &vCode, NULL);
+	const GLchar* vCode = Build.VertexCode.c_str();
+	glShaderSource(Build.VertexShader, 1, &vCode, NULL);
 
-	const GLchar* fCode;
-	temp = readShaderCode(fragmentPath);
-	fCode = temp.c_str();
-	glShaderSource(fragmentShaderID, 1, &fCode, NULL);
+	const GLchar* fCode = Build.FragmentCode.c_str();
+	glShaderSource(Build.FragmentShader, 1, &fCode, NULL);
 
-	glCompileShader(vertexShaderID);
-	glCompileShader(fragmentShaderID);
+	glCompileShader(Build.VertexShader);
+	glCompileShader(Build.FragmentShader);
 
-	if (!checkShaderStatus(vertexShaderID) || !checkShaderStatus(fragmentShaderID))
-		return;
+	ID = glCreateProgram();
+
+	glAttachShader(ID, Build.VertexShader);
+	glAttachShader(ID, Build.FragmentShader);
+	if (!Build.CachePath.empty())
+		glProgramParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(ID);
+}
+
+bool Shader::submitProgramBinary()
+{
+	std::ifstream file(Build.CachePath, std::ios::binary);
+	ProgramCacheHeader header;
+	if (!file || !file.read((char*)&header, sizeof(header)) || memcmp(header.magic, "PBC1", 4) != 0) {
+		CacheMisses++;
+		return false;
+	}
+	std::vector<char> binary(header.length);
+	if (!file.read(binary.data(), binary.size())) {
+		CacheMisses++;
+		return false;
+	}
 
 	ID = glCreateProgram();
+	glProgramBinary(ID, header.format, binary.data(), header.length);
+	Build.FromCache = true;
+	Build.CachedCompileMs = header.compileMs;
+	return true;
+}
+
+bool Shader::ready() const
+{
+	// without the extension there is no way to ask, finish() will wait
+	if (!GLEW_KHR_parallel_shader_compile && !GLEW_ARB_parallel_shader_compile)
+		return true;
+	GLint done = GL_TRUE;
+	glGetProgramiv(ID, GL_COMPLETION_STATUS_KHR, &done);
+	return done == GL_TRUE;
+}
+
+bool Shader::finish()
+{
+	if (Build.FromCache) {
+		Build.FromCache = false;
+		GLint status = GL_FALSE;
+		glGetProgramiv(ID, GL_LINK_STATUS, &status);
+		if (status == GL_TRUE) {
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - Build.Start).count();
+			SavedMs += std::max(0.0, Build.CachedCompileMs - ms);
+			CacheHits++;
+			Build = Pending();
+			reflectUniforms();
+			glState.useProgram(0);
+			return true;
+		}
+
+		// the driver may refuse binaries of another build, fall back to the sources
+		glDeleteProgram(ID);
+		CacheMisses++;
+		CacheRejects++;
+		Build.Start = std::chrono::steady_clock::now();
+		submitSources();
+	}
+
+	bool linked = checkShaderStatus(Build.VertexShader) && checkShaderStatus(Build.FragmentShader) && checkProgramStatus(ID);
+	if (linked && !Build.CachePath.empty()) {
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - Build.Start).count();
+		saveProgramBinary(Build.CachePath, (float)ms);
+	}
+
+	glDeleteShader(Build.VertexShader);
+	glDeleteShader(Build.FragmentShader);
+	Build = Pending();
+
+	if (linked)
+		reflectUniforms();
+	glState.useProgram(0);
+	return linked;
+}
+
+bool Shader::setupCompute(const char* computePath, const std::string& defines)
+{
+	std::vector<std::string> included;
+	std::string code = injectDefines(preprocess(computePath, included), defines);
+
+	GLuint computeShader = glCreateShader(GL_COMPUTE_SHADER);
+	const GLchar* cCode = code.c_str();
+	glShaderSource(computeShader, 1, &cCode, NULL);
+	glCompileShader(computeShader);
 
-	glAttachShader(ID, vertexShaderID);
-	glAttachShader(ID, fragmentShaderID);
+	ID = glCreateProgram();
+	glAttachShader(ID, computeShader);
 	glLinkProgram(ID);
 
-	if (!checkProgramStatus(ID))
+	bool linked = checkShaderStatus(computeShader) && checkProgramStatus(ID);
+	glDeleteShader(computeShader);
+	if (linked)
+		reflectUniforms();
+	glState.useProgram(0);
+	return linked;
+}
+
+void Shader::saveProgramBinary(const std::string& cachePath, float compileMs) const
+{
+	GLint length = 0;
+	glGetProgramiv(ID, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+	std::vector<char> binary(length);
+	GLenum format;
+	glGetProgramBinary(ID, length, &length, &format, binary.data());
+
+#ifdef _WIN32
+	_mkdir(ProgramCacheDir);
+#else
+	mkdir(ProgramCacheDir, 0755);
+#endif
+	std::ofstream file(cachePath, std::ios::binary);
+	if (!file) {
+		std::cout << "Failed to write program binary: " << cachePath << std::endl;
 		return;
+	}
+	ProgramCacheHeader header;
+	memcpy(header.magic, "PBC1", 4);
+	header.format = format;
+	header.length = (uint32_t)length;
+	header.compileMs = compileMs;
+	file.write((const char*)&header, sizeof(header));
+	file.write(binary.data(), length);
+}
+
+void Shader::use() const
+{
+	glState.useProgram(ID);
+}
+
+void Shader::setMat4(UniformName name, const glm::mat4& value) const
+{
+	GLint location = changedLocation(name, glm::value_ptr(value), sizeof(value));
+	if (location >= 0)
+		glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(value));
+}
 
-	glDeleteShader(vertexShaderID);
-	glDeleteShader(fragmentShaderID);
+void Shader::setVec4(UniformName name, glm::vec4 value) const
+{
+	GLint location = changedLocation(name, &value[0], sizeof(value));
+	if (location >= 0)
+		glUniform4fv(location, 1, &value[0]);
+}
 
-	glUseProgram(0);
+void Shader::setVec4Array(UniformName name, const glm::vec4* values, int count) const
+{
+	GLint location = changedLocation(name, &values[0][0], sizeof(glm::vec4) * count);
+	if (location >= 0)
+		glUniform4fv(location, count, &values[0][0]);
 }
 
+void Shader::setVec3(UniformName name, glm::vec3 value) const
+{
+	GLint location = changedLocation(name, &value[0], sizeof(value));
+	if (location >= 0)
+		glUniform3fv(location, 1, &value[0]);
+}
 
-void Shader::use() const
+void Shader::setVec2(UniformName name, glm::vec2 value) const
+{
+	GLint location = changedLocation(name, &value[0], sizeof(value));
+	if (location >= 0)
+		glUniform2fv(location, 1, &value[0]);
+}
+
+void Shader::setVec3(UniformName name, float v1, float v2, float v3) const
+{
+	setVec3(name, glm::vec3(v1, v2, v3));
+}
+
+void Shader::setVec3Array(UniformName name, const glm::vec3* values, int count) const
+{
+	GLint location = changedLocation(name, &values[0][0], sizeof(glm::vec3) * count);
+	if (location >= 0)
+		glUniform3fv(location, count, &values[0][0]);
+}
+
+void Shader::setFloat(UniformName name, float value) const
 {
-	glUseProgram(ID);
+	GLint location = changedLocation(name, &value, sizeof(value));
+	if (location >= 0)
+		glUniform1f(location, value);
 }
 
-void Shader::setMat4(const std::string& name, glm::mat4& value) const
+void Shader::setInt(UniformName name, int value) const
 {
-	unsigned int transformLoc = glGetUniformLocation(ID, name.c_str());
-	glUniformMatrix4fv(transformLoc, 1, GL_FALSE, glm::value_ptr(value));
+	GLint location = changedLocation(name, &value, sizeof(value));
+	if (location >= 0)
+		glUniform1i(location, value);
 }
 
-void Shader::setVec4(const std::string& name, glm::vec4 value) const
+void Shader::reportStats()
 {
-	glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+	frameStats.add("shader.uniform_uploads", (double)Uploads);
+	frameStats.add("shader.uniform_skipped", (double)Skipped);
+	Uploads = Skipped = 0;
+
+	unsigned long lookups = CacheHits + CacheMisses;
+	if (lookups > 0) {
+		frameStats.set("shader.cache_hit_rate", (double)CacheHits / lookups);
+		frameStats.set("shader.cache_rejects", (double)CacheRejects);
+		frameStats.set("shader.cache_saved_ms", SavedMs);
+	}
 }
 
-void Shader::setVec3(const std::string& name, glm::vec3 value) const
+// bytes of one element of a uniform of the given type
+static size_t uniformTypeBytes(GLenum type)
 {
-	glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+	switch (type) {
+		case GL_FLOAT_VEC2: case GL_INT_VEC2: case GL_UNSIGNED_INT_VEC2: case GL_BOOL_VEC2: return 8;
+		case GL_FLOAT_VEC3: case GL_INT_VEC3: case GL_UNSIGNED_INT_VEC3: case GL_BOOL_VEC3: return 12;
+		case GL_FLOAT_VEC4: case GL_INT_VEC4: case GL_UNSIGNED_INT_VEC4: case GL_BOOL_VEC4: case GL_FLOAT_MAT2: return 16;
+		case GL_FLOAT_MAT2x3: case GL_FLOAT_MAT3x2: return 24;
+		case GL_FLOAT_MAT2x4: case GL_FLOAT_MAT4x2: return 32;
+		case GL_FLOAT_MAT3: return 36;
+		case GL_FLOAT_MAT3x4: case GL_FLOAT_MAT4x3: return 48;
+		case GL_FLOAT_MAT4: return 64;
+		default: return 4; // scalars and samplers
+	}
 }
 
-void Shader::setVec3(const std::string& name, float v1, float v2, float v3) const
+void Shader::reflectUniforms()
 {
-	glUniform3f(glGetUniformLocation(ID, name.c_str()), v1, v2, v3);
+	Uniforms.clear();
+	Shadow.clear();
+
+	// shared per-frame constants live in a uniform buffer at a fixed binding
+	GLuint frameBlock = glGetUniformBlockIndex(ID, "FrameData");
+	if (frameBlock != GL_INVALID_INDEX)
+		glUniformBlockBinding(ID, frameBlock, FrameDataBinding);
+	// and per-draw data of multi-draw batches in a storage buffer
+	if (GLEW_VERSION_4_3 || (GLEW_ARB_program_interface_query && GLEW_ARB_shader_storage_buffer_object)) {
+		GLuint drawBlock = glGetProgramResourceIndex(ID, GL_SHADER_STORAGE_BLOCK, "DrawDataBlock");
+		if (drawBlock != GL_INVALID_INDEX)
+			glShaderStorageBlockBinding(ID, drawBlock, DrawDataBinding);
+	}
+
+	GLint count = 0, maxLength = 0;
+	glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+	std::vector<GLchar> name(maxLength + 1);
+	for (GLint i = 0; i < count; i++) {
+		GLint size;
+		GLenum type;
+		glGetActiveUniform(ID, i, (GLsizei)name.size(), NULL, &size, &type, name.data());
+		// members of uniform blocks have no location of their own
+		GLint location = glGetUniformLocation(ID, name.data());
+		if (location < 0)
+			continue;
+
+		// arrays are reported as "name[0]", set as "name"
+		std::string baseName = name.data();
+		size_t bracket = baseName.find('[');
+		if (bracket != std::string::npos)
+			baseName.resize(bracket);
+
+		Uniform uniform;
+		uniform.Hash = UniformName(baseName).Hash;
+		uniform.Location = location;
+		uniform.ShadowOffset = Shadow.size();
+		uniform.ShadowBytes = uniformTypeBytes(type) * size;
+		uniform.Valid = false;
+		Shadow.resize(Shadow.size() + uniform.ShadowBytes);
+		Uniforms.push_back(uniform);
+	}
+
+	std::sort(Uniforms.begin(), Uniforms.end(), [](const Uniform& a, const Uniform& b) { return a.Hash < b.Hash; });
+	for (size_t i = 1; i < Uniforms.size(); i++)
+		if (Uniforms[i].Hash == Uniforms[i - 1].Hash)
+			std::cout << "Uniform name hash collision in program " << ID << std::endl;
 }
 
-void Shader::setFloat(const std::string& name, float value) const
+// location to upload to, or -1 when the uniform is inactive or already holds the value
+GLint Shader::changedLocation(UniformName name, const void* value, size_t bytes) const
 {
-	glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+	auto it = std::lower_bound(Uniforms.begin(), Uniforms.end(), name.Hash,
+		[](const Uniform& uniform, uint32_t hash) { return uniform.Hash < hash; });
+	if (it == Uniforms.end() || it->Hash != name.Hash)
+		return -1;
+
+	Uniform& uniform = *it;
+	bytes = std::min(bytes, uniform.ShadowBytes);
+	unsigned char* shadow = Shadow.data() + uniform.ShadowOffset;
+	if (uniform.Valid && memcmp(shadow, value, bytes) == 0) {
+		Skipped++;
+		return -1;
+	}
+	memcpy(shadow, value, bytes);
+	uniform.Valid = true;
+	Uploads++;
+	return uniform.Location;
 }
 
-void Shader::setInt(const std::string& name, int value) const
+// expand #include "file" (relative to the including file, each file only
+// once) and emit #line so error messages point at the right file and line;
+// the source string number is the file's index in included
+std::string Shader::preprocess(const std::string& path, std::vector<std::string>& included) const
 {
-	glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+	int sourceIndex = (int)included.size();
+	included.push_back(path);
+	std::string code = readShaderCode(path.c_str());
+	std::string directory = path.substr(0, path.find_last_of("/\\") + 1);
+
+	std::string out;
+	int line = 1;
+	for (size_t pos = 0; pos < code.size(); line++) {
+		size_t end = std::min(code.find('\n', pos), code.size());
+		std::string text = code.substr(pos, end - pos);
+		pos = end + 1;
+
+		size_t first = text.find_first_not_of(" \t");
+		if (first == std::string::npos || text.compare(first, 8, "#include") != 0) {
+			out += text + "\n";
+			continue;
+		}
+
+		size_t open = text.find('"', first);
+		size_t close = open == std::string::npos ? open : text.find('"', open + 1);
+		if (close == std::string::npos) {
+			std::cout << path << "(" << line << "): malformed #include" << std::endl;
+			exit(1);
+		}
+		std::string target = directory + text.substr(open + 1, close - open - 1);
+		if (std::find(included.begin(), included.end(), target) != included.end()) {
+			out += "\n";
+			continue;
+		}
+		out += "#line 1 " + std::to_string(included.size()) + "\n";
+		out += preprocess(target, included);
+		out += "#line " + std::to_string(line + 1) + " " + std::to_string(sourceIndex) + "\n";
+	}
+	return out;
 }
 
 std::string Shader::readShaderCode(const char* fileName) const
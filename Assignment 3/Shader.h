@@ -1,25 +1,100 @@
 #pragma once
 #include "./Dependencies/glew/glew.h"
 #include "./Dependencies/glm/glm.hpp"
+#include <chrono>
+#include <cstdint>
 #include <string>
+#include <vector>
 #include <iostream>
 
+// FNV-1a hash of a uniform name. Constructed from a literal it is a constant
+// expression, so hot paths can hash their names at compile time:
+//     constexpr UniformName modelMatrixName("modelMatrix");
+struct UniformName {
+	uint32_t Hash;
+
+	constexpr UniformName(const char* name) : Hash(hash(name, 2166136261u)) {}
+	UniformName(const std::string& name) : Hash(hash(name.c_str(), 2166136261u)) {}
+
+	static constexpr uint32_t hash(const char* s, uint32_t h)
+	{
+		return *s ? hash(s + 1, (h ^ (uint8_t)*s) * 16777619u) : h;
+	}
+};
+
 class Shader {
 public:
-	void setupShader(const char* vertexPath, const char* fragmentPath);
+	// sources may #include "file" relative to themselves; defines are inserted
+	// after the #version line. Linked programs are cached as driver binaries
+	// in shadercache/ and reloaded when nothing changed
+	void setupShader(const char* vertexPath, const char* fragmentPath, const std::string& defines = std::string());
 	void use() const;
+	// the GL program, for sort keys
+	unsigned int program() const { return ID; }
+
+	// setupShader in two halves: submit() queues compile and link without
+	// waiting on the driver, finish() collects the result (status, reflection,
+	// binary cache). ready() tells whether finish() would not block, which is
+	// only known with KHR_parallel_shader_compile; see ShaderPipeline
+	void submit(const char* vertexPath, const char* fragmentPath, const std::string& defines = std::string());
+	bool ready() const;
+	bool finish();
+
+	// a compute program, built synchronously and without the binary cache
+	bool setupCompute(const char* computePath, const std::string& defines = std::string());
 
-	// a series utilities for setting shader parameters 
-	void setMat4(const std::string& name, glm::mat4& value) const;
-	void setVec4(const std::string& name, glm::vec4 value) const;
-	void setVec3(const std::string& name, glm::vec3 value) const;
-	void setVec3(const std::string& name, float v1, float v2, float v3) const;
-	void setFloat(const std::string& name, float value) const;
-	void setInt(const std::string& name, int value) const;
+	// a series utilities for setting shader parameters
+	// uniforms are looked up in the table reflected at link time, and values
+	// equal to the last one uploaded to this program are not sent again
+	void setMat4(UniformName name, const glm::mat4& value) const;
+	void setVec4(UniformName name, glm::vec4 value) const;
+	void setVec4Array(UniformName name, const glm::vec4* values, int count) const;
+	void setVec3(UniformName name, glm::vec3 value) const;
+	void setVec2(UniformName name, glm::vec2 value) const;
+	void setVec3(UniformName name, float v1, float v2, float v3) const;
+	void setVec3Array(UniformName name, const glm::vec3* values, int count) const;
+	void setFloat(UniformName name, float value) const;
+	void setInt(UniformName name, int value) const;
+
+	// uploads issued and skipped as redundant since the last call, plus the
+	// program binary cache hit rate and compile time saved, into frameStats
+	static void reportStats();
 
 private:
+	struct Uniform {
+		uint32_t Hash;
+		GLint Location;
+		size_t ShadowOffset, ShadowBytes;
+		bool Valid;
+	};
+
+	// state between submit() and finish()
+	struct Pending {
+		std::string VertexCode, FragmentCode, CachePath;
+		GLuint VertexShader = 0, FragmentShader = 0;
+		bool FromCache = false;
+		float CachedCompileMs = 0.0f;
+		std::chrono::steady_clock::time_point Start;
+	};
+
 	unsigned int ID;
+	Pending Build;
+
+	// active uniforms sorted by hash, and the last value of each
+	mutable std::vector<Uniform> Uniforms;
+	mutable std::vector<unsigned char> Shadow;
+
+	static unsigned long Uploads, Skipped;
+	static unsigned long CacheHits, CacheMisses, CacheRejects;
+	static double SavedMs;
+
+	void reflectUniforms();
+	void submitSources();
+	bool submitProgramBinary();
+	void saveProgramBinary(const std::string& cachePath, float compileMs) const;
+	GLint changedLocation(UniformName name, const void* value, size_t bytes) const;
 
+	std::string preprocess(const std::string& path, std::vector<std::string>& included) const;
 	std::string readShaderCode(const char* fileName) const;
 	bool checkShaderStatus(GLuint shaderID) const;
 	bool checkProgramStatus(GLuint programID) const;
@@ -0,0 +1,76 @@
+#include "ShaderPipeline.h"
+
+#include <iostream>
+#include <thread>
+
+bool ShaderPipeline::parallelCompileSupported()
+{
+    return GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile;
+}
+
+ShaderPipeline::ShaderPipeline()
+{
+    // let the driver use as many compiler threads as it likes
+    if (GLEW_KHR_parallel_shader_compile)
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+    else if (GLEW_ARB_parallel_shader_compile)
+        glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+}
+
+void ShaderPipeline::add(Shader& shader, const char* vertexPath, const char* fragmentPath,
+                         const std::string& defines, ReadyFunc onReady)
+{
+    if (Jobs.empty())
+        Start = std::chrono::steady_clock::now();
+    shader.submit(vertexPath, fragmentPath, defines);
+    Job job;
+    job.Target = &shader;
+    job.OnReady = onReady;
+    Jobs.push_back(job);
+    Submitted++;
+}
+
+void ShaderPipeline::complete(Job& job)
+{
+    bool linked = job.Target->finish();
+    if (job.OnReady)
+        job.OnReady(*job.Target, linked);
+}
+
+size_t ShaderPipeline::update()
+{
+    // without the extension readiness is unknown, so nothing completes here
+    if (!parallelCompileSupported())
+        return Jobs.size();
+
+    for (size_t i = 0; i < Jobs.size();) {
+        if (Jobs[i].Target->ready()) {
+            Job job = Jobs[i];
+            Jobs.erase(Jobs.begin() + i);
+            complete(job);
+        }
+        else
+            i++;
+    }
+    return Jobs.size();
+}
+
+void ShaderPipeline::finish()
+{
+    if (Submitted == 0)
+        return;
+
+    // with the extension keep polling so callbacks fire in completion order
+    if (parallelCompileSupported())
+        while (update() > 0)
+            std::this_thread::yield();
+
+    for (Job& job : Jobs)
+        complete(job);
+    Jobs.clear();
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - Start).count();
+    std::cout << "Build " << Submitted << " shader programs in " << ms << " ms"
+              << (parallelCompileSupported() ? " with parallel compile" : "") << std::endl;
+    Submitted = 0;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "Shader.h"
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Builds many programs at once. Everything is submitted up front so the
+// driver can compile them concurrently (on its own threads when it has
+// KHR_parallel_shader_compile) while the caller keeps loading assets;
+// update() collects the programs that are done without blocking and fires
+// their callbacks, finish() waits for the rest.
+class ShaderPipeline
+{
+public:
+    typedef std::function<void(Shader& shader, bool linked)> ReadyFunc;
+
+    ShaderPipeline();
+
+    void add(Shader& shader, const char* vertexPath, const char* fragmentPath,
+             const std::string& defines = std::string(), ReadyFunc onReady = ReadyFunc());
+
+    // collect finished programs, returns how many are still compiling
+    size_t update();
+    void finish();
+
+    size_t pending() const { return Jobs.size(); }
+
+    static bool parallelCompileSupported();
+
+private:
+    struct Job {
+        Shader* Target;
+        ReadyFunc OnReady;
+    };
+
+    std::vector<Job> Jobs;
+    std::chrono::steady_clock::time_point Start;
+    int Submitted = 0;
+
+    void complete(Job& job);
+};
@@ -0,0 +1,42 @@
+#include "ShaderVariants.h"
+#include "ShaderPipeline.h"
+#include "Stats.h"
+
+void ShaderVariants::setup(const char* vertexPath, const char* fragmentPath, const std::vector<std::string>& features)
+{
+    VertexPath = vertexPath;
+    FragmentPath = fragmentPath;
+    Features = features;
+    Variants.clear();
+}
+
+std::string ShaderVariants::defines(uint32_t features) const
+{
+    std::string text;
+    for (size_t i = 0; i < Features.size(); i++)
+        if (features & (1u << i))
+            text += "#define " + Features[i] + " 1\n";
+    return text;
+}
+
+Shader& ShaderVariants::get(uint32_t features)
+{
+    auto found = Variants.find(features);
+    if (found != Variants.end())
+        return *found->second;
+
+    Shader* shader = new Shader();
+    Variants[features].reset(shader);
+    shader->setupShader(VertexPath.c_str(), FragmentPath.c_str(), defines(features));
+    frameStats.add("shader.variant_compiles", 1.0);
+    return *shader;
+}
+
+void ShaderVariants::prewarm(ShaderPipeline& pipeline, uint32_t features)
+{
+    if (Variants.count(features))
+        return;
+    Shader* shader = new Shader();
+    Variants[features].reset(shader);
+    pipeline.add(*shader, VertexPath.c_str(), FragmentPath.c_str(), defines(features));
+}
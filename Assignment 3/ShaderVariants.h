@@ -0,0 +1,36 @@
+#pragma once
+
+#include "Shader.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+class ShaderPipeline;
+
+// One pair of sources compiled into permutations. Every feature is a
+// #define; a variant is a bitmask of enabled features (bit i = features[i])
+// and is compiled the first time it is asked for, then memoized. Disabled
+// features are never defined, so their #ifdef branches cost nothing at runtime.
+class ShaderVariants
+{
+public:
+    void setup(const char* vertexPath, const char* fragmentPath, const std::vector<std::string>& features);
+
+    // the program for a feature mask, compiled on first use
+    Shader& get(uint32_t features);
+    // queue a variant on a pipeline ahead of its first use
+    void prewarm(ShaderPipeline& pipeline, uint32_t features);
+
+    size_t compiledCount() const { return Variants.size(); }
+
+private:
+    std::string VertexPath, FragmentPath;
+    std::vector<std::string> Features;
+    // Shaders are handed out by reference, so they must not move
+    std::map<uint32_t, std::unique_ptr<Shader>> Variants;
+
+    std::string defines(uint32_t features) const;
+};
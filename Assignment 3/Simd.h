@@ -0,0 +1,318 @@
+#pragma once
+
+// 8-wide float vector used by the CPU kernels (SH projection, normal baking,
+// culling, ...). Maps to AVX2/FMA when the compiler targets it, to two SSE2
+// or NEON registers otherwise, and to plain arrays as a last resort, so the
+// kernels are written once and stay portable (the macOS build runs on ARM).
+// Both projects target AVX2 and FMA on x86 (/arch:AVX2, -mavx2 -mfma).
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#define SIMD_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SIMD_NEON 1
+#endif
+
+// whether this CPU runs what the kernels were compiled for, so an AVX2 build
+// can say so on an older CPU rather than die of an illegal instruction
+inline bool simdSupported()
+{
+#if SIMD_AVX2 && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    bool fma = (info[2] >> 12) & 1, osxsave = (info[2] >> 27) & 1;
+    __cpuidex(info, 7, 0);
+    bool avx2 = (info[1] >> 5) & 1;
+    // and the OS saves the upper halves of the registers
+    return fma && avx2 && osxsave && (_xgetbv(0) & 6) == 6;
+#elif SIMD_AVX2
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+    return true;
+#endif
+}
+
+// the path float8 takes in this build, for benchmarks to report
+inline const char* simdName()
+{
+#if SIMD_AVX2
+    return "AVX2";
+#elif SIMD_SSE2
+    return "SSE2";
+#elif SIMD_NEON
+    return "NEON";
+#else
+    return "scalar";
+#endif
+}
+
+struct alignas(32) float8 {
+#if SIMD_AVX2
+    __m256 v;
+    float8() {}
+    float8(__m256 x) : v(x) {}
+    float8(float x) : v(_mm256_set1_ps(x)) {}
+    static float8 load(const float* p) { return _mm256_loadu_ps(p); }
+    static float8 loadU16(const uint16_t* p) { return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p))); }
+    void store(float* p) const { _mm256_storeu_ps(p, v); }
+#elif SIMD_SSE2
+    __m128 lo, hi;
+    float8() {}
+    float8(__m128 a, __m128 b) : lo(a), hi(b) {}
+    float8(float x) : lo(_mm_set1_ps(x)), hi(_mm_set1_ps(x)) {}
+    static float8 load(const float* p) { return float8(_mm_loadu_ps(p), _mm_loadu_ps(p + 4)); }
+    static float8 loadU16(const uint16_t* p)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)p), zero = _mm_setzero_si128();
+        return float8(_mm_cvtepi32_ps(_mm_unpacklo_epi16(x, zero)), _mm_cvtepi32_ps(_mm_unpackhi_epi16(x, zero)));
+    }
+    void store(float* p) const { _mm_storeu_ps(p, lo); _mm_storeu_ps(p + 4, hi); }
+#elif SIMD_NEON
+    float32x4_t lo, hi;
+    float8() {}
+    float8(float32x4_t a, float32x4_t b) : lo(a), hi(b) {}
+    float8(float x) : lo(vdupq_n_f32(x)), hi(vdupq_n_f32(x)) {}
+    static float8 load(const float* p) { return float8(vld1q_f32(p), vld1q_f32(p + 4)); }
+    static float8 loadU16(const uint16_t* p)
+    {
+        uint16x8_t x = vld1q_u16(p);
+        return float8(vcvtq_f32_u32(vmovl_u16(vget_low_u16(x))), vcvtq_f32_u32(vmovl_u16(vget_high_u16(x))));
+    }
+    void store(float* p) const { vst1q_f32(p, lo); vst1q_f32(p + 4, hi); }
+#else
+    float f[8];
+    float8() {}
+    float8(float x) { for (int i = 0; i < 8; i++) f[i] = x; }
+    static float8 load(const float* p) { float8 r; for (int i = 0; i < 8; i++) r.f[i] = p[i]; return r; }
+    static float8 loadU16(const uint16_t* p) { float8 r; for (int i = 0; i < 8; i++) r.f[i] = p[i]; return r; }
+    void store(float* p) const { for (int i = 0; i < 8; i++) p[i] = f[i]; }
+#endif
+
+    // 0, 1, ..., 7 scaled and offset: lane i = base + i * step
+    static float8 ramp(float base, float step)
+    {
+        float lanes[8];
+        for (int i = 0; i < 8; i++)
+            lanes[i] = base + i * step;
+        return load(lanes);
+    }
+};
+
+#if SIMD_AVX2
+#define SIMD_OP2(name, expr) inline float8 name(const float8& a, const float8& b) { return expr(a.v, b.v); }
+#define SIMD_OP1(name, expr) inline float8 name(const float8& a) { return expr(a.v); }
+#elif SIMD_SSE2 || SIMD_NEON
+#define SIMD_OP2(name, expr) inline float8 name(const float8& a, const float8& b) { return float8(expr(a.lo, b.lo), expr(a.hi, b.hi)); }
+#define SIMD_OP1(name, expr) inline float8 name(const float8& a) { return float8(expr(a.lo), expr(a.hi)); }
+#else
+#define SIMD_OP2(name, expr) inline float8 name(const float8& a, const float8& b) { float8 r; for (int i = 0; i < 8; i++) r.f[i] = expr(a.f[i], b.f[i]); return r; }
+#define SIMD_OP1(name, expr) inline float8 name(const float8& a) { float8 r; for (int i = 0; i < 8; i++) r.f[i] = expr(a.f[i]); return r; }
+namespace simd_scalar {
+inline float add(float a, float b) { return a + b; }
+inline float sub(float a, float b) { return a - b; }
+inline float mul(float a, float b) { return a * b; }
+inline float div(float a, float b) { return a / b; }
+inline float min(float a, float b) { return a < b ? a : b; }
+inline float max(float a, float b) { return a > b ? a : b; }
+inline float mask(bool m) { uint32_t bits = m ? 0xFFFFFFFFu : 0u; float f; memcpy(&f, &bits, 4); return f; }
+inline uint32_t bits(float f) { uint32_t b; memcpy(&b, &f, 4); return b; }
+inline float fromBits(uint32_t b) { float f; memcpy(&f, &b, 4); return f; }
+inline float lt(float a, float b) { return mask(a < b); }
+inline float le(float a, float b) { return mask(a <= b); }
+inline float gt(float a, float b) { return mask(a > b); }
+inline float ge(float a, float b) { return mask(a >= b); }
+inline float and_(float a, float b) { return fromBits(bits(a) & bits(b)); }
+inline float or_(float a, float b) { return fromBits(bits(a) | bits(b)); }
+inline float andnot(float a, float b) { return fromBits(~bits(a) & bits(b)); }
+inline float sqrt_(float a) { return std::sqrt(a); }
+inline float floor_(float a) { return std::floor(a); }
+}
+#endif
+
+#if SIMD_AVX2
+SIMD_OP2(operator+, _mm256_add_ps)
+SIMD_OP2(operator-, _mm256_sub_ps)
+SIMD_OP2(operator*, _mm256_mul_ps)
+SIMD_OP2(operator/, _mm256_div_ps)
+SIMD_OP2(min, _mm256_min_ps)
+SIMD_OP2(max, _mm256_max_ps)
+SIMD_OP2(operator&, _mm256_and_ps)
+SIMD_OP2(operator|, _mm256_or_ps)
+SIMD_OP2(andNot, _mm256_andnot_ps)
+SIMD_OP1(sqrt, _mm256_sqrt_ps)
+SIMD_OP1(floor, _mm256_floor_ps)
+inline float8 operator<(const float8& a, const float8& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline float8 operator<=(const float8& a, const float8& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline float8 operator>(const float8& a, const float8& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline float8 operator>=(const float8& a, const float8& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+// MSVC has no __FMA__, its /arch:AVX2 includes FMA
+#if defined(__FMA__) || defined(_MSC_VER)
+inline float8 fmadd(const float8& a, const float8& b, const float8& c) { return _mm256_fmadd_ps(a.v, b.v, c.v); }
+#else
+inline float8 fmadd(const float8& a, const float8& b, const float8& c) { return _mm256_add_ps(_mm256_mul_ps(a.v, b.v), c.v); }
+#endif
+// mask ? a : b
+inline float8 select(const float8& mask, const float8& a, const float8& b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+inline int moveMask(const float8& mask) { return _mm256_movemask_ps(mask.v); }
+inline float reduceAdd(const float8& a)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(a.v), _mm256_extractf128_ps(a.v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+#elif SIMD_SSE2
+SIMD_OP2(operator+, _mm_add_ps)
+SIMD_OP2(operator-, _mm_sub_ps)
+SIMD_OP2(operator*, _mm_mul_ps)
+SIMD_OP2(operator/, _mm_div_ps)
+SIMD_OP2(min, _mm_min_ps)
+SIMD_OP2(max, _mm_max_ps)
+SIMD_OP2(operator&, _mm_and_ps)
+SIMD_OP2(operator|, _mm_or_ps)
+SIMD_OP2(andNot, _mm_andnot_ps)
+SIMD_OP2(operator<, _mm_cmplt_ps)
+SIMD_OP2(operator<=, _mm_cmple_ps)
+SIMD_OP2(operator>, _mm_cmpgt_ps)
+SIMD_OP2(operator>=, _mm_cmpge_ps)
+SIMD_OP1(sqrt, _mm_sqrt_ps)
+inline __m128 simdFloor4(__m128 a)
+{
+    // SSE2 has no floor: truncate, then step down where truncation rounded up
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+    return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a), _mm_set1_ps(1.0f)));
+}
+SIMD_OP1(floor, simdFloor4)
+inline float8 fmadd(const float8& a, const float8& b, const float8& c) { return a * b + c; }
+inline float8 select(const float8& mask, const float8& a, const float8& b) { return (mask & a) | andNot(mask, b); }
+inline int moveMask(const float8& mask) { return _mm_movemask_ps(mask.lo) | (_mm_movemask_ps(mask.hi) << 4); }
+inline float reduceAdd(const float8& a)
+{
+    __m128 s = _mm_add_ps(a.lo, a.hi);
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+#elif SIMD_NEON
+SIMD_OP2(operator+, vaddq_f32)
+SIMD_OP2(operator-, vsubq_f32)
+SIMD_OP2(operator*, vmulq_f32)
+SIMD_OP2(operator/, vdivq_f32)
+SIMD_OP2(min, vminq_f32)
+SIMD_OP2(max, vmaxq_f32)
+SIMD_OP1(sqrt, vsqrtq_f32)
+SIMD_OP1(floor, vrndmq_f32)
+#define SIMD_NEON_BITS(name, op) \
+    inline float32x4_t name(float32x4_t a, float32x4_t b) { return vreinterpretq_f32_u32(op(vreinterpretq_u32_f32(a), vreinterpretq_u32_f32(b))); }
+SIMD_NEON_BITS(simdAnd4, vandq_u32)
+SIMD_NEON_BITS(simdOr4, vorrq_u32)
+inline float32x4_t simdAndNot4(float32x4_t a, float32x4_t b) { return vreinterpretq_f32_u32(vbicq_u32(vreinterpretq_u32_f32(b), vreinterpretq_u32_f32(a))); }
+inline float32x4_t simdLt4(float32x4_t a, float32x4_t b) { return vreinterpretq_f32_u32(vcltq_f32(a, b)); }
+inline float32x4_t simdLe4(float32x4_t a, float32x4_t b) { return vreinterpretq_f32_u32(vcleq_f32(a, b)); }
+inline float32x4_t simdGt4(float32x4_t a, float32x4_t b) { return vreinterpretq_f32_u32(vcgtq_f32(a, b)); }
+inline float32x4_t simdGe4(float32x4_t a, float32x4_t b) { return vreinterpretq_f32_u32(vcgeq_f32(a, b)); }
+SIMD_OP2(operator&, simdAnd4)
+SIMD_OP2(operator|, simdOr4)
+SIMD_OP2(andNot, simdAndNot4)
+SIMD_OP2(operator<, simdLt4)
+SIMD_OP2(operator<=, simdLe4)
+SIMD_OP2(operator>, simdGt4)
+SIMD_OP2(operator>=, simdGe4)
+inline float8 fmadd(const float8& a, const float8& b, const float8& c) { return float8(vfmaq_f32(c.lo, a.lo, b.lo), vfmaq_f32(c.hi, a.hi, b.hi)); }
+inline float8 select(const float8& mask, const float8& a, const float8& b)
+{
+    return float8(vbslq_f32(vreinterpretq_u32_f32(mask.lo), a.lo, b.lo), vbslq_f32(vreinterpretq_u32_f32(mask.hi), a.hi, b.hi));
+}
+inline int moveMask(const float8& mask)
+{
+    uint32_t lanes[8];
+    vst1q_u32(lanes, vreinterpretq_u32_f32(mask.lo));
+    vst1q_u32(lanes + 4, vreinterpretq_u32_f32(mask.hi));
+    int bits = 0;
+    for (int i = 0; i < 8; i++)
+        bits |= (lanes[i] >> 31) << i;
+    return bits;
+}
+inline float reduceAdd(const float8& a) { return vaddvq_f32(vaddq_f32(a.lo, a.hi)); }
+#else
+SIMD_OP2(operator+, simd_scalar::add)
+SIMD_OP2(operator-, simd_scalar::sub)
+SIMD_OP2(operator*, simd_scalar::mul)
+SIMD_OP2(operator/, simd_scalar::div)
+SIMD_OP2(min, simd_scalar::min)
+SIMD_OP2(max, simd_scalar::max)
+SIMD_OP2(operator&, simd_scalar::and_)
+SIMD_OP2(operator|, simd_scalar::or_)
+SIMD_OP2(andNot, simd_scalar::andnot)
+SIMD_OP2(operator<, simd_scalar::lt)
+SIMD_OP2(operator<=, simd_scalar::le)
+SIMD_OP2(operator>, simd_scalar::gt)
+SIMD_OP2(operator>=, simd_scalar::ge)
+SIMD_OP1(sqrt, simd_scalar::sqrt_)
+SIMD_OP1(floor, simd_scalar::floor_)
+inline float8 fmadd(const float8& a, const float8& b, const float8& c) { return a * b + c; }
+inline float8 select(const float8& mask, const float8& a, const float8& b) { return (mask & a) | andNot(mask, b); }
+inline int moveMask(const float8& mask)
+{
+    int bits = 0;
+    for (int i = 0; i < 8; i++)
+        bits |= (simd_scalar::bits(mask.f[i]) >> 31) << i;
+    return bits;
+}
+inline float reduceAdd(const float8& a)
+{
+    float s = 0.0f;
+    for (int i = 0; i < 8; i++)
+        s += a.f[i];
+    return s;
+}
+#endif
+
+#undef SIMD_OP1
+#undef SIMD_OP2
+
+inline float8& operator+=(float8& a, const float8& b) { return a = a + b; }
+inline float8& operator*=(float8& a, const float8& b) { return a = a * b; }
+inline float8 operator-(const float8& a) { return float8(0.0f) - a; }
+inline float8 abs(const float8& a) { return max(a, -a); }
+inline float8 clamp(const float8& a, const float8& lo, const float8& hi) { return min(max(a, lo), hi); }
+
+// sin and cos of any angle together: reduced to [-pi, pi], folded onto
+// [-pi/2, pi/2] (which flips the sign of cos) and evaluated as degree 11 and
+// 12 polynomials, good to about 1e-7 after reduction
+inline void sincos(const float8& x, float8& s, float8& c)
+{
+    const float pi = 3.14159265f, halfPi = 1.57079633f, twoPi = 6.28318531f;
+    float8 a = x - float8(twoPi) * floor(fmadd(x, float8(1.0f / twoPi), float8(0.5f)));
+    float8 above = a > float8(halfPi), below = a < float8(-halfPi);
+    a = select(above, float8(pi) - a, select(below, float8(-pi) - a, a));
+    float8 a2 = a * a;
+    float8 p = fmadd(a2, float8(-2.5052108e-8f), float8(2.7557319e-6f));
+    p = fmadd(a2, p, float8(-1.9841270e-4f));
+    p = fmadd(a2, p, float8(8.3333333e-3f));
+    p = fmadd(a2, p, float8(-1.6666667e-1f));
+    s = a * fmadd(a2, p, float8(1.0f));
+    float8 q = fmadd(a2, float8(2.0876757e-9f), float8(-2.7557319e-7f));
+    q = fmadd(a2, q, float8(2.4801587e-5f));
+    q = fmadd(a2, q, float8(-1.3888889e-3f));
+    q = fmadd(a2, q, float8(4.1666667e-2f));
+    q = fmadd(a2, q, float8(-0.5f));
+    q = fmadd(a2, q, float8(1.0f));
+    c = select(above | below, -q, q);
+}
+inline float8 sin(const float8& x) { float8 s, c; sincos(x, s, c); return s; }
+inline float8 cos(const float8& x) { float8 s, c; sincos(x, s, c); return c; }
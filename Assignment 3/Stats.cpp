@@ -0,0 +1,41 @@
+#include "Stats.h"
+
+#include <iomanip>
+
+FrameStats frameStats;
+
+void FrameStats::add(const std::string& name, double value)
+{
+    Counters[name] += value;
+}
+
+void FrameStats::set(const std::string& name, double value)
+{
+    Gauges[name] = value;
+}
+
+void FrameStats::endFrame(double frameSeconds)
+{
+    Frames++;
+    Seconds += frameSeconds;
+}
+
+void FrameStats::print(std::ostream& out) const
+{
+    long frames = Frames > 0 ? Frames : 1;
+    out << "-- stats: " << Frames << " frames, " << std::fixed << std::setprecision(3)
+        << Seconds * 1000.0 / frames << " ms/frame --" << std::endl;
+    for (auto& counter : Counters)
+        out << "  " << std::left << std::setw(32) << counter.first << counter.second / frames << " /frame" << std::endl;
+    for (auto& gauge : Gauges)
+        out << "  " << std::left << std::setw(32) << gauge.first << gauge.second << std::endl;
+    out << std::defaultfloat << std::right;
+}
+
+void FrameStats::reset()
+{
+    for (auto& counter : Counters)
+        counter.second = 0.0;
+    Frames = 0;
+    Seconds = 0.0;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <map>
+#include <ostream>
+#include <string>
+
+// Named counters printed to the console every few seconds and at the end of
+// a headless run. add() values are per-frame and reported as averages over
+// the print interval, set() values are gauges that keep their last value.
+class FrameStats
+{
+public:
+    void add(const std::string& name, double value);
+    void set(const std::string& name, double value);
+
+    void endFrame(double frameSeconds);
+    void print(std::ostream& out) const;
+    void reset();
+
+    long frames() const { return Frames; }
+
+private:
+    std::map<std::string, double> Counters;
+    std::map<std::string, double> Gauges;
+    long Frames = 0;
+    double Seconds = 0.0;
+};
+
+extern FrameStats frameStats;
@@ -1,19 +1,36 @@
 #include "Texture.h"
+#include "GLState.h"
+#include "Residency.h"
 
 #include "./Dependencies/glew/glew.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "./Dependencies/stb_image/stb_image.h"
 
+#include <algorithm>
 #include <iostream>
 #include <vector>
 #include <string>
 
-void Texture::setupTexture(const char* texturePath)
+std::vector<unsigned char> halveImage(const std::vector<unsigned char>& image, int& width, int& height, int channels)
+{
+	int halfW = std::max(1, width / 2), halfH = std::max(1, height / 2);
+	int stepX = width > 1 ? 1 : 0, stepY = height > 1 ? 1 : 0;
+	std::vector<unsigned char> half((size_t)halfW * halfH * channels);
+	for (int y = 0; y < halfH; y++)
+		for (int x = 0; x < halfW; x++)
+			for (int c = 0; c < channels; c++) {
+				size_t row0 = (size_t)(2 * y) * width, row1 = (size_t)(2 * y + stepY) * width;
+				int sum = image[(row0 + 2 * x) * channels + c] + image[(row0 + 2 * x + stepX) * channels + c] +
+					image[(row1 + 2 * x) * channels + c] + image[(row1 + 2 * x + stepX) * channels + c];
+				half[((size_t)y * halfW + x) * channels + c] = (unsigned char)((sum + 2) / 4);
+			}
+	width = halfW;
+	height = halfH;
+	return half;
+}
+
+size_t Texture::upload(int firstLevel, unsigned int copyFrom)
 {
-	// tell stb_image.h to flip loaded texture's on the y-axis.
-	stbi_set_flip_vertically_on_load(true);
-	// load the texture data into "data"
-	unsigned char* data = stbi_load(texturePath, &Width, &Height, &BPP, 0);
 	GLenum format=3;
 	switch (BPP) {
 		case 1: format = GL_RED; break;
@@ -21,8 +38,9 @@ void Texture::setupTexture(const char* texturePath)
 		case 4: format = GL_RGBA; break;
 	}
 
+	Target = GL_TEXTURE_2D;
 	glGenTextures(1, &ID);
-	glBindTexture(GL_TEXTURE_2D, ID);
+	glState.bindTexture(GL_TEXTURE_2D, ID);
 
 	// set the texture wrapping parameters
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
@@ -31,19 +49,67 @@ void Texture::setupTexture(const char* texturePath)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	
-	if (data) {
-		glTexImage2D(GL_TEXTURE_2D, 0, format, Width, Height, 0, format, GL_UNSIGNED_BYTE, data);
-		glGenerateMipmap(GL_TEXTURE_2D);
-		stbi_image_free(data);
+
+	// every level is specified before any is copied, copies need the texture complete
+	int width = std::max(1, Width >> firstLevel), height = std::max(1, Height >> firstLevel);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (int level = firstLevel, w = width, h = height; level < (int)Levels.size(); level++) {
+		glTexImage2D(GL_TEXTURE_2D, level - firstLevel, format, w, h, 0, format, GL_UNSIGNED_BYTE,
+			copyFrom ? NULL : Levels[level].data());
+		w = std::max(1, w / 2);
+		h = std::max(1, h / 2);
 	}
-	else {
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	for (int level = firstLevel, w = width, h = height; copyFrom && level < (int)Levels.size(); level++) {
+		glCopyImageSubData(copyFrom, GL_TEXTURE_2D, level - Dropped, 0, 0, 0, ID, GL_TEXTURE_2D, level - firstLevel, 0, 0, 0, w, h, 1);
+		w = std::max(1, w / 2);
+		h = std::max(1, h / 2);
+	}
+	glState.bindTexture(GL_TEXTURE_2D, 0);
+
+	Dropped = firstLevel;
+	Bytes = mipChainBytes(width, height, BPP == 3 ? 4 : BPP);
+	return Bytes;
+}
+
+void Texture::setupTexture(const char* texturePath)
+{
+	// tell stb_image.h to flip loaded texture's on the y-axis.
+	stbi_set_flip_vertically_on_load(true);
+	// load the texture data into "data"
+	unsigned char* data = stbi_load(texturePath, &Width, &Height, &BPP, 0);
+	
+	if (!data) {
 		std::cout << "Failed to load texture: " << texturePath << std::endl;
 		exit(1);
 	}
+	// the whole chain stays in memory, dropped levels come back from it
+	Levels.clear();
+	Levels.push_back(std::vector<unsigned char>(data, data + (size_t)Width * Height * BPP));
+	stbi_image_free(data);
+	for (int width = Width, height = Height; width > 1 || height > 1;)
+		Levels.push_back(halveImage(Levels.back(), width, height, BPP));
+	size_t bytes = upload(0);
+	Path = texturePath;
+
+	// at most down to 16 texels on the short side
+	int maxDropped = 0;
+	while ((std::min(Width, Height) >> (maxDropped + 1)) >= 16)
+		maxDropped++;
+	Residency = residency.trackTexture(Path, bytes, maxDropped, [this](int dropped) { return setDroppedLevels(dropped); });
 
 	std::cout << "Load " << texturePath << " successfully!" << std::endl;
-	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+size_t Texture::setDroppedLevels(int droppedLevels)
+{
+	// dropping, the levels that stay are on the GPU already and are copied
+	// there (GL 4.3); restoring, or without copies, they come from memory
+	unsigned int old = ID;
+	bool copy = droppedLevels > Dropped && (GLEW_VERSION_4_3 || GLEW_ARB_copy_image);
+	size_t bytes = upload(droppedLevels, copy ? old : 0);
+	glState.deleteTextures(1, &old);
+	return bytes;
 }
 
 // loads a cubemap texture from 6 individual texture faces
@@ -57,8 +123,9 @@ void Texture::setupTexture(const char* texturePath)
 // -------------------------------------------------------
 void Texture::setupTextureCubemap(const std::vector<std::string>& texPaths)
 {
+    Target = GL_TEXTURE_CUBE_MAP;
     glGenTextures(1, &ID);
-	glBindTexture(GL_TEXTURE_CUBE_MAP, ID);
+	glState.bindTexture(GL_TEXTURE_CUBE_MAP, ID);
 
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     //glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
@@ -92,16 +159,18 @@ void Texture::setupTextureCubemap(const std::vector<std::string>& texPaths)
     }
 
 	std::cout << "Load Cubemap successfully!" << std::endl;
-	glBindTexture(GL_TEXTURE_2D, 0);
+	glState.bindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	Residency = residency.trackTexture(texPaths[0], (size_t)Width * Height * 4 * 6);
 }
 
 void Texture::bind(unsigned int slot) const
 {
-	glActiveTexture(GL_TEXTURE0 + slot);
-	glBindTexture(GL_TEXTURE_2D, ID);
+	if (Residency >= 0)
+		residency.touch(Residency);
+	glState.bindTextureUnit(slot, Target, ID);
 }
 
 void Texture::unbind() const
 {
-	glBindTexture(GL_TEXTURE_2D, 0);
+	glState.bindTexture(Target, 0);
 }
@@ -12,7 +12,26 @@ public:
 	void bind(unsigned int slot) const;
 	void unbind() const;
 
+	// re-create the texture without its top mip levels, returns the new size in bytes;
+	// never reads the disk, levels kept are copied on the GPU or come from the chain in memory
+	size_t setDroppedLevels(int droppedLevels);
+
 private:
 	unsigned int ID;
+	// GL_TEXTURE_2D or GL_TEXTURE_CUBE_MAP
+	unsigned int Target;
 	int Width, Height, BPP;
+	std::string Path;
+	int Residency = -1;
+	// what the texture takes now, mips included
+	size_t Bytes = 0;
+	// the whole mip chain as decoded at setup, and how many of its top levels the texture is without
+	std::vector<std::vector<unsigned char>> Levels;
+	int Dropped = 0;
+
+	// the chain from firstLevel on, from memory or copied from the texture copyFrom
+	size_t upload(int firstLevel, unsigned int copyFrom = 0);
 };
+
+// 2x2 box filter, halves width and height (never below 1)
+std::vector<unsigned char> halveImage(const std::vector<unsigned char>& image, int& width, int& height, int channels);
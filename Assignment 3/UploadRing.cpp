@@ -0,0 +1,174 @@
+#include "UploadRing.h"
+#include "GLState.h"
+#include "Residency.h"
+#include "Stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+UploadRing uploadRing;
+
+static size_t alignUp(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+bool UploadRing::persistentSupported()
+{
+    return GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+}
+
+void UploadRing::setup(size_t regionBytes)
+{
+    GLint alignment = 0;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    UniformAlignment = std::max<size_t>(alignment, 16);
+    if (GLEW_VERSION_4_3 || GLEW_ARB_shader_storage_buffer_object) {
+        glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        StorageAlignment = std::max<size_t>(alignment, 16);
+    }
+    if (GLEW_VERSION_4_3 || GLEW_ARB_texture_buffer_range) {
+        glGetIntegerv(GL_TEXTURE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        TextureAlignment = std::max<size_t>(alignment, 16);
+    }
+    create(regionBytes);
+    std::cout << "Upload ring: " << Regions << " x " << RegionBytes / 1024 << " KB, "
+              << (Mapped ? "persistently mapped" : "copied on flush") << std::endl;
+}
+
+void UploadRing::create(size_t regionBytes)
+{
+    // whole regions, so every region starts aligned for any binding
+    RegionBytes = alignUp(regionBytes, std::max(std::max(UniformAlignment, StorageAlignment), TextureAlignment));
+    size_t bytes = RegionBytes * Regions;
+    glGenBuffers(1, &Buffer);
+    glState.bindBuffer(GL_COPY_WRITE_BUFFER, Buffer);
+    if (persistentSupported()) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_COPY_WRITE_BUFFER, bytes, NULL, flags);
+        Mapped = (unsigned char*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, bytes, flags);
+        Staging.clear();
+    }
+    else {
+        glBufferData(GL_COPY_WRITE_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+        Mapped = nullptr;
+        Staging.resize(RegionBytes);
+    }
+    glState.bindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    for (GLsync& fence : Fences) {
+        if (fence)
+            glDeleteSync(fence);
+        fence = nullptr;
+    }
+    Region = 0;
+    Head = Flushed = 0;
+    if (Residency < 0)
+        Residency = residency.trackBuffer("upload ring", bytes);
+    else
+        residency.resize(Residency, bytes);
+}
+
+void UploadRing::grow(size_t bytes)
+{
+    flush();
+    // the frames in flight still read the old buffer; the GL keeps its
+    // storage until they finish, the name goes once they have
+    RetiredBuffers.push_back({ Buffer, Regions });
+    create(std::max(RegionBytes * 2, bytes * 2));
+    std::cout << "Upload ring grown to " << Regions << " x " << RegionBytes / 1024 << " KB" << std::endl;
+}
+
+void UploadRing::beginFrame()
+{
+    Region = (Region + 1) % Regions;
+    Head = Flushed = 0;
+    GLsync& fence = Fences[Region];
+    if (!fence)
+        return;
+
+    GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+    if (status == GL_TIMEOUT_EXPIRED) {
+        auto start = std::chrono::steady_clock::now();
+        do
+            status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+        while (status == GL_TIMEOUT_EXPIRED);
+        Waits++;
+        WaitMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    glDeleteSync(fence);
+    fence = nullptr;
+}
+
+UploadRing::Allocation UploadRing::allocate(size_t bytes, size_t alignment)
+{
+    // aligned in the buffer, not just in the region
+    size_t base = Region * RegionBytes;
+    size_t offset = alignUp(base + Head, alignment) - base;
+    if (offset + bytes > RegionBytes) {
+        grow(bytes + alignment);
+        base = 0;
+        offset = 0;
+    }
+    Head = offset + bytes;
+    Uploaded += bytes;
+
+    Allocation allocation;
+    allocation.Buffer = Buffer;
+    allocation.Offset = base + offset;
+    allocation.Data = Mapped ? Mapped + allocation.Offset : Staging.data() + offset;
+    return allocation;
+}
+
+UploadRing::Allocation UploadRing::upload(const void* data, size_t bytes, size_t alignment)
+{
+    Allocation allocation = allocate(bytes, alignment);
+    memcpy(allocation.Data, data, bytes);
+    flush();
+    return allocation;
+}
+
+void UploadRing::flush()
+{
+    if (Mapped || Head == Flushed)
+        return;
+    residency.touch(Residency);
+    size_t bytes = Head - Flushed;
+    glState.bindBuffer(GL_COPY_WRITE_BUFFER, Buffer);
+    void* target = glMapBufferRange(GL_COPY_WRITE_BUFFER, Region * RegionBytes + Flushed, bytes,
+                                    GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+    if (target) {
+        memcpy(target, Staging.data() + Flushed, bytes);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    }
+    glState.bindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    Flushed = Head;
+}
+
+void UploadRing::endFrame()
+{
+    flush();
+    residency.touch(Residency);
+    if (Fences[Region])
+        glDeleteSync(Fences[Region]);
+    Fences[Region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    for (Retired& retired : RetiredBuffers)
+        if (--retired.FramesLeft < 0)
+            glState.deleteBuffers(1, &retired.Buffer);
+    RetiredBuffers.erase(std::remove_if(RetiredBuffers.begin(), RetiredBuffers.end(),
+                                        [](const Retired& retired) { return retired.FramesLeft < 0; }),
+                         RetiredBuffers.end());
+}
+
+void UploadRing::reportStats()
+{
+    frameStats.add("upload.bytes", (double)Uploaded);
+    frameStats.add("upload.fence_waits", (double)Waits);
+    frameStats.add("upload.wait_ms", WaitMs);
+    Uploaded = 0;
+    Waits = 0;
+    WaitMs = 0.0;
+}
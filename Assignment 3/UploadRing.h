@@ -0,0 +1,79 @@
+#pragma once
+
+#include "./Dependencies/glew/glew.h"
+
+#include <cstddef>
+#include <vector>
+
+// Per-frame dynamic data (uniforms, indirect commands, instance lists)
+// written straight into GPU-visible memory. One buffer is split into Regions
+// frame regions used in turn; the CPU fills one while the GPU still reads the
+// previous ones, and a fence set at the end of each frame says when its
+// region is free again, so writes never wait on the driver. Allocations are
+// bump pointers into the current region at the alignment asked for. With
+// GL 4.4 or ARB_buffer_storage the buffer is mapped once, persistent and
+// coherent, and written in place; the macOS context stops at 4.1, where
+// writes go to a CPU copy that flush() maps unsynchronized (the fences make
+// that safe) and copies into the region.
+class UploadRing
+{
+public:
+    static const int Regions = 3;
+
+    struct Allocation {
+        // write through Data before the next allocate()
+        void* Data = nullptr;
+        unsigned int Buffer = 0;
+        size_t Offset = 0;
+    };
+
+    static bool persistentSupported();
+
+    // regionBytes is a first guess, a region too small for a frame grows
+    void setup(size_t regionBytes);
+
+    // moves to the next region, waiting for the GPU only if it still reads it
+    void beginFrame();
+    Allocation allocate(size_t bytes, size_t alignment = 16);
+    // allocate, copy in and flush
+    Allocation upload(const void* data, size_t bytes, size_t alignment = 16);
+    // writes since the last flush reach the buffer before the next draw;
+    // nothing to do when persistently mapped
+    void flush();
+    // fences the region against the commands issued with it
+    void endFrame();
+
+    // the offset alignments uniform, storage and texture buffer ranges need
+    size_t uniformAlignment() const { return UniformAlignment; }
+    size_t storageAlignment() const { return StorageAlignment; }
+    size_t textureAlignment() const { return TextureAlignment; }
+
+    // upload.bytes, upload.fence_waits and upload.wait_ms since the last call
+    void reportStats();
+
+private:
+    unsigned int Buffer = 0;
+    unsigned char* Mapped = nullptr;
+    std::vector<unsigned char> Staging;
+    size_t RegionBytes = 0;
+    int Region = 0;
+    size_t Head = 0, Flushed = 0;
+    GLsync Fences[Regions] = {};
+    // outgrown buffers, deleted once the frames using them are done
+    struct Retired {
+        unsigned int Buffer;
+        int FramesLeft;
+    };
+    std::vector<Retired> RetiredBuffers;
+    size_t UniformAlignment = 256, StorageAlignment = 256, TextureAlignment = 256;
+    int Residency = -1;
+
+    size_t Uploaded = 0;
+    int Waits = 0;
+    double WaitMs = 0.0;
+
+    void create(size_t regionBytes);
+    void grow(size_t bytes);
+};
+
+extern UploadRing uploadRing;
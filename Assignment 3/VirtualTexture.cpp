@@ -0,0 +1,668 @@
+#include "VirtualTexture.h"
+#include "GLState.h"
+#include "Parallel.h"
+#include "Residency.h"
+
+#include "./Dependencies/glew/glew.h"
+#include "./Dependencies/stb_image/stb_image.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <utility>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// ---------------------------------------------------------------------------
+// MappedFile
+// ---------------------------------------------------------------------------
+
+bool MappedFile::map(const char* path, size_t createSize)
+{
+    close();
+    bool create = createSize > 0;
+#ifdef _WIN32
+    HANDLE f = CreateFileA(path, create ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ, FILE_SHARE_READ, NULL,
+                           create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (f == INVALID_HANDLE_VALUE)
+        return false;
+    fileHandle = f;
+    LARGE_INTEGER fileSize;
+    if (create)
+        fileSize.QuadPart = (LONGLONG)createSize;
+    else
+        GetFileSizeEx(f, &fileSize);
+    size = (size_t)fileSize.QuadPart;
+    mapHandle = CreateFileMappingA(f, NULL, create ? PAGE_READWRITE : PAGE_READONLY, fileSize.HighPart, fileSize.LowPart, NULL);
+    if (!mapHandle)
+        return false;
+    data = (unsigned char*)MapViewOfFile(mapHandle, create ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+#else
+    fd = ::open(path, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDONLY, 0644);
+    if (fd < 0)
+        return false;
+    if (create) {
+        if (ftruncate(fd, (off_t)createSize) != 0)
+            return false;
+        size = createSize;
+    }
+    else {
+        struct stat st;
+        fstat(fd, &st);
+        size = (size_t)st.st_size;
+    }
+    void* p = mmap(NULL, size, create ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+    data = p == MAP_FAILED ? nullptr : (unsigned char*)p;
+#endif
+    return data != nullptr;
+}
+
+bool MappedFile::open(const char* path)
+{
+    return map(path, 0);
+}
+
+bool MappedFile::create(const char* path, size_t fileSize)
+{
+    return map(path, fileSize);
+}
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+    if (data)
+        UnmapViewOfFile(data);
+    if (mapHandle)
+        CloseHandle(mapHandle);
+    if (fileHandle)
+        CloseHandle(fileHandle);
+    fileHandle = mapHandle = nullptr;
+#else
+    if (data)
+        munmap(data, size);
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+#endif
+    data = nullptr;
+    size = 0;
+}
+
+// ---------------------------------------------------------------------------
+// Page file building
+// ---------------------------------------------------------------------------
+
+// source image for the tiler: uncompressed BMPs and DDSs (level 0, e.g. from
+// the normal baker) are read straight from a mapping so huge maps never have
+// to fit in memory, other formats go through stb_image
+struct SourceImage {
+    int Width = 0, Height = 0;
+    MappedFile File;
+    const unsigned char* Pixels = nullptr;
+    size_t Stride = 0;
+    int Channels = 0;
+    bool Bgr = false, TopDown = false;
+    unsigned char* Decoded = nullptr;
+
+    bool open(const char* path)
+    {
+        if (File.open(path) && File.size > 54 && File.data[0] == 'B' && File.data[1] == 'M') {
+            uint32_t offset, compression;
+            int32_t w, h;
+            uint16_t bpp;
+            memcpy(&offset, File.data + 10, 4);
+            memcpy(&w, File.data + 18, 4);
+            memcpy(&h, File.data + 22, 4);
+            memcpy(&bpp, File.data + 28, 2);
+            memcpy(&compression, File.data + 30, 4);
+            // the rows have to be in the file, a short or malformed one goes to stb_image
+            size_t rows = h < 0 ? (size_t)-(int64_t)h : (size_t)h;
+            size_t stride = ((size_t)(w > 0 ? w : 0) * (bpp / 8) + 3) & ~(size_t)3;
+            if ((bpp == 24 || bpp == 32) && (compression == 0 || compression == 3) && w > 0 && h != 0 &&
+                offset <= File.size && stride * rows <= File.size - offset && rows <= (size_t)INT32_MAX) {
+                Width = w;
+                Height = (int)rows;
+                TopDown = h < 0;
+                Channels = bpp / 8;
+                Stride = stride;
+                Pixels = File.data + offset;
+                Bgr = true;
+                return true;
+            }
+        }
+        if (File.data && File.size > 128 && memcmp(File.data, "DDS ", 4) == 0) {
+            uint32_t h, w, fourCC, bpp, redMask;
+            memcpy(&h, File.data + 12, 4);
+            memcpy(&w, File.data + 16, 4);
+            memcpy(&fourCC, File.data + 84, 4);
+            memcpy(&bpp, File.data + 88, 4);
+            memcpy(&redMask, File.data + 92, 4);
+            if (fourCC == 0 && (bpp == 24 || bpp == 32) && File.size >= 128 + (size_t)w * h * (bpp / 8)) {
+                Width = w;
+                Height = h;
+                TopDown = true;
+                Channels = bpp / 8;
+                Stride = (size_t)Width * Channels;
+                Pixels = File.data + 128;
+                Bgr = redMask != 0xff;
+                return true;
+            }
+        }
+        File.close();
+        // rows bottom first, like the BMP path and like Texture::setupTexture
+        stbi_set_flip_vertically_on_load(true);
+        Decoded = stbi_load(path, &Width, &Height, &Channels, 0);
+        Pixels = Decoded;
+        Stride = (size_t)Width * Channels;
+        return Decoded != nullptr;
+    }
+
+    ~SourceImage()
+    {
+        if (Decoded)
+            stbi_image_free(Decoded);
+    }
+
+    // texel with y = 0 at the bottom row
+    void texel(int x, int y, unsigned char* rgba) const
+    {
+        const unsigned char* p = Pixels + (size_t)(TopDown ? Height - 1 - y : y) * Stride + (size_t)x * Channels;
+        switch (Channels) {
+            case 1: rgba[0] = rgba[1] = rgba[2] = p[0]; rgba[3] = 255; break;
+            case 2: rgba[0] = rgba[1] = rgba[2] = p[0]; rgba[3] = p[1]; break;
+            default:
+                rgba[0] = Bgr ? p[2] : p[0];
+                rgba[1] = p[1];
+                rgba[2] = Bgr ? p[0] : p[2];
+                rgba[3] = Channels == 4 ? p[3] : 255;
+        }
+    }
+};
+
+// what a page file with this header takes, 0 when no page file could have it
+static uint64_t pageFileBytes(const PageFileHeader& header)
+{
+    if (memcmp(header.magic, "VTP1", 4) != 0 || header.pageSize == 0 || header.pageSize > 4096 || header.border > 64 ||
+        header.pagesX == 0 || header.pagesY == 0 || header.pagesX > 65536 || header.pagesY > 65536 ||
+        header.levels == 0 || header.levels > 32)
+        return 0;
+    uint64_t pages = 0;
+    for (uint32_t level = 0; level < header.levels; level++)
+        pages += (uint64_t)std::max(1u, header.pagesX >> level) * std::max(1u, header.pagesY >> level);
+    uint64_t stride = header.pageSize + 2 * header.border;
+    return sizeof(PageFileHeader) + pages * stride * stride * 4;
+}
+
+// a complete file over another, in one step where the system allows
+static bool replaceFile(const char* from, const char* to)
+{
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return std::rename(from, to) == 0;
+#endif
+}
+
+static uint32_t nextPowerOfTwo(uint32_t v)
+{
+    uint32_t p = 1;
+    while (p < v)
+        p <<= 1;
+    return p;
+}
+
+template <typename Func>
+static void parallelRows(uint32_t rows, Func func)
+{
+    parallelFor(rows, 1, [&](size_t begin, size_t end) {
+        for (size_t row = begin; row < end; row++)
+            func((uint32_t)row);
+    });
+}
+
+bool VirtualTexture::buildPageFile(const char* sourcePath, const char* pagePath, int pageSize, int border)
+{
+    SourceImage source;
+    if (!source.open(sourcePath)) {
+        std::cout << "Failed to open virtual texture source: " << sourcePath << std::endl;
+        return false;
+    }
+
+    PageFileHeader header;
+    memcpy(header.magic, "VTP1", 4);
+    header.width = source.Width;
+    header.height = source.Height;
+    header.pageSize = pageSize;
+    header.border = border;
+    header.pagesX = nextPowerOfTwo((source.Width + pageSize - 1) / pageSize);
+    header.pagesY = nextPowerOfTwo((source.Height + pageSize - 1) / pageSize);
+    header.levels = 1;
+    while ((std::max(header.pagesX, header.pagesY) >> (header.levels - 1)) > 1)
+        header.levels++;
+
+    // the header doubles as the layout description for the helpers below
+    VirtualTexture layout;
+    layout.Header = header;
+    uint64_t totalPages = 0;
+    for (uint32_t level = 0; level < header.levels; level++) {
+        layout.LevelFirstPage.push_back(totalPages);
+        totalPages += (uint64_t)layout.levelPagesX(level) * layout.levelPagesY(level);
+    }
+    const size_t stride = pageSize + 2 * border;
+    const size_t bytes = layout.pageBytes();
+
+    // built aside, only a complete file takes the page file's name
+    std::string buildPath = std::string(pagePath) + ".tmp";
+    MappedFile out;
+    if (!out.create(buildPath.c_str(), sizeof(PageFileHeader) + totalPages * bytes)) {
+        std::cout << "Failed to create page file: " << buildPath << std::endl;
+        out.close();
+        std::remove(buildPath.c_str());
+        return false;
+    }
+    memcpy(out.data, &header, sizeof(header));
+    unsigned char* pages = out.data + sizeof(PageFileHeader);
+
+    std::cout << "Building page file " << pagePath << " (" << source.Width << "x" << source.Height << ", "
+              << totalPages << " pages)" << std::endl;
+
+    for (uint32_t level = 0; level < header.levels; level++) {
+        // extent of real content at this level; the padding replicates the edge
+        int contentW = std::max(1, (int)std::ceil(source.Width / std::ldexp(1.0, level)));
+        int contentH = std::max(1, (int)std::ceil(source.Height / std::ldexp(1.0, level)));
+        uint32_t pagesX = layout.levelPagesX(level);
+        uint32_t pagesY = layout.levelPagesY(level);
+        uint32_t prevPagesX = level > 0 ? layout.levelPagesX(level - 1) : 0;
+        int prevW = std::max(1, (int)std::ceil(source.Width / std::ldexp(1.0, (int)level - 1)));
+        int prevH = std::max(1, (int)std::ceil(source.Height / std::ldexp(1.0, (int)level - 1)));
+
+        auto storedTexel = [&](uint32_t lvl, uint32_t firstPagesX, int x, int y) -> const unsigned char* {
+            x = std::min(x, prevW - 1);
+            y = std::min(y, prevH - 1);
+            uint64_t page = layout.LevelFirstPage[lvl] + (uint64_t)(y / pageSize) * firstPagesX + (x / pageSize);
+            size_t inner = ((size_t)(y % pageSize + border) * stride + (x % pageSize + border)) * 4;
+            return pages + page * bytes + inner;
+        };
+
+        parallelRows(pagesY, [&](uint32_t py) {
+            for (uint32_t px = 0; px < pagesX; px++) {
+                unsigned char* dst = pages + (layout.LevelFirstPage[level] + (uint64_t)py * pagesX + px) * bytes;
+                for (size_t ty = 0; ty < stride; ty++)
+                    for (size_t tx = 0; tx < stride; tx++) {
+                        int x = glm::clamp((int)(px * pageSize + tx) - border, 0, contentW - 1);
+                        int y = glm::clamp((int)(py * pageSize + ty) - border, 0, contentH - 1);
+                        unsigned char* texel = dst + (ty * stride + tx) * 4;
+                        if (level == 0) {
+                            source.texel(x, y, texel);
+                            continue;
+                        }
+                        // 2x2 box filter of the level above, already in the file
+                        int sum[4] = { 0, 0, 0, 0 };
+                        for (int j = 0; j < 2; j++)
+                            for (int i = 0; i < 2; i++) {
+                                const unsigned char* s = storedTexel(level - 1, prevPagesX, 2 * x + i, 2 * y + j);
+                                for (int c = 0; c < 4; c++)
+                                    sum[c] += s[c];
+                            }
+                        for (int c = 0; c < 4; c++)
+                            texel[c] = (unsigned char)((sum[c] + 2) / 4);
+                    }
+            }
+        });
+    }
+
+    out.close();
+    if (!replaceFile(buildPath.c_str(), pagePath)) {
+        std::cout << "Failed to move " << buildPath << " to " << pagePath << std::endl;
+        std::remove(buildPath.c_str());
+        return false;
+    }
+    std::cout << "Build " << pagePath << " successfully!" << std::endl;
+    return true;
+}
+
+bool VirtualTexture::updatePageFile(const char* sourcePath, const char* pagePath)
+{
+    struct stat src, dst;
+    bool haveSource = stat(sourcePath, &src) == 0;
+    bool havePages = stat(pagePath, &dst) == 0;
+    if (havePages && (!haveSource || dst.st_mtime >= src.st_mtime)) {
+        // and as long as its header says
+        MappedFile pages;
+        PageFileHeader header;
+        if (pages.open(pagePath) && pages.size >= sizeof(header)) {
+            memcpy(&header, pages.data, sizeof(header));
+            uint64_t bytes = pageFileBytes(header);
+            if (bytes > 0 && pages.size >= bytes)
+                return true;
+        }
+        if (!haveSource)
+            return false;
+        std::cout << "Page file " << pagePath << " is damaged, building it again" << std::endl;
+    }
+    return buildPageFile(sourcePath, pagePath);
+}
+
+// ---------------------------------------------------------------------------
+// Runtime
+// ---------------------------------------------------------------------------
+
+uint64_t VirtualTexture::pageKey(uint32_t level, uint32_t x, uint32_t y)
+{
+    return ((uint64_t)level << 48) | ((uint64_t)y << 24) | x;
+}
+
+uint32_t VirtualTexture::levelPagesX(uint32_t level) const
+{
+    return std::max(1u, Header.pagesX >> level);
+}
+
+uint32_t VirtualTexture::levelPagesY(uint32_t level) const
+{
+    return std::max(1u, Header.pagesY >> level);
+}
+
+size_t VirtualTexture::pageBytes() const
+{
+    size_t stride = Header.pageSize + 2 * Header.border;
+    return stride * stride * 4;
+}
+
+glm::vec2 VirtualTexture::uvScale() const
+{
+    return glm::vec2(float(Header.width) / float(Header.pagesX * Header.pageSize),
+                     float(Header.height) / float(Header.pagesY * Header.pageSize));
+}
+
+void VirtualTexture::setup(const std::vector<std::string>& pagePaths, int cacheSlots)
+{
+    for (size_t i = 0; i < pagePaths.size(); i++) {
+        std::unique_ptr<MappedFile> layer(new MappedFile());
+        if (!layer->open(pagePaths[i].c_str()) || layer->size < sizeof(PageFileHeader)) {
+            std::cout << "Failed to load page file: " << pagePaths[i] << std::endl;
+            exit(1);
+        }
+        PageFileHeader header;
+        memcpy(&header, layer->data, sizeof(header));
+        uint64_t bytes = pageFileBytes(header);
+        if (bytes == 0 || layer->size < bytes) {
+            std::cout << "Page file " << pagePaths[i] << " is damaged or cut short" << std::endl;
+            exit(1);
+        }
+        if (i > 0 && memcmp(&header, &Header, sizeof(header)) != 0) {
+            std::cout << "Page file " << pagePaths[i] << " does not match the other layers" << std::endl;
+            exit(1);
+        }
+        Header = header;
+        Layers.push_back(std::move(layer));
+    }
+
+    LevelFirstPage.clear();
+    uint64_t totalPages = 0;
+    for (uint32_t level = 0; level < Header.levels; level++) {
+        LevelFirstPage.push_back(totalPages);
+        totalPages += (uint64_t)levelPagesX(level) * levelPagesY(level);
+    }
+
+    // indirection: one RGBA8 texel per page and level -> (slot x, slot y, resident level)
+    glGenTextures(1, &IndirectionID);
+    glState.bindTexture(GL_TEXTURE_2D, IndirectionID);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, Header.levels - 1);
+    Indirection.resize(Header.levels);
+    for (uint32_t level = 0; level < Header.levels; level++) {
+        Indirection[level].assign((size_t)levelPagesX(level) * levelPagesY(level) * 4, 0);
+        glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, levelPagesX(level), levelPagesY(level), 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    }
+
+    // physical caches, one per layer, sharing the slot layout
+    CacheSlots = cacheSlots;
+    int cacheSize = CacheSlots * (Header.pageSize + 2 * Header.border);
+    CacheIDs.resize(Layers.size());
+    glGenTextures((GLsizei)CacheIDs.size(), CacheIDs.data());
+    for (size_t i = 0; i < CacheIDs.size(); i++) {
+        glState.bindTexture(GL_TEXTURE_2D, CacheIDs[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, cacheSize, cacheSize, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        ResidencyHandles.push_back(residency.trackTexture(pagePaths[i] + " cache", (size_t)cacheSize * cacheSize * 4));
+    }
+    glState.bindTexture(GL_TEXTURE_2D, 0);
+    ResidencyHandles.push_back(residency.trackTexture(pagePaths[0] + " indirection",
+                                                      mipChainBytes(Header.pagesX, Header.pagesY, 4)));
+
+    Slots.assign(CacheSlots * CacheSlots, Slot());
+    LRU.clear();
+    Resident.clear();
+    for (int i = 0; i < (int)Slots.size(); i++)
+        Slots[i].lru = LRU.insert(LRU.end(), i);
+
+    // the single page of the coarsest level is always resident so every lookup has a fallback
+    int root = acquireSlot();
+    upload(pageKey(Header.levels - 1, 0, 0), root);
+    Slots[root].pinned = true;
+    LRU.erase(Slots[root].lru);
+    rebuildIndirection();
+
+    glGenFramebuffers(1, &FeedbackFBO);
+    glGenTextures(1, &FeedbackColour);
+    glGenRenderbuffers(1, &FeedbackDepth);
+    glGenBuffers(2, FeedbackPBO);
+    FeedbackResidency = residency.trackTexture(pagePaths[0] + " feedback", 0);
+    ResidencyHandles.push_back(FeedbackResidency);
+
+    std::cout << "Load virtual texture " << Header.width << "x" << Header.height << " (" << Layers.size()
+              << " layers, " << Slots.size() << " cache slots) successfully!" << std::endl;
+}
+
+void VirtualTexture::release()
+{
+    // each layer unmaps and closes its file as it goes
+    Layers.clear();
+}
+
+void VirtualTexture::beginFeedback()
+{
+    glGetIntegerv(GL_VIEWPORT, SavedViewport);
+    int width = std::max(1, SavedViewport[2] / FeedbackDivisor);
+    int height = std::max(1, SavedViewport[3] / FeedbackDivisor);
+
+    if (width != FeedbackWidth || height != FeedbackHeight) {
+        FeedbackWidth = width;
+        FeedbackHeight = height;
+
+        glState.bindTexture(GL_TEXTURE_2D, FeedbackColour);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16UI, width, height, 0, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, NULL);
+        glState.bindTexture(GL_TEXTURE_2D, 0);
+        glBindRenderbuffer(GL_RENDERBUFFER, FeedbackDepth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, FeedbackFBO);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, FeedbackColour, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, FeedbackDepth);
+
+        for (int i = 0; i < 2; i++) {
+            glState.bindBuffer(GL_PIXEL_PACK_BUFFER, FeedbackPBO[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)width * height * 4 * sizeof(GLushort), NULL, GL_STREAM_READ);
+        }
+        glState.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        FeedbackFrames = 0; // both PBOs are stale now
+
+        // colour + depth target and two read back buffers of 8 bytes per texel
+        residency.resize(FeedbackResidency, (size_t)width * height * (8 + 4 + 2 * 8));
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, FeedbackFBO);
+    glViewport(0, 0, FeedbackWidth, FeedbackHeight);
+    GLuint clear[4] = { 0, 0, 0, 0 };
+    glClearBufferuiv(GL_COLOR, 0, clear);
+    glClear(GL_DEPTH_BUFFER_BIT);
+
+    FeedbackLodBias = std::log2(float(SavedViewport[2]) / float(FeedbackWidth));
+}
+
+void VirtualTexture::endFeedback()
+{
+    // asynchronous read back, consumed by update() one frame later
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glState.bindBuffer(GL_PIXEL_PACK_BUFFER, FeedbackPBO[FeedbackFrames & 1]);
+    glReadPixels(0, 0, FeedbackWidth, FeedbackHeight, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, 0);
+    glState.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    FeedbackFrames++;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(SavedViewport[0], SavedViewport[1], SavedViewport[2], SavedViewport[3]);
+}
+
+void VirtualTexture::update()
+{
+    Frame++;
+    UploadsLastFrame = 0;
+    if (FeedbackFrames < 2)
+        return;
+
+    // the buffer endFeedback() filled on the previous frame
+    std::vector<uint64_t> requests;
+    glState.bindBuffer(GL_PIXEL_PACK_BUFFER, FeedbackPBO[FeedbackFrames & 1]);
+    const GLushort* feedback = (const GLushort*)glMapBufferRange(
+        GL_PIXEL_PACK_BUFFER, 0, (GLsizeiptr)FeedbackWidth * FeedbackHeight * 4 * sizeof(GLushort), GL_MAP_READ_BIT);
+    if (feedback) {
+        for (int i = 0; i < FeedbackWidth * FeedbackHeight; i++) {
+            const GLushort* p = feedback + i * 4;
+            if (p[3] == 0 || p[2] >= Header.levels)
+                continue;
+            // also ask for the ancestors so quality refines progressively
+            for (uint32_t level = p[2], x = p[0], y = p[1]; level < Header.levels; level++, x >>= 1, y >>= 1)
+                requests.push_back(pageKey(level, x, y));
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glState.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    // unique, coarsest level first
+    std::sort(requests.begin(), requests.end(), std::greater<uint64_t>());
+    requests.erase(std::unique(requests.begin(), requests.end()), requests.end());
+
+    std::vector<uint64_t> missing;
+    for (uint64_t key : requests) {
+        auto it = Resident.find(key);
+        if (it == Resident.end()) {
+            missing.push_back(key);
+            continue;
+        }
+        Slot& slot = Slots[it->second];
+        slot.lastUsed = Frame;
+        if (!slot.pinned)
+            LRU.splice(LRU.begin(), LRU, slot.lru);
+    }
+
+    for (uint64_t key : missing) {
+        if (UploadsLastFrame >= MaxUploadsPerFrame)
+            break;
+        int slot = acquireSlot();
+        if (slot < 0)
+            break; // everything in the cache is visible this frame
+        upload(key, slot);
+        UploadsLastFrame++;
+    }
+
+    if (IndirectionDirty)
+        rebuildIndirection();
+}
+
+int VirtualTexture::acquireSlot()
+{
+    if (LRU.empty())
+        return -1;
+    int index = LRU.back();
+    Slot& slot = Slots[index];
+    if (slot.key != ~0ull) {
+        if (slot.lastUsed == Frame)
+            return -1;
+        Resident.erase(slot.key);
+        IndirectionDirty = true;
+    }
+    LRU.splice(LRU.begin(), LRU, slot.lru);
+    return index;
+}
+
+void VirtualTexture::upload(uint64_t key, int slot)
+{
+    uint32_t level = (uint32_t)(key >> 48);
+    uint32_t y = (uint32_t)(key >> 24) & 0xFFFFFF;
+    uint32_t x = (uint32_t)key & 0xFFFFFF;
+    uint64_t page = LevelFirstPage[level] + (uint64_t)y * levelPagesX(level) + x;
+    int stride = Header.pageSize + 2 * Header.border;
+
+    for (size_t i = 0; i < Layers.size(); i++) {
+        const unsigned char* data = Layers[i]->data + sizeof(PageFileHeader) + page * pageBytes();
+        glState.bindTexture(GL_TEXTURE_2D, CacheIDs[i]);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % CacheSlots) * stride, (slot / CacheSlots) * stride,
+                        stride, stride, GL_RGBA, GL_UNSIGNED_BYTE, data);
+    }
+    glState.bindTexture(GL_TEXTURE_2D, 0);
+
+    Slots[slot].key = key;
+    Slots[slot].lastUsed = Frame;
+    Resident[key] = slot;
+    IndirectionDirty = true;
+}
+
+void VirtualTexture::rebuildIndirection()
+{
+    glState.bindTexture(GL_TEXTURE_2D, IndirectionID);
+    for (int level = (int)Header.levels - 1; level >= 0; level--) {
+        uint32_t pagesX = levelPagesX(level), pagesY = levelPagesY(level);
+        std::vector<unsigned char>& table = Indirection[level];
+        for (uint32_t y = 0; y < pagesY; y++)
+            for (uint32_t x = 0; x < pagesX; x++) {
+                unsigned char* entry = &table[((size_t)y * pagesX + x) * 4];
+                auto it = Resident.find(pageKey(level, x, y));
+                if (it != Resident.end()) {
+                    entry[0] = (unsigned char)(it->second % CacheSlots);
+                    entry[1] = (unsigned char)(it->second / CacheSlots);
+                    entry[2] = (unsigned char)level;
+                    entry[3] = 255;
+                }
+                else {
+                    // fall back to whatever covers this page one level up
+                    const std::vector<unsigned char>& parent = Indirection[level + 1];
+                    memcpy(entry, &parent[((size_t)(y / 2) * levelPagesX(level + 1) + x / 2) * 4], 4);
+                }
+            }
+        glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, pagesX, pagesY, GL_RGBA, GL_UNSIGNED_BYTE, table.data());
+    }
+    glState.bindTexture(GL_TEXTURE_2D, 0);
+    IndirectionDirty = false;
+}
+
+void VirtualTexture::bind(unsigned int firstSlot) const
+{
+    residency.touch(ResidencyHandles);
+    glState.bindTextureUnit(firstSlot, GL_TEXTURE_2D, IndirectionID);
+    for (size_t i = 0; i < CacheIDs.size(); i++)
+        glState.bindTextureUnit(firstSlot + 1 + (unsigned int)i, GL_TEXTURE_2D, CacheIDs[i]);
+}
+
+void VirtualTexture::unbind(unsigned int firstSlot) const
+{
+    for (size_t i = 0; i <= CacheIDs.size(); i++)
+        glState.bindTextureUnit(firstSlot + (unsigned int)i, GL_TEXTURE_2D, 0);
+    glState.activeTexture(GL_TEXTURE0);
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "./Dependencies/glm/glm.hpp"
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// memory mapping of a whole file, read-only or freshly created for writing
+struct MappedFile {
+    unsigned char* data = nullptr;
+    size_t size = 0;
+
+    bool open(const char* path);
+    bool create(const char* path, size_t fileSize);
+    void close();
+    ~MappedFile() { close(); }
+
+private:
+    bool map(const char* path, size_t createSize);
+
+#ifdef _WIN32
+    void* fileHandle = nullptr;
+    void* mapHandle = nullptr;
+#else
+    int fd = -1;
+#endif
+};
+
+// header of a page file (.vtp) produced by VirtualTexture::buildPageFile
+// pages are stored level by level, row-major, bottom row first, as RGBA8
+// with a border of duplicated neighbour texels around every page
+struct PageFileHeader {
+    char magic[4];
+    uint32_t width, height;     // source image size in texels
+    uint32_t pageSize, border;  // payload size and border of one page
+    uint32_t pagesX, pagesY;    // page grid of level 0 (powers of two)
+    uint32_t levels;
+};
+
+// Sparse virtual texture: the source image lives in a tiled page file on disk
+// and only the pages the feedback pass asks for are streamed into a fixed
+// size physical cache. Several layers (e.g. colour and normal map) can share
+// one page layout, residency and indirection table.
+class VirtualTexture
+{
+public:
+    // tile a BMP (streamed through a mapping) or any stb_image format into a
+    // page file, built beside it as <pagePath>.tmp and renamed into place
+    // once complete, so a build that stops halfway leaves no page file
+    static bool buildPageFile(const char* sourcePath, const char* pagePath, int pageSize = 128, int border = 4);
+    // rebuild the page file only if it is missing, older than the source or
+    // shorter than its header says
+    static bool updatePageFile(const char* sourcePath, const char* pagePath);
+
+    void setup(const std::vector<std::string>& pagePaths, int cacheSlots = 16);
+    // unmap the page files, nothing streams after this
+    void release();
+
+    // low resolution pass that records which pages are visible
+    void beginFeedback();
+    void endFeedback();
+    float feedbackLodBias() const { return FeedbackLodBias; }
+
+    // read back last frame's feedback, stream missing pages, refresh the indirection table
+    void update();
+
+    // indirection on unit firstSlot, physical caches of the layers on the following units
+    void bind(unsigned int firstSlot) const;
+    void unbind(unsigned int firstSlot) const;
+
+    glm::vec2 virtualPages() const { return glm::vec2(Header.pagesX, Header.pagesY); }
+    glm::vec2 uvScale() const;
+    float maxLevel() const { return float(Header.levels - 1); }
+    float pageSize() const { return float(Header.pageSize); }
+    float border() const { return float(Header.border); }
+    float cacheSlots() const { return float(CacheSlots); }
+
+    int residentPages() const { return (int)Resident.size(); }
+    int uploadsLastFrame() const { return UploadsLastFrame; }
+
+    int MaxUploadsPerFrame = 16;
+    int FeedbackDivisor = 8;
+
+private:
+    struct Slot {
+        uint64_t key = ~0ull;
+        unsigned int lastUsed = 0;
+        bool pinned = false;
+        std::list<int>::iterator lru;
+    };
+
+    PageFileHeader Header;
+    std::vector<std::unique_ptr<MappedFile>> Layers;
+    std::vector<uint64_t> LevelFirstPage;
+
+    unsigned int IndirectionID;
+    std::vector<unsigned int> CacheIDs;
+    std::vector<int> ResidencyHandles;
+    int FeedbackResidency = -1;
+    std::vector<std::vector<unsigned char>> Indirection;
+    bool IndirectionDirty = true;
+
+    int CacheSlots = 16;
+    std::vector<Slot> Slots;
+    std::list<int> LRU; // front = most recently used
+    std::unordered_map<uint64_t, int> Resident;
+
+    unsigned int FeedbackFBO, FeedbackColour, FeedbackDepth;
+    unsigned int FeedbackPBO[2];
+    int FeedbackWidth = 0, FeedbackHeight = 0;
+    int SavedViewport[4];
+    float FeedbackLodBias = 0.0f;
+    unsigned int FeedbackFrames = 0;
+    unsigned int Frame = 0;
+    int UploadsLastFrame = 0;
+
+    static uint64_t pageKey(uint32_t level, uint32_t x, uint32_t y);
+    uint32_t levelPagesX(uint32_t level) const;
+    uint32_t levelPagesY(uint32_t level) const;
+    size_t pageBytes() const;
+
+    void upload(uint64_t key, int slot);
+    int acquireSlot();
+    void rebuildIndirection();
+};
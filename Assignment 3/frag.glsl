@@ -6,11 +6,34 @@ in vec2 oUV;
 in vec3 oNorm;
 in vec3 FragPos;
 
-uniform sampler2D tex1;
+uniform sampler2DArray tex1;
+#ifdef MULTI_DRAW
+// from the per-draw data, see vert.glsl
+flat in int oLayer;
+#define layer oLayer
+#else
+uniform int layer;
+#endif
 
-uniform float dirlightBrightness;
+#include "frame.glsl"
+
+// features, see ShaderVariants: ALPHA_TEST, ENV_LIGHTING, INSTANCED (vertex stage only), MULTI_DRAW
+#ifdef ENV_LIGHTING
+#include "lighting.glsl"
+#endif
 
 void main()
 {
-   FragColor = texture(tex1, oUV);
+   vec4 albedo = texture(tex1, vec3(oUV, layer));
+#ifdef ALPHA_TEST
+   if (albedo.a < 0.5)
+       discard;
+#endif
+#ifdef ENV_LIGHTING
+   vec3 normal = normalize(oNorm);
+   float diff = max(dot(normal, normalize(lightPos.xyz - FragPos)), 0.0);
+   FragColor = vec4(albedo.rgb * (irradianceSH(normal) + dirlightBrightness * diff), albedo.a);
+#else
+   FragColor = albedo;
+#endif
 }
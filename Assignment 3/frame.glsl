@@ -0,0 +1,10 @@
+// per-frame constants, mirrors FrameData in FrameUniforms.h
+layout (std140) uniform FrameData {
+    mat4 viewMatrix;
+    mat4 projectionMatrix;
+    mat4 skyboxViewMatrix;
+    vec4 lightPos;
+    vec4 viewPos;
+    float dirlightBrightness;
+    float time;
+};
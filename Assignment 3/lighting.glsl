@@ -0,0 +1,11 @@
+// irradiance of the skybox as 9 SH coefficients, basis constants and the
+// cosine lobe folded in by EnvironmentLight
+uniform vec3 envSH[9];
+
+vec3 irradianceSH(vec3 n)
+{
+    return envSH[0]
+         + envSH[1] * n.y + envSH[2] * n.z + envSH[3] * n.x
+         + envSH[4] * (n.x * n.y) + envSH[5] * (n.y * n.z) + envSH[6] * (3.0 * n.z * n.z - 1.0)
+         + envSH[7] * (n.x * n.z) + envSH[8] * (n.x * n.x - n.y * n.y);
+}
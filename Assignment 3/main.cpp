@@ -8,12 +8,45 @@ Student Name: Jerry Cheng
 #include "./Dependencies/glm/glm.hpp"
 #include "./Dependencies/glm/gtc/matrix_transform.hpp"
 #include "Shader.h"
+#include "ShaderPipeline.h"
+#include "ShaderVariants.h"
 #include "Texture.h"
 #include "Misc.h"
-
+#include "VirtualTexture.h"
+#include "MaterialPacker.h"
+#include "Residency.h"
+#include "Stats.h"
+#include "EnvironmentLight.h"
+#include "NormalBaker.h"
+#include "GLState.h"
+#include "GeometryPool.h"
+#include "Culling.h"
+#include "Bvh.h"
+#include "Occlusion.h"
+#include "GpuCulling.h"
+#include "Lod.h"
+#include "Parallel.h"
+#include "FrameUniforms.h"
+#include "RenderQueue.h"
+#include "CommandList.h"
+#include "LockFree.h"
+#include "FixedStepThread.h"
+#include "UploadRing.h"
+#include "Orbits.h"
+#include "Belt.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
 #include <iostream>
 #include <fstream>
+#include <string>
 #include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <sys/stat.h>
 
 // Testing variables
 
@@ -104,6 +137,15 @@ public:
         updateCameraVectors();
     }
     
+    // puts the camera where the simulation had it
+    void SetSpherical(float r, float theta, float phi)
+    {
+        R = r;
+        Theta = theta;
+        Phi = phi;
+        updateCameraVectors();
+    }
+    
     void ProcessMouseScroll(float yoffset)
     {
         R -= yoffset * ScrollSensitivity;
@@ -134,17 +176,32 @@ private:
 };
 
 // Shaders
-Shader shader;
+// vert.glsl/frag.glsl permutations for every textured mesh
+ShaderVariants meshShaders;
+enum MeshFeature {
+    MeshAlphaTest = 1 << 0,
+    MeshEnvLighting = 1 << 1,
+    MeshInstanced = 1 << 2,
+    MeshMultiDraw = 1 << 3,
+};
+// the variant meshDraws are drawn with, MULTI_DRAW where the GL has it
+uint32_t meshBatchFeatures = MeshEnvLighting;
+// the material array of the meshes in meshDraws
+int meshBatchArray = -1;
 Shader skyboxShader;
 Shader nmShader;
+Shader vtFeedbackShader;
 
 // Textures
-Texture planetTexture;
-Texture planetNormal;
-Texture spacecraftTexture;
+VirtualTexture planetVT;
 Texture skyboxTexture;
-Texture ufoTexture;
-Texture rockTexture;
+EnvironmentLight environmentLight;
+
+// Materials, all non-planet meshes share one texture array
+MaterialPacker materials;
+Material* spacecraftMaterial;
+Material* ufoMaterial;
+Material* rockMaterial;
 
 // Normal Mapping
 std::vector<glm::vec3> tangents;
@@ -156,16 +213,147 @@ Model spacecraft;
 Model ufo;
 Model rock;
 
+// Per-frame constants shared by all programs
+FrameUniforms frameUniforms;
+
 // Lighting
 float envLightIntensity = 0.8f;
 glm::vec3 envLightPos = glm::vec3(0.0f, 10.0f, 10.0f);
 
+// Static meshes, all in one pool
+GeometryPool geometry;
+int planetMesh, spacecraftMesh, rockMesh, ufoMesh;
+// textured meshes drawn with the mesh shader, rebuilt every frame
+DrawBatch meshDraws;
+
 // VAO
-GLuint vao[4];
+GLuint vao_ring;
 GLuint vao_skybox;
 
-// Camera
+// Asteroid ring: every rock on a Keplerian orbit of its own about the
+// planet, in chunks generated around the camera. Each resident chunk is a
+// recording job of its own that evaluates its rocks into their bounds and
+// matrices and, when in view, culls them and writes the list it is drawn
+// through. The matrices go to a texture buffer, the top 3 rows of each as
+// RGBA32F texels.
+AsteroidBelt asteroidBelt;
+GLuint ringMatrixTexture;
+// where a texture buffer cannot take a range of the upload ring, the
+// matrices are written here and copied to a buffer of their own
+bool ringMatricesStreamed = false;
+GLuint ringMatrixBuffer = 0;
+std::vector<float> ringMatrixData;
+
+// Scene hierarchy over the objects, refit as they move. The rocks drift
+// apart too fast to keep a tree over them, queries test them all instead
+enum SceneObject { ScenePlanet, SceneSpacecraft, SceneUfo, SceneRing, SceneObjectCount };
+const char* sceneObjectNames[SceneObjectCount] = { "planet", "spacecraft", "ufo", "asteroid ring" };
+// bounding spheres as centre and radius, in model space and in the world
+glm::vec4 meshSpheres[SceneObjectCount];
+glm::vec4 sceneSpheres[SceneObjectCount];
+std::vector<Aabb> sceneBounds(SceneObjectCount);
+Bvh sceneBvh;
+
+// Levels of detail generated at load, one chain per object (the ring's is
+// the rock's), and each object's current level; the belt keeps its rocks'
+LodChain meshLods[SceneObjectCount];
+int objectLods[SceneObjectCount];
+LodSettings lodSettings;
+// this frame's rock data in one allocation of the upload ring, written by
+// the recording jobs: every resident rock's matrix, its sphere when the GPU
+// culls, and the instance lists, each chunk in view's visible rocks grouped
+// by level from an offset of its own
+UploadRing::Allocation ringUpload;
+size_t ringMatrixSpace = 0, ringListsOffset = 0;
+// what each chunk's job found, summed into the frame's stats
+struct RingChunkStats {
+    size_t Near, Tested, Hidden;
+    size_t Levels[LodMaxLevels];
+};
+std::vector<RingChunkStats> ringChunkStats;
+// with base instances (GL 4.3) the chunks' draws go in one multi-draw
+bool ringMultiDraw = false;
+// the rock mesh's radius about its origin, what its matrices scale
+float rockRadius = 0.0f;
+
+// Software occlusion: a low polygon sphere inside the planet, rasterized into
+// a small CPU depth buffer that the rocks and crafts are tested against
+OcclusionBuffer occlusion;
+std::vector<glm::vec3> planetOccluderVertices;
+std::vector<uint32_t> planetOccluderIndices;
+glm::vec3 planetOccluderCentre;
+bool occlusionCulling = true;
+
+// Or the ring culled on the GPU against last frame's depth, with the draw
+// built there too
+GpuCuller ringCuller;
+bool gpuCulling = false;
+
+// Render queue: the frame's draws recorded as commands on worker threads,
+// one list per thread, then merged and drawn in key order
+enum RenderPass { PassFeedback, PassOpaque, PassSky };
+// the texture sets and vertex inputs draws are keyed on, material array n
+// is the set TexturesMaterials + n
+enum TextureSet { TexturesNone, TexturesPlanet, TexturesSkybox, TexturesMaterials };
+enum VertexInput { VertexPool, VertexRing, VertexSkybox };
+enum DrawKind { DrawPlanetFeedback, DrawPlanet, DrawMesh, DrawRing, DrawRingChunk, DrawSkybox };
+// the data of every command, its uniforms included
+struct QueuedDraw {
+    DrawKind Kind;
+    int Mesh;
+    int MaterialArray;
+    // a ring chunk's visible rocks, level after level from First in the instance lists
+    uint32_t First;
+    uint32_t LevelCounts[LodMaxLevels];
+    DrawData Data;
+};
+RenderQueue renderQueue;
+CommandRecorder commandRecorder;
+// what the recording threads read of the frame, fixed before they start
+struct FrameRecording {
+    glm::mat4 Matrices[SceneObjectCount];
+    bool Visible[SceneObjectCount];
+    glm::vec3 Eye;
+    LodView Lod;
+    unsigned int MeshProgram, RingProgram;
+    // the ring's: when its rocks are and where their matrices, spheres and
+    // instance lists go (null when not wanted), each resident chunk's offset
+    // in the lists (NoList out of view), what rocks are culled against and
+    // the point they are counted near
+    float Time;
+    float* RockMatrices;
+    float* RockSpheres;
+    uint32_t* RockLists;
+    std::vector<size_t> ListOffsets;
+    Frustum RingFrustum;
+    glm::mat4 ViewMatrix;
+    bool Occluding;
+    glm::vec3 NearPoint;
+    float NearDistance;
+};
+// one job per scene object, then the skybox, then one per resident chunk of the ring
+const int SceneJobCount = SceneObjectCount + 1;
+const size_t NoList = SIZE_MAX;
+// the chunk draws gathered since the last state change, and their commands
+// in the layout fixed by glMultiDrawElementsIndirect
+std::vector<const QueuedDraw*> ringDraws;
+struct RingCommand {
+    unsigned int Count;
+    unsigned int InstanceCount;
+    unsigned int FirstIndex;
+    int BaseVertex;
+    unsigned int BaseInstance;
+};
+std::vector<RingCommand> ringCommands;
+
+// GPU buffers outside the pool, for residency accounting
+int ringResidency;
+int skyboxResidency;
+
+// Camera, moved by input on the simulation thread, and the one frames are
+// drawn from, between its last two steps
 Camera camera;
+Camera viewCamera;
 
 // Skybox Coords
 GLfloat skyboxVertices[] =
@@ -224,13 +412,43 @@ int E_skybox = 36;
 
 // Rock Variables
 int rockCount = 400;
-std::vector<glm::mat4> modelMatrices;
+// the ring's mean radius, where a rock goes round at the planet's rotation speed
+const float ringRadius = 6.0f;
+// how near the camera the ring's chunks are generated, and how many rocks
+// of them a frame may generate as it moves
+float ringStreamDistance = 100.0f;
+const size_t ringStreamBudget = 65536;
 
 // Other Variables
 float planetRotationSpeed = 0.2f;
 float currentTime;
 glm::vec3 spacecraftScale = glm::vec3(0.0008f);
 
+// Simulation: input, the camera and the clock the planet and ring turn by
+// advance at a fixed rate on their own thread. Input gets there through a
+// lock-free queue and the state comes back through a lock-free triple
+// buffer as the last two steps, for frames to interpolate between.
+const double SimulationStep = 1.0 / 60.0;
+struct SimState {
+    float CameraR, CameraTheta, CameraPhi;
+    double Time;
+};
+struct SimSnapshot {
+    SimState Previous, Current;
+    double CurrentAt;   // FixedStepThread::now() when Current was stepped
+};
+struct InputEvent {
+    enum Type { KeyDown, KeyUp, Drag } Kind;
+    int Key;
+    float X, Y;
+};
+SpscQueue<InputEvent, 1024> inputEvents;
+TripleBuffer<SimSnapshot> simSnapshots;
+FixedStepThread simulation;
+// owned by the simulation thread once it runs
+SimState simState;
+double simStartTime;
+
 
 
 void GetTangentsAndBitangents_Planet() {
@@ -279,34 +497,6 @@ void GetTangentsAndBitangents_Planet() {
     }
 }
 
-void CreateRand_ModelMatrices() {
-    GLfloat radius = 6.0f;
-    GLfloat offset = 0.5f;
-    GLfloat displacement;
-    
-    for (int i = 0; i < rockCount; i++) {
-        glm::mat4 model = glm::mat4(1.0f);
-        
-        GLfloat angle = (GLfloat)i / (GLfloat)rockCount * 360.0f;
-        displacement = (rand() % (GLint)(2 * offset * 200)) / 100.0f - offset;
-        GLfloat x = sin(angle) * radius + displacement;
-        displacement = (rand() % (GLint)(2 * offset * 200)) / 100.0f - offset;
-        GLfloat y = displacement * 0.4f + 1;
-        displacement = (rand() % (GLint)(2 * offset * 200)) / 100.0f - offset;
-        GLfloat z = cos(angle) * radius + displacement;
-        
-        model = glm::translate(model, glm::vec3(x, y, z));
-        
-        GLfloat scale = (rand() % 10) / 100.0f + 0.05;
-        model = glm::scale(model, glm::vec3(scale));
-        
-        GLfloat rotateAngle = (rand() % 360);
-        model = glm::rotate(model, rotateAngle, glm::vec3(0.4f, 0.5f, 0.8f));
-        
-        modelMatrices.push_back(model);
-    }
-}
-
 void get_OpenGL_info()
 {
 	// OpenGL information
@@ -320,6 +510,208 @@ void get_OpenGL_info()
 
 
 
+// centre of the bounding box and the farthest vertex from it
+glm::vec4 boundingSphere(const Model& model)
+{
+    Aabb box;
+    for (const Vertex& vertex : model.vertices)
+        box.grow(vertex.position);
+    glm::vec3 centre = box.centre();
+    float radius = 0.0f;
+    for (const Vertex& vertex : model.vertices)
+        radius = std::max(radius, glm::length(vertex.position - centre));
+    return glm::vec4(centre, radius);
+}
+
+// the largest factor a matrix scales lengths by
+float matrixScale(const glm::mat4& matrix)
+{
+    return std::max(glm::length(glm::vec3(matrix[0])),
+                    std::max(glm::length(glm::vec3(matrix[1])), glm::length(glm::vec3(matrix[2]))));
+}
+
+// moves the top level of the scene hierarchy to this frame's matrices
+void updateScene(const glm::mat4* matrices)
+{
+    for (int i = 0; i < SceneObjectCount; i++) {
+        const glm::mat4& matrix = matrices[i];
+        float scale = matrixScale(matrix);
+        glm::vec3 centre = glm::vec3(matrix * glm::vec4(glm::vec3(meshSpheres[i]), 1.0f));
+        sceneSpheres[i] = glm::vec4(centre, meshSpheres[i].w * scale);
+        sceneBounds[i] = Aabb::fromSphere(centre, sceneSpheres[i].w);
+    }
+    if (sceneBvh.empty() || sceneBvh.refit(sceneBounds) > 2.0f)
+        sceneBvh.build(sceneBounds);
+}
+
+// the ring's chunks around the camera, and one allocation of the upload
+// ring for all the recording jobs write of its rocks: every resident rock's
+// matrix, its sphere when the GPU culls, and room in the instance lists for
+// all the rocks of each chunk in view
+void prepareRocks(FrameRecording& frame, bool inView)
+{
+    // with nothing resident, on the first frame or with the camera back
+    // from far out, everything in reach comes at once
+    asteroidBelt.stream(viewCamera.Position, currentTime, asteroidBelt.residentRocks() == 0 ? SIZE_MAX : ringStreamBudget);
+    size_t count = asteroidBelt.slots();
+    size_t chunks = asteroidBelt.residentChunks();
+    frame.Time = currentTime;
+    frame.RockMatrices = frame.RockSpheres = nullptr;
+    frame.RockLists = nullptr;
+    frame.ListOffsets.assign(chunks, NoList);
+    ringChunkStats.assign(chunks, RingChunkStats());
+    ringUpload = UploadRing::Allocation();
+    if (count == 0)
+        return;
+    
+    size_t listCount = 0;
+    if (!gpuCulling && inView)
+        for (size_t chunk = 0; chunk < chunks; chunk++)
+            if (asteroidBelt.residentVisible(chunk, frame.RingFrustum)) {
+                SphereRange slots = asteroidBelt.residentSlots(chunk);
+                frame.ListOffsets[chunk] = listCount;
+                listCount += slots.End - slots.Begin;
+            }
+    
+    // one allocation for all of it, its data only holds until the next
+    size_t matrixBytes = count * 12 * sizeof(float);
+    size_t alignment = std::max(uploadRing.textureAlignment(), uploadRing.storageAlignment());
+    ringMatrixSpace = ringMatricesStreamed ? (matrixBytes + alignment - 1) / alignment * alignment : 0;
+    ringListsOffset = ringMatrixSpace + (gpuCulling ? count * sizeof(glm::vec4) : 0);
+    size_t uploadBytes = ringListsOffset + listCount * sizeof(uint32_t);
+    if (uploadBytes > 0)
+        ringUpload = uploadRing.allocate(uploadBytes, alignment);
+    unsigned char* uploadData = static_cast<unsigned char*>(ringUpload.Data);
+    if (!ringMatricesStreamed && ringMatrixData.size() != count * 12) {
+        ringMatrixData.resize(count * 12);
+        residency.resize(ringResidency, matrixBytes);
+    }
+    frame.RockMatrices = ringMatricesStreamed ? reinterpret_cast<float*>(uploadData) : ringMatrixData.data();
+    frame.RockSpheres = gpuCulling ? reinterpret_cast<float*>(uploadData + ringMatrixSpace) : nullptr;
+    if (listCount > 0)
+        frame.RockLists = reinterpret_cast<uint32_t*>(uploadData + ringListsOffset);
+}
+
+// the rocks' data to where the GPU reads it, once the jobs have written it
+void finishRocks()
+{
+    size_t count = asteroidBelt.slots();
+    if (count == 0) {
+        // nothing for the GPU to cull either
+        if (gpuCulling)
+            ringCuller.moveSpheres(0, 0, 0);
+        return;
+    }
+    uploadRing.flush();
+    
+    size_t matrixBytes = count * 12 * sizeof(float);
+    if (ringMatricesStreamed) {
+        glState.bindTexture(GL_TEXTURE_BUFFER, ringMatrixTexture);
+        glTexBufferRange(GL_TEXTURE_BUFFER, GL_RGBA32F, ringUpload.Buffer, ringUpload.Offset, matrixBytes);
+    }
+    else {
+        // orphaned first, the GPU may still be drawing last frame's
+        residency.touch(ringResidency);
+        glState.bindBuffer(GL_TEXTURE_BUFFER, ringMatrixBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, matrixBytes, NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, matrixBytes, ringMatrixData.data());
+    }
+    if (gpuCulling)
+        ringCuller.moveSpheres(ringUpload.Buffer, ringUpload.Offset + ringMatrixSpace, count);
+}
+
+// one step of the simulation thread: the input since the last, then the
+// camera, then a snapshot for the renderer
+void simulationStep(long tick)
+{
+    InputEvent event;
+    while (inputEvents.pop(event)) {
+        bool down = event.Kind == InputEvent::KeyDown;
+        switch (event.Kind) {
+        case InputEvent::KeyDown:
+        case InputEvent::KeyUp:
+            if (event.Key == GLFW_KEY_W)
+                keyCtrl.W_KEY = down;
+            if (event.Key == GLFW_KEY_S)
+                keyCtrl.S_KEY = down;
+            if (event.Key == GLFW_KEY_A)
+                keyCtrl.A_KEY = down;
+            if (event.Key == GLFW_KEY_D)
+                keyCtrl.D_KEY = down;
+            break;
+        case InputEvent::Drag:
+            camera.ProcessMouseMovement_Left(event.X, event.Y);
+            break;
+        }
+    }
+    camera.ProcessKeyPress();
+    
+    SimState state = { camera.R, camera.Theta, camera.Phi, simStartTime + (tick + 1) * SimulationStep };
+    SimSnapshot& snapshot = simSnapshots.back();
+    snapshot.Previous = simState;
+    snapshot.Current = state;
+    snapshot.CurrentAt = FixedStepThread::now();
+    simSnapshots.publish();
+    simState = state;
+}
+
+// the frame's camera and clock, a step behind the simulation so there is
+// always a newer state to move towards
+void interpolateSimulation()
+{
+    simSnapshots.update();
+    const SimSnapshot& snapshot = simSnapshots.front();
+    const SimState& from = snapshot.Previous;
+    const SimState& to = snapshot.Current;
+    float t = (float)glm::clamp((FixedStepThread::now() - snapshot.CurrentAt) / SimulationStep, 0.0, 1.0);
+    
+    // Phi jumps by a whole turn as the camera wraps it, the short way round is meant
+    float phiDelta = std::remainder(to.CameraPhi - from.CameraPhi, 2.0f * (float)M_PI);
+    viewCamera.SetSpherical(glm::mix(from.CameraR, to.CameraR, t), glm::mix(from.CameraTheta, to.CameraTheta, t),
+                            from.CameraPhi + phiDelta * t);
+    currentTime = (float)(from.Time + (to.Time - from.Time) * t);
+    frameStats.set("sim.skipped_steps", (double)simulation.skipped());
+}
+
+// what is under the cursor, by bounding sphere
+void pickObject(double x, double y)
+{
+    glm::mat4 viewMatrix = viewCamera.GetViewMatrix();
+    glm::mat4 projectionMatrix = glm::perspective(glm::radians(45.0f), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.5f, 100.0f);
+    glm::vec4 viewport(0.0f, 0.0f, (float)SCR_WIDTH, (float)SCR_HEIGHT);
+    glm::vec3 nearPoint = glm::unProject(glm::vec3((float)x, SCR_HEIGHT - (float)y, 0.0f), viewMatrix, projectionMatrix, viewport);
+    glm::vec3 farPoint = glm::unProject(glm::vec3((float)x, SCR_HEIGHT - (float)y, 1.0f), viewMatrix, projectionMatrix, viewport);
+    glm::vec3 direction = glm::normalize(farPoint - nearPoint);
+    
+    int rock = -1;
+    float hitT;
+    int object = sceneBvh.raycast(nearPoint, direction, 1e30f, [&](uint32_t item, float maxT, float& t) {
+        if (item != SceneRing)
+            return intersectRaySphere(nearPoint, direction, glm::vec3(sceneSpheres[item]), sceneSpheres[item].w, maxT, t);
+        // a click is rare enough to test every resident rock; the padding
+        // between chunks has no radius to hit
+        const SphereSet& rocks = asteroidBelt.spheres();
+        bool hit = false;
+        for (size_t i = 0; i < rocks.X.size(); i++) {
+            glm::vec3 centre(rocks.X[i], rocks.Y[i], rocks.Z[i]);
+            float rockT;
+            if (rocks.Radius[i] > 0.0f && intersectRaySphere(nearPoint, direction, centre, rocks.Radius[i], maxT, rockT)) {
+                rock = (int)i;
+                t = maxT = rockT;
+                hit = true;
+            }
+        }
+        return hit;
+    }, hitT);
+    
+    if (object < 0)
+        std::cout << "Picked nothing" << std::endl;
+    else if (object == SceneRing)
+        std::cout << "Picked rock " << asteroidBelt.rockIndex(rock) << " at distance " << hitT << std::endl;
+    else
+        std::cout << "Picked " << sceneObjectNames[object] << " at distance " << hitT << std::endl;
+}
+
 void loadMeshes()
 {
     // TODO: load objects and norm vertices to unit bbox
@@ -330,105 +722,131 @@ void loadMeshes()
     // TODO: initialize craft motion
 
 
-    GLuint vbo[6];
-    GLuint ebo[4];
-    glGenBuffers(6, vbo);
-    glGenBuffers(4, ebo);
-        
-    // Planet
+    // every static mesh goes into one pool with its levels of detail, sized to fit them all
     planet = loadOBJ("resources/object/planet.obj");
     GetTangentsAndBitangents_Planet();
-    glGenVertexArrays(1, &vao[0]);
-    glBindVertexArray(vao[0]);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
-    glBufferData(GL_ARRAY_BUFFER, planet.vertices.size() * sizeof(Vertex), &planet.vertices[0], GL_STATIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo[0]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, planet.indices.size() * sizeof(unsigned int), &planet.indices[0], GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[4]);
-    glBufferData(GL_ARRAY_BUFFER, tangents.size() * sizeof(glm::vec3), &tangents[0], GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[5]);
-    glBufferData(GL_ARRAY_BUFFER, biTangents.size() * sizeof(glm::vec3), &biTangents[0], GL_STATIC_DRAW);
-
-    // Position, UV Coords, Vertex Normals, Tangents, BiTangents
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, position));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, uv));
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[4]);
-    glEnableVertexAttribArray(3);
-    glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[5]);
-    glEnableVertexAttribArray(4);
-    glVertexAttribPointer(4, 1, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
-    
-    
-    // Spacecraft
     spacecraft = loadOBJ("resources/object/spacecraft.obj");
-    glGenVertexArrays(1, &vao[1]);
-    glBindVertexArray(vao[1]);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
-    glBufferData(GL_ARRAY_BUFFER, spacecraft.vertices.size() * sizeof(Vertex), &spacecraft.vertices[0], GL_STATIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, spacecraft.indices.size() * sizeof(unsigned int), &spacecraft.indices[0], GL_STATIC_DRAW);
-    
-    // Position, UV Coords, Vertex Normals
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, position));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, uv));
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
-    
-    // Rock
     rock = loadOBJ("resources/object/rock.obj");
-    glGenVertexArrays(1, &vao[2]);
-    glBindVertexArray(vao[2]);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[2]);
-    glBufferData(GL_ARRAY_BUFFER, rock.vertices.size() * sizeof(Vertex), &rock.vertices[0], GL_STATIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo[2]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, rock.indices.size() * sizeof(unsigned int), &rock.indices[0], GL_STATIC_DRAW);
-    
-    // Position, UV Coords, Vertex Normals
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[2]);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, position));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, uv));
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+    ufo = loadOBJ("resources/object/craft.obj");
+    double lodStart = glfwGetTime();
+    std::vector<LodLevel> lodLevels[SceneObjectCount];
+    lodLevels[ScenePlanet] = buildLodLevels(planet, tangents);
+    lodLevels[SceneSpacecraft] = buildLodLevels(spacecraft);
+    lodLevels[SceneUfo] = buildLodLevels(ufo);
+    lodLevels[SceneRing] = buildLodLevels(rock);
+    std::cout << "Levels of detail built in " << (glfwGetTime() - lodStart) * 1000.0 << " ms" << std::endl;
+    size_t vertexCount = 0, indexCount = 0;
+    for (const std::vector<LodLevel>& levels : lodLevels) {
+        for (const LodLevel& level : levels) {
+            vertexCount += level.Mesh.vertices.size();
+            indexCount += level.Mesh.indices.size();
+        }
+    }
+    geometry.setup(vertexCount, indexCount);
+    for (int object = 0; object < SceneObjectCount; object++) {
+        meshLods[object].add(geometry, lodLevels[object]);
+        objectLods[object] = 0;
+        std::cout << "  " << sceneObjectNames[object] << ":";
+        for (int level = 0; level < meshLods[object].levels(); level++)
+            std::cout << " " << meshLods[object].Triangles[level] << " triangles (error " << meshLods[object].Error[level] << ")";
+        std::cout << std::endl;
+    }
+    planetMesh = meshLods[ScenePlanet].Meshes[0];
+    spacecraftMesh = meshLods[SceneSpacecraft].Meshes[0];
+    ufoMesh = meshLods[SceneUfo].Meshes[0];
+    rockMesh = meshLods[SceneRing].Meshes[0];
+    
+    // the ring as before, its chunks generated once the camera is near;
+    // the matrices scale uniformly, so a rock's bounds are the mesh's scaled
+    rockRadius = 0.0f;
+    for (const Vertex& vertex : rock.vertices)
+        rockRadius = std::max(rockRadius, glm::length(vertex.position));
+    BeltSettings ring;
+    ring.Rocks = rockCount;
+    ring.Radius = ringRadius;
+    ring.HalfWidth = 0.5f;
+    // the gravity that makes a rock at ringRadius go round at the planet's speed
+    ring.GM = planetRotationSpeed * planetRotationSpeed * ringRadius * ringRadius * ringRadius;
+    ring.RockRadius = rockRadius;
+    ring.StreamDistance = ringStreamDistance;
+    asteroidBelt.setup(ring);
+    
+    meshSpheres[ScenePlanet] = boundingSphere(planet);
+    meshSpheres[SceneSpacecraft] = boundingSphere(spacecraft);
+    meshSpheres[SceneUfo] = boundingSphere(ufo);
+    meshSpheres[SceneRing] = glm::vec4(0.0f, 0.0f, 0.0f, asteroidBelt.reach());
+    
+    // the occluder has to stay inside the planet, so no larger than the
+    // nearest of its face planes
+    planetOccluderCentre = glm::vec3(meshSpheres[ScenePlanet]);
+    float planetInradius = meshSpheres[ScenePlanet].w;
+    for (size_t i = 0; i + 2 < planet.indices.size(); i += 3) {
+        glm::vec3 a = planet.vertices[planet.indices[i]].position;
+        glm::vec3 b = planet.vertices[planet.indices[i + 1]].position;
+        glm::vec3 c = planet.vertices[planet.indices[i + 2]].position;
+        glm::vec3 normal = glm::cross(b - a, c - a);
+        float length = glm::length(normal);
+        if (length > 1e-12f)
+            planetInradius = std::min(planetInradius, std::abs(glm::dot(normal, a - planetOccluderCentre)) / length);
+    }
+    buildSphereOccluder(planetInradius, 12, 24, planetOccluderVertices, planetOccluderIndices);
+    occlusion.setup(256, 192);
+    
+    if (gpuCulling && !GpuCuller::supported()) {
+        std::cout << "GPU culling needs OpenGL 4.3, culling the ring on the CPU" << std::endl;
+        gpuCulling = false;
+    }
+    std::vector<float> rockRadiusError;
+    for (float error : meshLods[SceneRing].Error)
+        rockRadiusError.push_back(error / rockRadius);
+    if (gpuCulling && !ringCuller.setup(geometry, meshLods[SceneRing].Meshes, rockRadiusError, asteroidBelt.spheres()))
+        gpuCulling = false;
+    
+    // the matrices are rewritten every frame, 3 RGBA32F texels each; with
+    // texture buffer ranges (GL 4.3) the texture is pointed at them in the
+    // upload ring, otherwise they are copied to a buffer of their own, sized
+    // as the resident rocks come and go
+    glGenTextures(1, &ringMatrixTexture);
+    ringMatricesStreamed = GLEW_VERSION_4_3 || GLEW_ARB_texture_buffer_range;
+    if (!ringMatricesStreamed) {
+        glGenBuffers(1, &ringMatrixBuffer);
+        glState.bindBuffer(GL_TEXTURE_BUFFER, ringMatrixBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, 12 * sizeof(float), NULL, GL_STREAM_DRAW);
+        ringResidency = residency.trackBuffer("rock matrices", 12 * sizeof(float));
+        glState.bindTexture(GL_TEXTURE_BUFFER, ringMatrixTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, ringMatrixBuffer);
+    }
     
-    // Set random model matrices for rocks
-    CreateRand_ModelMatrices();
+    // the ring reads the pool plus the index of one visible rock per
+    // instance, from wherever in the upload ring this frame's lists went;
+    // with base instances every chunk's runs of them go in one multi-draw
+    ringMultiDraw = GLEW_VERSION_4_3 || (GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance);
+    glGenVertexArrays(1, &vao_ring);
+    glState.bindVertexArray(vao_ring);
+    geometry.setVertexFormat();
+    glEnableVertexAttribArray(4);
+    glVertexAttribDivisor(4, 1);
     
-    // Ufos
-    ufo = loadOBJ("resources/object/craft.obj");
-    glGenVertexArrays(1, &vao[3]);
-    glBindVertexArray(vao[3]);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[3]);
-    glBufferData(GL_ARRAY_BUFFER, ufo.vertices.size() * sizeof(Vertex), &ufo.vertices[0], GL_STATIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo[3]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, ufo.indices.size() * sizeof(unsigned int), &ufo.indices[0], GL_STATIC_DRAW);
-    
-    // Position, UV Coords, Vertex Normals
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[3]);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, position));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, uv));
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+    // room for every rock's matrix, sphere and visible index besides the
+    // uniforms and batches, up to a million rocks; past that the ring grows
+    // to what is resident
+    size_t ringRocks = std::min<size_t>(rockCount, 1 << 20);
+    uploadRing.setup(ringRocks * (12 * sizeof(float) + sizeof(glm::vec4) + sizeof(uint32_t)) + 64 * 1024);
     
 
     //Load textures
-    planetTexture.setupTexture("resources/texture/earthTexture.bmp");
-    planetNormal.setupTexture("resources/texture/earthNormal.bmp");
-    spacecraftTexture.setupTexture("resources/texture/spacecraftTexture.bmp");
-    rockTexture.setupTexture("resources/texture/rockTexture.bmp");
-    ufoTexture.setupTexture("resources/texture/craftTexture.bmp");
+    // the planet maps are too big to be resident, they are tiled once into page files and streamed
+    VirtualTexture::updatePageFile("resources/texture/earthTexture.bmp", "resources/texture/earthTexture.vtp");
+    // a normal map baked with --bake-normal takes precedence over the authored one
+    struct stat baked;
+    const char* planetNormal = stat("resources/texture/earthNormal.dds", &baked) == 0 ?
+        "resources/texture/earthNormal.dds" : "resources/texture/earthNormal.bmp";
+    VirtualTexture::updatePageFile(planetNormal, "resources/texture/earthNormal.vtp");
+    planetVT.setup({ "resources/texture/earthTexture.vtp", "resources/texture/earthNormal.vtp" });
+    spacecraftMaterial = materials.add("resources/texture/spacecraftTexture.bmp");
+    rockMaterial = materials.add("resources/texture/rockTexture.bmp");
+    ufoMaterial = materials.add("resources/texture/craftTexture.bmp");
+    materials.build();
  }
 
 void createSkybox()
@@ -440,9 +858,10 @@ void createSkybox()
     unsigned int VBO;
     glGenVertexArrays(1, &vao_skybox);
     glGenBuffers(1, &VBO);
-    glBindVertexArray(vao_skybox);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glState.bindVertexArray(vao_skybox);
+    glState.bindBuffer(GL_ARRAY_BUFFER, VBO);
     glBufferData(GL_ARRAY_BUFFER, sizeof(skyboxVertices), &skyboxVertices, GL_STATIC_DRAW);
+    skyboxResidency = residency.trackBuffer("skybox vertices", sizeof(skyboxVertices));
     glEnableVertexAttribArray(0);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
     
@@ -454,8 +873,7 @@ void createSkybox()
     texPaths.push_back(std::string("resources/skybox/front.bmp"));
     texPaths.push_back(std::string("resources/skybox/back.bmp"));
     skyboxTexture.setupTextureCubemap(texPaths);
-    
-    skyboxShader.setupShader("skybox.vs", "skybox.fs");
+    environmentLight.setup(texPaths, "resources/skybox/environment.cache");
 }
 
 void sendDataToOpenGL()
@@ -478,21 +896,343 @@ void initializedGL(void) //run only once
     get_OpenGL_info();
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
+	glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
+    // submit every program first, the driver compiles them while the assets load
+    ShaderPipeline shaders;
+    
+    // set up vetex shader and fragment shader
+    meshShaders.setup("vert.glsl", "frag.glsl", { "ALPHA_TEST", "ENV_LIGHTING", "INSTANCED", "MULTI_DRAW" });
+    if (DrawBatch::multiDrawSupported())
+        meshBatchFeatures |= MeshMultiDraw;
+    meshShaders.prewarm(shaders, meshBatchFeatures);
+    meshShaders.prewarm(shaders, MeshEnvLighting | MeshInstanced);
+    
+    // set up normal shaders, their texture units never change
+    shaders.add(nmShader, "nm.vs", "nm.fs", "", [](Shader& program, bool linked) {
+        if (!linked)
+            return;
+        program.use();
+        program.setInt("vtIndirection", 0);
+        program.setInt("texColour", 1);
+        program.setInt("texNorm", 2);
+        glState.useProgram(0);
+    });
+    shaders.add(vtFeedbackShader, "nm.vs", "vt_feedback.fs");
+    shaders.add(skyboxShader, "skybox.vs", "skybox.fs");
 
 	sendDataToOpenGL();
+    shaders.finish();
     
     // set up the camera parameters
     camera = Camera(glm::vec3(18.0f, 15.0f, 90.0f), 0.2f, 0.01f);
+    viewCamera = camera;
+}
 
-    // set up vetex shader and fragment shader
-    shader.setupShader("vert.glsl", "frag.glsl");
+
+
+void setVirtualTextureUniforms(const Shader& shader, const VirtualTexture& vt)
+{
+    shader.setVec2("vtPages", vt.virtualPages());
+    shader.setVec2("vtUVScale", vt.uvScale());
+    shader.setFloat("vtMaxLevel", vt.maxLevel());
+    shader.setFloat("vtPageSize", vt.pageSize());
+    shader.setFloat("vtBorder", vt.border());
+    shader.setFloat("vtCacheSlots", vt.cacheSlots());
+}
+
+// distance from the eye to the nearest point of an object's bounds, what
+// opaque draws go front to back by
+float sceneDepth(int object, const glm::vec3& eye)
+{
+    return glm::length(glm::vec3(sceneSpheres[object]) - eye) - sceneSpheres[object].w;
+}
+
+void recordDraw(CommandList& commands, RenderPass pass, unsigned int program, unsigned textures, VertexInput vertexInput,
+                float depth, const QueuedDraw& draw)
+{
+    commands.record(RenderQueue::makeKey(pass, program, textures, vertexInput, depth), draw.Kind, draw);
+}
+
+// one recording job: an object's level of detail and draws, or the skybox.
+// The ring is here only when the GPU culls it, its chunks record their own
+// draws otherwise. Runs on any thread, so nothing here may touch GL
+void recordObject(int job, const FrameRecording& frame, CommandList& commands)
+{
+    QueuedDraw queued = {};
+    if (job == SceneObjectCount) {
+        // Skybox, after everything it could be hidden behind
+        queued.Kind = DrawSkybox;
+        recordDraw(commands, PassSky, skyboxShader.program(), TexturesSkybox, VertexSkybox, 0.0f, queued);
+        return;
+    }
+    int object = job;
+    if (!frame.Visible[object])
+        return;
+    float depth = sceneDepth(object, frame.Eye);
+    if (object != SceneRing) {
+        float pixelsPerUnit = frame.Lod.pixelsPerUnit(matrixScale(frame.Matrices[object]), depth + sceneSpheres[object].w,
+                                                      sceneSpheres[object].w);
+        objectLods[object] = selectLod(meshLods[object], pixelsPerUnit, objectLods[object], lodSettings);
+        queued.Mesh = meshLods[object].Meshes[objectLods[object]];
+        queued.Data.ModelMatrix = frame.Matrices[object];
+    }
     
-    // set up normal shaders
-    nmShader.setupShader("nm.vs", "nm.fs");
+    switch (object) {
+    case ScenePlanet:
+        // its virtual texture feedback first, so the pages it asks for are in before it is drawn
+        queued.Kind = DrawPlanetFeedback;
+        recordDraw(commands, PassFeedback, vtFeedbackShader.program(), TexturesNone, VertexPool, 0.0f, queued);
+        queued.Kind = DrawPlanet;
+        recordDraw(commands, PassOpaque, nmShader.program(), TexturesPlanet, VertexPool, depth, queued);
+        break;
+    case SceneSpacecraft:
+    case SceneUfo:
+    {
+        const Material& material = object == SceneSpacecraft ? *spacecraftMaterial : *ufoMaterial;
+        queued.Kind = DrawMesh;
+        queued.MaterialArray = material.Array;
+        queued.Data.Layer = material.Layer;
+        recordDraw(commands, PassOpaque, frame.MeshProgram, TexturesMaterials + material.Array, VertexPool, depth, queued);
+        break;
+    }
+    case SceneRing:
+        // culled on the GPU, which built the draw too
+        queued.Kind = DrawRing;
+        recordDraw(commands, PassOpaque, frame.RingProgram, TexturesMaterials + rockMaterial->Array, VertexRing, depth, queued);
+        break;
+    }
+}
+
+// one recording job per resident chunk: its rocks to where their orbits
+// have them now and, when in view, those the frustum and the planet leave
+// visible, each at its level, grouped by level into the chunk's own part of
+// the instance lists and drawn from there. Runs on any thread, so nothing
+// here may touch GL
+void recordRingChunk(size_t chunk, const FrameRecording& frame, CommandList& commands)
+{
+    SphereRange slots = asteroidBelt.residentSlots(chunk);
+    asteroidBelt.evaluateResident(chunk, frame.Time, frame.RockMatrices, frame.RockSpheres);
+    const SphereSet& rocks = asteroidBelt.spheres();
+    RingChunkStats& stats = ringChunkStats[chunk];
+    stats.Near = countSpheresNear(rocks, slots, frame.NearPoint, frame.NearDistance);
+    if (frame.ListOffsets[chunk] == NoList)
+        return;
+    
+    static thread_local std::vector<uint32_t> visible;
+    visible.resize(slots.End - slots.Begin);
+    size_t count = cullRange(frame.RingFrustum, rocks, slots, visible.data());
+    if (frame.Occluding) {
+        size_t kept = 0;
+        for (size_t i = 0; i < count; i++) {
+            uint32_t rock = visible[i];
+            glm::vec3 centre = glm::vec3(frame.ViewMatrix * glm::vec4(rocks.X[rock], rocks.Y[rock], rocks.Z[rock], 1.0f));
+            if (occlusion.sphereVisible(centre, rocks.Radius[rock]))
+                visible[kept++] = rock;
+        }
+        stats.Tested = count;
+        stats.Hidden = count - kept;
+        count = kept;
+    }
+    if (count == 0)
+        return;
+    
+    // levels of detail go by the pixels each level's error would cover
+    const LodChain& chain = meshLods[SceneRing];
+    std::vector<uint8_t>& rockLods = asteroidBelt.lods();
+    float nearest = FLT_MAX;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t rock = visible[i];
+        glm::vec3 centre(rocks.X[rock], rocks.Y[rock], rocks.Z[rock]);
+        float radius = rocks.Radius[rock];
+        float distance = glm::length(centre - frame.Eye);
+        nearest = std::min(nearest, distance - radius);
+        float pixelsPerUnit = frame.Lod.pixelsPerUnit(radius / rockRadius, distance, radius);
+        rockLods[rock] = (uint8_t)selectLod(chain, pixelsPerUnit, rockLods[rock], lodSettings);
+        stats.Levels[rockLods[rock]]++;
+    }
     
+    QueuedDraw queued = {};
+    queued.Kind = DrawRingChunk;
+    queued.First = (uint32_t)frame.ListOffsets[chunk];
+    size_t next[LodMaxLevels];
+    size_t start = 0;
+    for (int level = 0; level < LodMaxLevels; level++) {
+        queued.LevelCounts[level] = (uint32_t)stats.Levels[level];
+        next[level] = start;
+        start += stats.Levels[level];
+    }
+    uint32_t* list = frame.RockLists + queued.First;
+    for (size_t i = 0; i < count; i++)
+        list[next[rockLods[visible[i]]]++] = visible[i];
+    recordDraw(commands, PassOpaque, frame.RingProgram, TexturesMaterials + rockMaterial->Array, VertexRing,
+               std::max(nearest, 0.0f), queued);
+}
+
+// the meshes gathered since the last state change, as one batch
+void flushMeshDraws()
+{
+    if (meshDraws.size() == 0)
+        return;
+    Shader& shader = meshShaders.get(meshBatchFeatures);
+    shader.use();
+    shader.setVec3Array("envSH", environmentLight.irradianceSH(), 9);
+    // the batch breaks where the array does, they are in the key
+    Material batch;
+    batch.Array = meshBatchArray;
+    materials.bind(batch, 0);
+    shader.setInt("tex1", 0);
+    geometry.bind();
+    meshDraws.draw(shader);
+    meshDraws.clear();
+}
+
+// what every ring draw reads, the rocks' matrices written by the chunks' jobs
+void bindRingState()
+{
+    geometry.touch();
+    if (!ringMatricesStreamed)
+        residency.touch(ringResidency);
+    Shader& ringShader = meshShaders.get(MeshEnvLighting | MeshInstanced);
+    ringShader.use();
+    ringShader.setVec3Array("envSH", environmentLight.irradianceSH(), 9);
+    materials.bind(*rockMaterial, 0);
+    ringShader.setInt("tex1", 0);
+    ringShader.setInt("layer", rockMaterial->Layer);
+    glState.bindTextureUnit(1, GL_TEXTURE_BUFFER, ringMatrixTexture);
+    ringShader.setInt("instanceMatrices", 1);
+}
+
+// the ring chunks gathered since the last state change, a run of the
+// instance lists per chunk and level: all in one multi-draw whose base
+// instances pick the runs, or one instanced draw per run
+void flushRingDraws()
+{
+    if (ringDraws.empty())
+        return;
+    bindRingState();
+    const LodChain& rockChain = meshLods[SceneRing];
+    size_t lists = ringUpload.Offset + ringListsOffset;
+    glState.bindVertexArray(vao_ring);
+    glState.bindBuffer(GL_ARRAY_BUFFER, ringUpload.Buffer);
+    if (ringMultiDraw) {
+        ringCommands.clear();
+        for (const QueuedDraw* queued : ringDraws) {
+            uint32_t first = queued->First;
+            for (int level = 0; level < rockChain.levels(); level++) {
+                uint32_t count = queued->LevelCounts[level];
+                if (count > 0) {
+                    const PoolMesh& mesh = geometry.mesh(rockChain.Meshes[level]);
+                    ringCommands.push_back({ mesh.IndexCount, count, mesh.FirstIndex, mesh.BaseVertex, first });
+                }
+                first += count;
+            }
+        }
+        // the list's buffer is taken into the VAO before the upload, which may move the ring on
+        glVertexAttribIPointer(4, 1, GL_UNSIGNED_INT, sizeof(uint32_t), (void*)lists);
+        UploadRing::Allocation indirect = uploadRing.upload(ringCommands.data(), ringCommands.size() * sizeof(RingCommand));
+        glState.bindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect.Buffer);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)indirect.Offset, (GLsizei)ringCommands.size(), 0);
+        frameStats.add("geometry.draw_calls", 1.0);
+    }
+    else {
+        size_t draws = 0;
+        for (const QueuedDraw* queued : ringDraws) {
+            size_t first = queued->First;
+            for (int level = 0; level < rockChain.levels(); level++) {
+                uint32_t count = queued->LevelCounts[level];
+                if (count > 0) {
+                    glVertexAttribIPointer(4, 1, GL_UNSIGNED_INT, sizeof(uint32_t), (void*)(lists + first * sizeof(uint32_t)));
+                    geometry.draw(rockChain.Meshes[level], (int)count);
+                    draws++;
+                }
+                first += count;
+            }
+        }
+        frameStats.add("geometry.draw_calls", (double)draws);
+    }
+    ringDraws.clear();
 }
 
+void drawQueued(const QueuedDraw& queued)
+{
+    switch (queued.Kind) {
+    case DrawPlanetFeedback:
+        // Planet virtual texture feedback, then stream in what it asked for
+        geometry.bind();
+        planetVT.beginFeedback();
+        vtFeedbackShader.use();
+        vtFeedbackShader.setMat4("modelMatrix", queued.Data.ModelMatrix);
+        setVirtualTextureUniforms(vtFeedbackShader, planetVT);
+        vtFeedbackShader.setFloat("vtLodBias", planetVT.feedbackLodBias());
+        geometry.draw(queued.Mesh);
+        planetVT.endFeedback();
+        planetVT.update();
+        break;
+        
+    case DrawPlanet:
+        geometry.bind();
+        nmShader.use();
+        nmShader.setMat4("modelMatrix", queued.Data.ModelMatrix);
+        setVirtualTextureUniforms(nmShader, planetVT);
+        planetVT.bind(0);
+        environmentLight.bind(3);
+        environmentLight.setUniforms(nmShader, 3);
+        geometry.draw(queued.Mesh);
+        planetVT.unbind(0);
+        break;
+        
+    case DrawMesh:
+        // drawn with the others of its state in flushMeshDraws
+        meshBatchArray = queued.MaterialArray;
+        meshDraws.add(geometry, queued.Mesh, queued.Data);
+        break;
+        
+    case DrawRing:
+        bindRingState();
+        ringCuller.draw();
+        break;
+        
+    case DrawRingChunk:
+        // drawn with the other chunks in flushRingDraws
+        ringDraws.push_back(&queued);
+        break;
+        
+    case DrawSkybox:
+        glState.depthFunc(GL_LEQUAL);
+        skyboxShader.use();
+        glState.bindVertexArray(vao_skybox);
+        residency.touch(skyboxResidency);
+        skyboxTexture.bind(0);
+        glDrawArrays(GL_TRIANGLES, 0, E_skybox);
+        glState.depthFunc(GL_LESS);
+        break;
+    }
+}
 
+// merges the recorded lists, sorts them and replays the draws, meshes and
+// ring chunks that share state as one batch each
+void executeRenderQueue()
+{
+    renderQueue.clear();
+    commandRecorder.merge(renderQueue);
+    renderQueue.sort();
+    meshDraws.clear();
+    ringDraws.clear();
+    for (size_t i = 0; i < renderQueue.size(); i++) {
+        uint32_t type;
+        const QueuedDraw* queued = static_cast<const QueuedDraw*>(commandRecorder.command(renderQueue[i].Payload, type));
+        drawQueued(*queued);
+        if (i + 1 == renderQueue.size() || RenderQueue::stateOf(renderQueue[i + 1].Key) != RenderQueue::stateOf(renderQueue[i].Key)) {
+            flushMeshDraws();
+            flushRingDraws();
+        }
+    }
+    materials.unbind();
+    frameStats.add("queue.draws", (double)renderQueue.size());
+    frameStats.add("queue.command_lists", (double)commandRecorder.listCount());
+    frameStats.add("queue.state_changes", (double)renderQueue.stateChanges());
+}
 
 void paintGL(void)  //always run
 {
@@ -505,100 +1245,162 @@ void paintGL(void)  //always run
     //TODO: do normal mapping
     //TODO: draw the elements
     
-    glm::mat4 modelMatrix = glm::mat4(1.0f);
-    glm::mat4 viewMatrix = camera.GetViewMatrix();
+    glm::mat4 viewMatrix = viewCamera.GetViewMatrix();
     glm::mat4 projectionMatrix = glm::perspective(glm::radians(45.0f), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.5f, 100.0f);
     
+    // camera and lighting, read by every program from one uniform buffer
+    FrameData frame;
+    frame.ViewMatrix = viewMatrix;
+    frame.ProjectionMatrix = projectionMatrix;
+    frame.SkyboxViewMatrix = glm::mat4(glm::mat3(viewMatrix));
+    frame.LightPos = glm::vec4(envLightPos, 1.0f);
+    frame.ViewPos = glm::vec4(viewCamera.Position, 1.0f);
+    frame.LightBrightness = envLightIntensity;
+    frame.Time = currentTime;
+    frameUniforms.update(frame);
+    
+    
+    // where everything is this frame
+    glm::mat4 planetMatrix = glm::mat4(1.0f);
+    planetMatrix = glm::rotate(planetMatrix, glm::radians(-90.f), glm::vec3(1, 0, 0));
+    planetMatrix = glm::rotate(planetMatrix, currentTime * planetRotationSpeed, glm::vec3(0.0f, 0.0f, 1.0f));
+    planetMatrix = glm::translate(planetMatrix, glm::vec3(0, -1.05f, 0));
+    
+    glm::mat4 spacecraftMatrix = glm::mat4(1.0f);
+    glm::vec3 cameraPos = viewCamera.Position - viewCamera.Target;
+    spacecraftMatrix = glm::translate(spacecraftMatrix, cameraPos);
+    spacecraftMatrix = glm::translate(spacecraftMatrix, glm::vec3(0, -1.0f, -1.4f));
+    spacecraftMatrix = glm::scale(spacecraftMatrix, spacecraftScale);
+    
+    glm::mat4 ufoMatrix = glm::mat4(1.0f);
+    ufoMatrix = glm::translate(ufoMatrix, glm::vec3(6.0f, 2.0f, -6.0f));
+    ufoMatrix = glm::scale(ufoMatrix, glm::vec3(0.2f));
+    
+    // and what of it the camera can see; the ring as a whole stays put,
+    // its rocks are moved by their chunks' recording jobs
+    const glm::mat4 objectMatrices[SceneObjectCount] = { planetMatrix, spacecraftMatrix, ufoMatrix, glm::mat4(1.0f) };
+    updateScene(objectMatrices);
+    Frustum viewFrustum = Frustum::fromMatrix(projectionMatrix * viewMatrix);
+    bool visible[SceneObjectCount] = {};
+    std::vector<uint32_t> sceneVisible;
+    sceneBvh.queryFrustum(viewFrustum, sceneVisible);
+    for (uint32_t object : sceneVisible)
+        visible[object] = true;
+    frameStats.add("scene.visible_objects", (double)sceneVisible.size());
+    
+    // and of that, what is not behind the planet
+    bool occluding = occlusionCulling && visible[ScenePlanet];
+    size_t occlusionTested = 0, occlusionCulled = 0;
+    double occlusionMs = 0.0;
+    if (occluding) {
+        double occlusionStart = glfwGetTime();
+        occlusion.begin(projectionMatrix);
+        occlusion.rasterize(viewMatrix * glm::translate(planetMatrix, planetOccluderCentre), planetOccluderVertices, planetOccluderIndices);
+        occlusion.finish();
+        for (int object : { SceneSpacecraft, SceneUfo }) {
+            if (!visible[object])
+                continue;
+            occlusionTested++;
+            glm::vec3 centre = glm::vec3(viewMatrix * glm::vec4(glm::vec3(sceneSpheres[object]), 1.0f));
+            if (!occlusion.sphereVisible(centre, sceneSpheres[object].w)) {
+                visible[object] = false;
+                occlusionCulled++;
+            }
+        }
+        occlusionMs += (glfwGetTime() - occlusionStart) * 1000.0;
+    }
     
-    // Planet
-    glBindVertexArray(vao[0]);
-    
-    modelMatrix = glm::mat4(1.0f);
-    modelMatrix = glm::rotate(modelMatrix, glm::radians(-90.f), glm::vec3(1, 0, 0));
-    modelMatrix = glm::rotate(modelMatrix, currentTime * planetRotationSpeed, glm::vec3(0.0f, 0.0f, 1.0f));
-    modelMatrix = glm::translate(modelMatrix, glm::vec3(0, -1.05f, 0));
-    
-    nmShader.use();
-    nmShader.setMat4("viewMatrix", viewMatrix);
-    nmShader.setMat4("projectionMatrix", projectionMatrix);
-    nmShader.setMat4("modelMatrix", modelMatrix);
-    nmShader.setVec3("lightPos", envLightPos);
-    nmShader.setVec3("viewPos", camera.Position);
-    nmShader.setFloat("dirlightBrightness", envLightIntensity);
-    
-    planetTexture.bind(0);
-    planetNormal.bind(1);
-    nmShader.setInt("texColour", 0);
-    nmShader.setInt("texNorm", 1);
-    glDrawElements(GL_TRIANGLES, (GLsizei)planet.indices.size(), GL_UNSIGNED_INT, 0);
-    planetTexture.unbind();
-    planetNormal.unbind();
-    
-    
-    shader.use();
-    shader.setMat4("viewMatrix", viewMatrix);
-    shader.setMat4("projectionMatrix", projectionMatrix);
-    
-    // Spacecraft
-    glBindVertexArray(vao[1]);
-    
-    modelMatrix = glm::mat4(1.0f);
-    glm::vec3 cameraPos = camera.Position - camera.Target;
-    modelMatrix = glm::translate(modelMatrix, cameraPos);
-    modelMatrix = glm::translate(modelMatrix, glm::vec3(0, -1.0f, -1.4f));
-    modelMatrix = glm::scale(modelMatrix, spacecraftScale);
-    shader.setMat4("modelMatrix", modelMatrix);
-    
-    spacecraftTexture.bind(0);
-    shader.setInt("tex1", 0);
-    glDrawElements(GL_TRIANGLES, (GLsizei)spacecraft.indices.size(), GL_UNSIGNED_INT, 0);
-    spacecraftTexture.unbind();
+    // levels of detail go by the pixels each level's error would cover
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    LodView lodView = LodView::fromProjection(projectionMatrix, viewport[3]);
+    glm::vec3 eye = glm::vec3(glm::inverse(viewMatrix)[3]);
+    double lodTriangles[LodMaxLevels] = {};
     
     
     // Astroids
-    glBindVertexArray(vao[2]);
-    
-    modelMatrix = glm::mat4(1.0f);
-    modelMatrix = glm::rotate(modelMatrix, currentTime * planetRotationSpeed, glm::vec3(0.0f, 1.0f, 0.0f));
-    glm::mat4 modelMatrixTemp;
-    
-    for (int i = 0; i < rockCount; i++) {
-        modelMatrixTemp = modelMatrices[i];
-        modelMatrixTemp = modelMatrix * modelMatrixTemp;
-        shader.setMat4("modelMatrix", modelMatrixTemp);
-        
-        rockTexture.bind(0);
-        shader.setInt("tex1", 0);
-        glDrawElements(GL_TRIANGLES, (GLsizei)rock.indices.size(), GL_UNSIGNED_INT, 0);
-        rockTexture.unbind();
+    const LodChain& rockChain = meshLods[SceneRing];
+    size_t ringVisibleCount = 0;
+    if (gpuCulling) {
+        // what the GPU drew last frame, the only thing that comes back
+        std::vector<size_t> levelCounts;
+        ringVisibleCount = ringCuller.reportStats(&levelCounts);
+        for (size_t level = 0; level < levelCounts.size(); level++)
+            lodTriangles[level] += (double)levelCounts[level] * rockChain.Triangles[level];
     }
     
     
-    // Ufo
-    glBindVertexArray(vao[3]);
-    
-    modelMatrix = glm::mat4(1.0f);
-    modelMatrix = glm::translate(modelMatrix, glm::vec3(6.0f, 2.0f, -6.0f));
-    modelMatrix = glm::scale(modelMatrix, glm::vec3(0.2f));
-    shader.setMat4("modelMatrix", modelMatrix);
-    
-    ufoTexture.bind(0);
-    shader.setInt("tex1", 0);
-    glDrawElements(GL_TRIANGLES, (GLsizei)ufo.indices.size(), GL_UNSIGNED_INT, 0);
-    ufoTexture.unbind();
-    
-    
-    // Skybox
-    glDepthFunc(GL_LEQUAL);
-    skyboxShader.use();
-    viewMatrix = glm::mat4(glm::mat3(viewMatrix));
-    skyboxShader.setMat4("view", viewMatrix);
-    skyboxShader.setMat4("projection", projectionMatrix);
-    glBindVertexArray(vao_skybox);
-    skyboxTexture.bind(0);
-    glDrawArrays(GL_TRIANGLES, 0, E_skybox);
-    glDepthFunc(GL_LESS);
+    // every object picks its level of detail and records its draws, and
+    // every resident chunk of the ring moves, culls and records its rocks,
+    // on whichever thread takes it; the lists are merged, sorted and
+    // replayed here
+    FrameRecording recording;
+    for (int object = 0; object < SceneObjectCount; object++) {
+        recording.Matrices[object] = objectMatrices[object];
+        recording.Visible[object] = visible[object];
+    }
+    recording.Visible[SceneRing] = gpuCulling && visible[SceneRing];
+    recording.Eye = eye;
+    recording.Lod = lodView;
+    // getting a variant may build it, which only this thread can do
+    recording.MeshProgram = meshShaders.get(meshBatchFeatures).program();
+    recording.RingProgram = meshShaders.get(MeshEnvLighting | MeshInstanced).program();
+    recording.RingFrustum = viewFrustum;
+    recording.ViewMatrix = viewMatrix;
+    recording.Occluding = occluding;
+    recording.NearPoint = glm::vec3(sceneSpheres[SceneSpacecraft]);
+    recording.NearDistance = sceneSpheres[SceneSpacecraft].w + 1.0f;
+    prepareRocks(recording, visible[SceneRing]);
+    
+    double recordStart = glfwGetTime();
+    commandRecorder.begin();
+    parallelFor(SceneJobCount + asteroidBelt.residentChunks(), 1, [&](size_t begin, size_t end) {
+        CommandList& commands = commandRecorder.local();
+        for (size_t job = begin; job < end; job++) {
+            if (job < (size_t)SceneJobCount)
+                recordObject((int)job, recording, commands);
+            else
+                recordRingChunk(job - SceneJobCount, recording, commands);
+        }
+    });
+    frameStats.add("record.ms", (glfwGetTime() - recordStart) * 1000.0);
+    finishRocks();
+    
+    // culled on the GPU against where the rocks are this frame
+    if (gpuCulling && visible[SceneRing]) {
+        double cullStart = glfwGetTime();
+        ringCuller.cull(viewMatrix, projectionMatrix, viewport[2], viewport[3], lodSettings);
+        frameStats.add("cull.ms", (glfwGetTime() - cullStart) * 1000.0);
+    }
     
+    // and what the chunks found
+    size_t rocksNearSpacecraft = 0;
+    for (const RingChunkStats& stats : ringChunkStats) {
+        rocksNearSpacecraft += stats.Near;
+        occlusionTested += stats.Tested;
+        occlusionCulled += stats.Hidden;
+        for (int level = 0; level < rockChain.levels(); level++) {
+            ringVisibleCount += stats.Levels[level];
+            lodTriangles[level] += (double)stats.Levels[level] * rockChain.Triangles[level];
+        }
+    }
+    frameStats.add("scene.rocks_near_spacecraft", (double)rocksNearSpacecraft);
+    frameStats.add("occlusion.ms", occlusionMs);
+    frameStats.add("occlusion.culled_pct", occlusionTested > 0 ? 100.0 * occlusionCulled / occlusionTested : 0.0);
+    frameStats.add("ring.instances", (double)asteroidBelt.residentRocks());
+    frameStats.add("ring.visible", (double)ringVisibleCount);
+    
+    for (int object : { ScenePlanet, SceneSpacecraft, SceneUfo })
+        if (visible[object])
+            lodTriangles[objectLods[object]] += meshLods[object].Triangles[objectLods[object]];
+    for (int level = 0; level < LodMaxLevels; level++)
+        frameStats.add("lod.triangles_l" + std::to_string(level), lodTriangles[level]);
+    
+    executeRenderQueue();
+    
+    // this frame's depth is what the next one culls against
+    if (gpuCulling)
+        ringCuller.captureDepth(viewMatrix, viewport[2], viewport[3]);
 }
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
@@ -624,6 +1426,11 @@ void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
     if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_RELEASE) {
         mouseCtrl.LEFT_BUTTON = false;
     }
+    if (button == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_PRESS) {
+        double x, y;
+        glfwGetCursorPos(window, &x, &y);
+        pickObject(x, y);
+    }
 }
 
 void cursor_position_callback(GLFWwindow* window, double x, double y)
@@ -633,7 +1440,8 @@ void cursor_position_callback(GLFWwindow* window, double x, double y)
     if (mouseCtrl.LEFT_BUTTON) {
         float xoffset = x - mouseCtrl.MOUSE_X;
         float yoffset = y - mouseCtrl.MOUSE_Y;
-        camera.ProcessMouseMovement_Left(xoffset, yoffset);
+        InputEvent event = { InputEvent::Drag, 0, xoffset, yoffset };
+        inputEvents.push(event);
     }
     mouseCtrl.MOUSE_X = x;
     mouseCtrl.MOUSE_Y = y;
@@ -652,30 +1460,78 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
     // Key Press
     if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
         glfwSetWindowShouldClose(window, true);
-    if (key == GLFW_KEY_W && action == GLFW_PRESS)
-        keyCtrl.W_KEY = true;
-    if (key == GLFW_KEY_S && action == GLFW_PRESS)
-        keyCtrl.S_KEY = true;
-    if (key == GLFW_KEY_A && action == GLFW_PRESS)
-        keyCtrl.A_KEY = true;
-    if (key == GLFW_KEY_D && action == GLFW_PRESS)
-        keyCtrl.D_KEY = true;
-    
-    
-    // Key Release
-    if (key == GLFW_KEY_W && action == GLFW_RELEASE)
-        keyCtrl.W_KEY = false;
-    if (key == GLFW_KEY_S && action == GLFW_RELEASE)
-        keyCtrl.S_KEY = false;
-    if (key == GLFW_KEY_A && action == GLFW_RELEASE)
-        keyCtrl.A_KEY = false;
-    if (key == GLFW_KEY_D && action == GLFW_RELEASE)
-        keyCtrl.D_KEY = false;
+    
+    // the rest is the simulation's, presses and releases go to its thread
+    if (action == GLFW_PRESS || action == GLFW_RELEASE) {
+        InputEvent event = { action == GLFW_PRESS ? InputEvent::KeyDown : InputEvent::KeyUp, key, 0.0f, 0.0f };
+        inputEvents.push(event);
+    }
 }
 
 
 int main(int argc, char* argv[])
 {
+	// --headless <frames>: render offscreen, print stats and exit
+	// --vram-budget <MB>: cap on tracked GPU memory, textures shed mip levels to stay under it
+	// --rocks <count>: asteroids in the ring
+	// --ring-distance <units>: generate the ring only that near the camera
+	// --bench-cull <count>: time frustum culling of that many spheres and exit
+	// --no-occlusion: draw what is behind the planet too
+	// --lod-error <pixels>: screen-space error each level of detail may show, 0 keeps full detail
+	// --gpu-cull: cull the ring in a compute pass and draw it indirectly (OpenGL 4.3)
+	// --bench-queue <count>: time the render queue sorting that many draws and exit
+	// --bench-orbits <count>: time moving that many rocks along their orbits and exit
+	// --bench-ring <count>: time generating a ring of that many rocks and exit
+	// --bake-normal <heightmap> <out.dds> [--strength <s>] [--flat]: bake a normal map and exit
+	if (!simdSupported()) {
+		std::cout << "This build needs a CPU with AVX2 and FMA" << std::endl;
+		return -1;
+	}
+	long headlessFrames = 0;
+	NormalBakeSettings bake;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc)
+			headlessFrames = atol(argv[++i]);
+		else if (strcmp(argv[i], "--vram-budget") == 0 && i + 1 < argc)
+			residency.Budget = (size_t)(atof(argv[++i]) * 1024.0 * 1024.0);
+		else if (strcmp(argv[i], "--rocks") == 0 && i + 1 < argc)
+			rockCount = std::max(0, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--ring-distance") == 0 && i + 1 < argc)
+			ringStreamDistance = std::max(0.0f, (float)atof(argv[++i]));
+		else if (strcmp(argv[i], "--no-occlusion") == 0)
+			occlusionCulling = false;
+		else if (strcmp(argv[i], "--lod-error") == 0 && i + 1 < argc)
+			lodSettings.PixelError = std::max(0.0f, (float)atof(argv[++i]));
+		else if (strcmp(argv[i], "--gpu-cull") == 0)
+			gpuCulling = true;
+		else if (strcmp(argv[i], "--bench-cull") == 0 && i + 1 < argc) {
+			benchmarkCulling((size_t)atol(argv[++i]));
+			return 0;
+		}
+		else if (strcmp(argv[i], "--bench-queue") == 0 && i + 1 < argc) {
+			benchmarkRenderQueue((size_t)atol(argv[++i]));
+			return 0;
+		}
+		else if (strcmp(argv[i], "--bench-orbits") == 0 && i + 1 < argc) {
+			benchmarkOrbits((size_t)atol(argv[++i]));
+			return 0;
+		}
+		else if (strcmp(argv[i], "--bench-ring") == 0 && i + 1 < argc) {
+			benchmarkBelt((size_t)atol(argv[++i]));
+			return 0;
+		}
+		else if (strcmp(argv[i], "--bake-normal") == 0 && i + 2 < argc) {
+			bake.HeightPath = argv[++i];
+			bake.OutputPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--strength") == 0 && i + 1 < argc)
+			bake.Strength = (float)atof(argv[++i]);
+		else if (strcmp(argv[i], "--flat") == 0)
+			bake.Spherical = false;
+	}
+	if (!bake.HeightPath.empty())
+		return bakeNormalMap(bake) ? 0 : 1;
+
 	/* Initialize the glfw */
 	if (!glfwInit()) {
 		std::cout << "Failed to initialize GLFW" << std::endl;
@@ -689,6 +1545,8 @@ int main(int argc, char* argv[])
 #ifdef __APPLE__
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 #endif
+	if (headlessFrames > 0)
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
 
 	/* Create a windowed mode window and its OpenGL context */
 	GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "HW3", NULL, NULL);
@@ -716,22 +1574,58 @@ int main(int argc, char* argv[])
     get_OpenGL_info();
 	initializedGL();
 
+    // the first snapshot comes before the thread, so no frame sees an empty one
+    simStartTime = glfwGetTime();
+    simState = { camera.R, camera.Theta, camera.Phi, simStartTime };
+    simSnapshots.back().Previous = simSnapshots.back().Current = simState;
+    simSnapshots.back().CurrentAt = FixedStepThread::now();
+    simSnapshots.publish();
+    simulation.start(SimulationStep, simulationStep);
+    
+    long frameCount = 0;
+    double lastFrame = glfwGetTime();
+    double lastPrint = lastFrame;
 	while (!glfwWindowShouldClose(window)) {
         //TODO: Get time information to make the planet, rocks and crafts moving across time
         //Hints: the function to get time -> float currentTIme = static_cast<float>(glfwGetTime());
-        currentTime = static_cast<float>(glfwGetTime());
-        camera.ProcessKeyPress();
+        interpolateSimulation();
+        residency.beginFrame();
+        uploadRing.beginFrame();
         
 		/* Render here */
 		paintGL();
+        uploadRing.endFrame();
 
 		/* Swap front and back buffers */
 		glfwSwapBuffers(window);
 
 		/* Poll for and process events */
 		glfwPollEvents();
+        
+        double now = glfwGetTime();
+        Shader::reportStats();
+        glState.reportStats();
+        uploadRing.reportStats();
+        asteroidBelt.reportStats();
+        frameStats.endFrame(now - lastFrame);
+        lastFrame = now;
+        if (headlessFrames > 0 && ++frameCount >= headlessFrames)
+            break;
+        if (headlessFrames == 0 && now - lastPrint > 5.0) {
+            residency.reportStats();
+            frameStats.print(std::cout);
+            frameStats.reset();
+            lastPrint = now;
+        }
 	}
+    
+    if (headlessFrames > 0) {
+        residency.reportStats();
+        frameStats.print(std::cout);
+    }
 
+    simulation.stop();
+    planetVT.release();
 	glfwTerminate();
 	return 0;
 }
@@ -10,23 +10,65 @@ in VS_OUT {
     vec3 TangentLightPos;
     vec3 TangentViewPos;
     vec3 TangentFragPos;
+    mat3 WorldTBN;
 } fs_in;
 
+// virtual texture: indirection table plus the physical page caches
+uniform sampler2D vtIndirection;
 uniform sampler2D texColour;
 uniform sampler2D texNorm;
 
-uniform float dirlightBrightness;
+uniform vec2 vtPages;
+uniform vec2 vtUVScale;
+uniform float vtMaxLevel;
+uniform float vtPageSize;
+uniform float vtBorder;
+uniform float vtCacheSlots;
+
+#include "frame.glsl"
+
+// image-based ambient: SH irradiance plus a prefiltered specular cubemap,
+// rougher towards the last mip
+#include "lighting.glsl"
+uniform samplerCube envSpecular;
+uniform float envSpecularMaxLod;
+
+const float glossLod = 1.0;
+
+// translate a virtual uv into the physical cache through the indirection table
+vec2 virtualToPhysical(vec2 uv)
+{
+    vec2 vuv = clamp(uv, 0.0, 1.0) * vtUVScale;
+    vec2 texel = vuv * vtPages * vtPageSize;
+    vec2 dx = dFdx(texel);
+    vec2 dy = dFdy(texel);
+    float lod = 0.5 * log2(max(max(dot(dx, dx), dot(dy, dy)), 1e-8));
+    int level = int(clamp(floor(lod), 0.0, vtMaxLevel));
+
+    ivec2 levelPages = max(ivec2(vtPages) >> level, ivec2(1));
+    ivec2 page = min(ivec2(vuv * vec2(levelPages)), levelPages - 1);
+    vec3 entry = floor(texelFetch(vtIndirection, page, level).rgb * 255.0 + 0.5);
+
+    // the resident page may be coarser than the one asked for
+    vec2 pageCoord = vuv * vtPages / exp2(entry.b);
+    vec2 inner = clamp(pageCoord - floor(pageCoord), 0.0, 1.0);
+    float stride = vtPageSize + 2.0 * vtBorder;
+    return (entry.rg * stride + vtBorder + inner * vtPageSize) / (vtCacheSlots * stride);
+}
 
 void main()
 {
     //TODO: Implement the normal mapping
     //TODO: Implement the Phong Illumination
     
-    vec3 normal = texture(texNorm, fs_in.TexCoords).rgb;
+    vec2 physicalUV = virtualToPhysical(fs_in.TexCoords);
+    
+    vec3 normal = textureLod(texNorm, physicalUV, 0.0).rgb;
     normal = normalize(normal * 2.0 - 1.0);
     
-    vec3 colour = texture(texColour, fs_in.TexCoords).rgb;
-    vec3 ambient = 0.3 * colour;
+    vec3 colour = textureLod(texColour, physicalUV, 0.0).rgb;
+    vec3 worldNormal = normalize(fs_in.WorldTBN * normal);
+    vec3 ambient = irradianceSH(worldNormal) * colour;
     
     vec3 lightDir = normalize(fs_in.TangentLightPos - fs_in.TangentFragPos);
     float diff = max(dot(lightDir, normal), 0.0);
@@ -38,6 +80,10 @@ void main()
     float spec = pow(max(dot(normal, halfwayDir), 0.0), 32.0);
     vec3 specular = vec3(0.2) * spec;
     
+    vec3 worldView = normalize(viewPos.xyz - fs_in.FragPos);
+    vec3 envReflect = reflect(-worldView, worldNormal);
+    specular += 0.2 * textureLod(envSpecular, envReflect, min(glossLod, envSpecularMaxLod)).rgb;
+    
     FragColor = vec4(ambient + diffuse + specular, 1.0);
 }
 
@@ -14,14 +14,12 @@ out VS_OUT {
     vec3 TangentLightPos;
     vec3 TangentViewPos;
     vec3 TangentFragPos;
+    mat3 WorldTBN;
 } vs_out;
 
 uniform mat4 modelMatrix;
-uniform mat4 viewMatrix;
-uniform mat4 projectionMatrix;
 
-uniform vec3 lightPos;
-uniform vec3 viewPos;
+#include "frame.glsl"
 
 void main()
 {
@@ -36,9 +34,10 @@ void main()
     T = normalize(T - dot(T, N) * N);
     vec3 B = cross(N, T);
     
-    mat3 TBN = transpose(mat3(T, B, N));
-    vs_out.TangentLightPos = TBN * lightPos;
-    vs_out.TangentViewPos = TBN * viewPos;
+    vs_out.WorldTBN = mat3(T, B, N);
+    mat3 TBN = transpose(vs_out.WorldTBN);
+    vs_out.TangentLightPos = TBN * lightPos.xyz;
+    vs_out.TangentViewPos = TBN * viewPos.xyz;
     vs_out.TangentFragPos = TBN * vs_out.FragPos;
     
     gl_Position = projectionMatrix * viewMatrix * vec4(vs_out.FragPos, 1.0);
@@ -3,12 +3,11 @@ layout (location = 0) in vec3 aPos;
 
 out vec3 TexCoords;
 
-uniform mat4 projection;
-uniform mat4 view;
+#include "frame.glsl"
 
 void main()
 {
     TexCoords = aPos;
-    vec4 pos = projection * view * vec4(aPos, 1.0);
+    vec4 pos = projectionMatrix * skyboxViewMatrix * vec4(aPos, 1.0);
     gl_Position = pos.xyww;
 }  
\ No newline at end of file
@@ -1,5 +1,10 @@
 #version 330 core
 
+#ifdef MULTI_DRAW
+#extension GL_ARB_shader_draw_parameters : require
+#extension GL_ARB_shader_storage_buffer_object : require
+#endif
+
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec2 aUV;
 layout (location = 2) in vec3 aNorm;
@@ -8,16 +13,47 @@ out vec2 oUV;
 out vec3 oNorm;
 out vec3 FragPos;
 
+#ifdef INSTANCED
+// one rock per instance, each on its own orbit. Instances are the survivors
+// of culling, each carries the index of its rock's matrix, stored as its top
+// 3 rows. Location 3 is the pool's tangent.
+layout (location = 4) in uint aInstance;
+uniform samplerBuffer instanceMatrices;
+#elif defined(MULTI_DRAW)
+// one entry per command of the DrawBatch, mirrors DrawData
+struct DrawData {
+    mat4 modelMatrix;
+    ivec4 material;  // x = layer
+};
+layout (std430) readonly buffer DrawDataBlock {
+    DrawData draws[];
+};
+flat out int oLayer;
+#else
 uniform mat4 modelMatrix;
-uniform mat4 viewMatrix;
-uniform mat4 projectionMatrix;
+#endif
+
+#include "frame.glsl"
 
 
 void main()
 {
-    FragPos = vec3(modelMatrix * vec4(aPos, 1.0));
+#ifdef INSTANCED
+    int texel = int(aInstance) * 3;
+    mat4 model = transpose(mat4(texelFetch(instanceMatrices, texel), texelFetch(instanceMatrices, texel + 1),
+                                texelFetch(instanceMatrices, texel + 2), vec4(0.0, 0.0, 0.0, 1.0)));
+    // instances are only scaled uniformly, the fragment shader renormalizes
+    oNorm = mat3(model) * aNorm;
+#elif defined(MULTI_DRAW)
+    mat4 model = draws[gl_DrawIDARB].modelMatrix;
+    oLayer = draws[gl_DrawIDARB].material.x;
+    oNorm = mat3(transpose(inverse(model))) * aNorm;
+#else
+    mat4 model = modelMatrix;
+    oNorm = mat3(transpose(inverse(modelMatrix))) * aNorm;
+#endif
+    FragPos = vec3(model * vec4(aPos, 1.0));
     oUV = aUV;
-    oNorm = aNorm;
 
     gl_Position = projectionMatrix * viewMatrix * vec4(FragPos, 1.0); 
 }
@@ -0,0 +1,35 @@
+#version 330 core
+
+// Virtual texture feedback: writes the page and level every pixel needs.
+// Rendered at a fraction of the screen size, vtLodBias compensates for that.
+
+out uvec4 FragColor;
+
+in VS_OUT {
+    vec3 FragPos;
+    vec2 TexCoords;
+    vec3 TangentLightPos;
+    vec3 TangentViewPos;
+    vec3 TangentFragPos;
+    mat3 WorldTBN;
+} fs_in;
+
+uniform vec2 vtPages;
+uniform vec2 vtUVScale;
+uniform float vtMaxLevel;
+uniform float vtPageSize;
+uniform float vtLodBias;
+
+void main()
+{
+    vec2 vuv = clamp(fs_in.TexCoords, 0.0, 1.0) * vtUVScale;
+    vec2 texel = vuv * vtPages * vtPageSize;
+    vec2 dx = dFdx(texel);
+    vec2 dy = dFdy(texel);
+    float lod = 0.5 * log2(max(max(dot(dx, dx), dot(dy, dy)), 1e-8)) - vtLodBias;
+    int level = int(clamp(floor(lod), 0.0, vtMaxLevel));
+
+    ivec2 levelPages = max(ivec2(vtPages) >> level, ivec2(1));
+    ivec2 page = min(ivec2(vuv * vec2(levelPages)), levelPages - 1);
+    FragColor = uvec4(uvec2(page), uint(level), 1u);
+}